@@ -0,0 +1,527 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <ftw.h>
+
+#include "lib_tar.h"
+
+/**
+ * Benchmark of lib_tar on synthetic archives.
+ *
+ * The archive is generated with a given number of members spread over a tree of directories, each member having a
+ * size drawn between a minimum and a maximum. Every API is then timed, reporting its throughput, the median and
+ * 99th percentile latency of a call and the number of system calls per call. System calls are counted by wrapping
+ * them at link time, see the bench target of the Makefile.
+ */
+
+#define BLOCK 512
+
+struct options {
+    size_t no_members;
+    size_t min_size;
+    size_t max_size;
+    int depth;          // levels of directories under the root
+    int fanout;         // subdirectories per directory
+    size_t no_queries;  // calls timed for each lookup function
+    const char *archive;
+    int keep;
+    int stats;          // also collect the statistics of the library and print them at the end
+    int io_engine;      // TAR_IO_* given to tar_set_io_engine()
+};
+
+/**
+ * System calls made by the library, counted by the __wrap_* functions below.
+ * The library is built with _FILE_OFFSET_BITS=64, so glibc resolves the calls taking an offset to their *64 symbol.
+ */
+static unsigned long no_syscalls;
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_pread64(int fd, void *buf, size_t count, off_t offset);
+off_t __real_lseek64(int fd, off_t offset, int whence);
+int __real_fstat64(int fd, struct stat *st);
+void *__real_mmap64(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void *addr, size_t len);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    no_syscalls++;
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_pread64(int fd, void *buf, size_t count, off_t offset) {
+    no_syscalls++;
+    return __real_pread64(fd, buf, count, offset);
+}
+
+off_t __wrap_lseek64(int fd, off_t offset, int whence) {
+    no_syscalls++;
+    return __real_lseek64(fd, offset, whence);
+}
+
+int __wrap_fstat64(int fd, struct stat *st) {
+    no_syscalls++;
+    return __real_fstat64(fd, st);
+}
+
+void *__wrap_mmap64(void *addr, size_t len, int prot, int flags, int fd, off_t offset) {
+    no_syscalls++;
+    return __real_mmap64(addr, len, prot, flags, fd, offset);
+}
+
+int __wrap_munmap(void *addr, size_t len) {
+    no_syscalls++;
+    return __real_munmap(addr, len);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift, rand() is too slow and too short for millions of members */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* Writes a ustar header with a valid checksum */
+static void write_header(FILE *out, const char *name, uint64_t size, char typeflag) {
+    tar_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.name, name, strnlen(name, sizeof(hdr.name)));
+    snprintf(hdr.mode, sizeof(hdr.mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(hdr.uid, sizeof(hdr.uid), "%07o", 1000);
+    snprintf(hdr.gid, sizeof(hdr.gid), "%07o", 1000);
+    snprintf(hdr.size, sizeof(hdr.size), "%011llo", (unsigned long long) size);
+    snprintf(hdr.mtime, sizeof(hdr.mtime), "%011o", 1700000000);
+    hdr.typeflag = typeflag;
+    memcpy(hdr.magic, TMAGIC, TMAGLEN);
+    memcpy(hdr.version, TVERSION, TVERSLEN);
+    memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(hdr); i++) {
+        sum += ((unsigned char *) &hdr)[i];
+    }
+    snprintf(hdr.chksum, sizeof(hdr.chksum), "%06o", sum);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+}
+
+/* Path of the directory a member goes into, directory i of the last level */
+static void dir_path(const struct options *opt, size_t i, char *path) {
+    path[0] = '\0';
+    for (int level = 0; level < opt->depth; level++) {
+        size_t digit = i;
+        for (int j = level + 1; j < opt->depth; j++) {
+            digit /= opt->fanout;
+        }
+        sprintf(path + strlen(path), "d%zu/", digit % opt->fanout);
+    }
+}
+
+/**
+ * Generates the archive, returning the paths of its members in members and the ones of its directories in dirs.
+ */
+static int generate(const struct options *opt, char ***members, char ***dirs, size_t *no_dirs) {
+    FILE *out = fopen(opt->archive, "w");
+    if (out == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    size_t leaves = 1;
+    for (int level = 0; level < opt->depth; level++) {
+        leaves *= opt->fanout;
+    }
+    *no_dirs = 0;
+    *dirs = malloc(sizeof(char *) * (leaves * 2 + 1));
+    *members = malloc(sizeof(char *) * opt->no_members);
+
+    uint8_t *data = malloc(opt->max_size ? opt->max_size : 1);
+    uint64_t state = 42;
+    for (size_t i = 0; i < opt->max_size; i++) {
+        data[i] = next_random(&state);
+    }
+    static const uint8_t zeros[BLOCK];
+    char path[512], prev[512] = "";
+
+    for (size_t i = 0; i < opt->no_members; i++) {
+        // Members are spread evenly over the directories of the last level, in order
+        dir_path(opt, i * leaves / opt->no_members, path);
+        if (strcmp(path, prev) != 0) {
+            // Headers of the directories not written yet, from the top
+            for (char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+                size_t len = slash - path + 1;
+                if (strncmp(path, prev, len) == 0) {
+                    continue;
+                }
+                char dir[512];
+                memcpy(dir, path, len);
+                dir[len] = '\0';
+                write_header(out, dir, 0, DIRTYPE);
+                (*dirs)[(*no_dirs)++] = strdup(dir);
+            }
+            strcpy(prev, path);
+        }
+
+        uint64_t size = opt->min_size;
+        if (opt->max_size > opt->min_size) {
+            size += next_random(&state) % (opt->max_size - opt->min_size + 1);
+        }
+        sprintf(path + strlen(path), "f%zu", i);
+        write_header(out, path, size, REGTYPE);
+        fwrite(data, 1, size, out);
+        fwrite(zeros, 1, (BLOCK - size % BLOCK) % BLOCK, out);
+        (*members)[i] = strdup(path);
+    }
+    fwrite(zeros, 1, BLOCK, out);
+    fwrite(zeros, 1, BLOCK, out);
+    free(data);
+    return fclose(out);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Prints a line of results.
+ *
+ * @param lat The latency of each call in nanoseconds, sorted in place.
+ * @param bytes The number of bytes processed by all the calls, zero if a throughput makes no sense.
+ */
+static void report(const char *name, uint64_t *lat, size_t calls, uint64_t bytes, unsigned long syscalls) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < calls; i++) {
+        total += lat[i];
+    }
+    qsort(lat, calls, sizeof(uint64_t), compare_u64);
+    double secs = total / 1e9;
+    printf("%-24s %10zu %12.3f %14.0f %10.1f %12.2f %12.2f %10.2f\n", name, calls, secs * 1e3,
+           secs > 0 ? calls / secs : 0, secs > 0 && bytes ? bytes / secs / 1e6 : 0,
+           lat[calls / 2] / 1e3, lat[calls * 99 / 100] / 1e3, (double) syscalls / calls);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+/* Prints the counters of the library for every group of functions */
+static void print_stats(void) {
+    tar_stats_t stats;
+    tar_stats_snapshot(&stats);
+    printf("\n%-14s %10s %12s %10s %10s %14s %14s %10s\n", "group", "calls", "headers", "preads", "ring_reads",
+           "bytes_read", "bytes_skipped", "p99_us");
+    for (int op = 0; op < TAR_NO_OPS; op++) {
+        const tar_op_stats_t *s = &stats.ops[op];
+        // Upper bound of the bucket holding the 99th percentile
+        uint64_t seen = 0;
+        int bucket = 0;
+        while (bucket < TAR_HIST_BUCKETS - 1 && (seen += s->latency[bucket]) * 100 < s->calls * 99) {
+            bucket++;
+        }
+        printf("%-14s %10llu %12llu %10llu %10llu %14llu %14llu %10.2f\n", tar_op_name(op),
+               (unsigned long long) s->calls, (unsigned long long) s->headers, (unsigned long long) s->preads,
+               (unsigned long long) s->ring_reads,
+               (unsigned long long) s->bytes_read, (unsigned long long) s->bytes_skipped,
+               s->calls ? (2ULL << bucket) / 1e3 : 0);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n members] [-s min_size:max_size] [-d depth] [-w fanout] [-q queries] "
+                    "[-o archive] [-k] [-S] [-u]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    struct options opt = { 10000, 0, 4096, 3, 8, 100000, "/tmp/lib_tar_bench.tar", 0, 0, TAR_IO_DEFAULT };
+    int c;
+    while ((c = getopt(argc, argv, "n:s:d:w:q:o:kSu")) != -1) {
+        switch (c) {
+            case 'n': opt.no_members = strtoull(optarg, NULL, 10); break;
+            case 's': sscanf(optarg, "%zu:%zu", &opt.min_size, &opt.max_size); break;
+            case 'd': opt.depth = atoi(optarg); break;
+            case 'w': opt.fanout = atoi(optarg); break;
+            case 'q': opt.no_queries = strtoull(optarg, NULL, 10); break;
+            case 'o': opt.archive = optarg; break;
+            case 'k': opt.keep = 1; break;
+            case 'S': opt.stats = 1; break;
+            case 'u': opt.io_engine = TAR_IO_URING; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (opt.no_members == 0 || opt.min_size > opt.max_size || opt.depth < 0 || opt.fanout < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char **members, **dirs;
+    size_t no_dirs;
+    uint64_t start = now_ns();
+    if (generate(&opt, &members, &dirs, &no_dirs) != 0) {
+        return 1;
+    }
+    int fd = open(opt.archive, O_RDONLY);
+    struct stat st;
+    fstat(fd, &st);
+    printf("archive %s: %zu members, %zu directories, %.1f MB, generated in %.1f ms\n\n", opt.archive,
+           opt.no_members, no_dirs, st.st_size / 1e6, (now_ns() - start) / 1e6);
+    printf("%-24s %10s %12s %14s %10s %12s %12s %10s\n", "function", "calls", "total_ms", "ops/s", "MB/s",
+           "p50_us", "p99_us", "sys/call");
+
+    tar_stats_enable(opt.stats);
+    if (tar_set_io_engine(opt.io_engine) == -1) {
+        fprintf(stderr, "io_uring is not available, the archive is read with pread()\n");
+    }
+    size_t q = opt.no_queries;
+    uint64_t *lat = malloc(sizeof(uint64_t) * (q > opt.no_members ? q : opt.no_members));
+    uint8_t *buf = malloc(1 << 20);
+    uint64_t state = 7;
+    unsigned long sys;
+    uint64_t bytes;
+
+    // Archive walks
+    sys = no_syscalls;
+    start = now_ns();
+    check_archive(fd);
+    lat[0] = now_ns() - start;
+    report("check_archive", lat, 1, st.st_size, no_syscalls - sys);
+
+    sys = no_syscalls;
+    start = now_ns();
+    tar_archive_t *ar = tar_open(fd);
+    lat[0] = now_ns() - start;
+    report("tar_open", lat, 1, st.st_size, no_syscalls - sys);
+
+    // Lookups, the first fd-based call indexes the archive and is timed on its own
+    sys = no_syscalls;
+    start = now_ns();
+    exists(fd, members[0]);
+    lat[0] = now_ns() - start;
+    report("exists (first call)", lat, 1, 0, no_syscalls - sys);
+
+    const char *names[] = { "exists", "is_file", "is_dir", "is_symlink" };
+    int (*lookups[])(int, char *) = { exists, is_file, is_dir, is_symlink };
+    for (int f = 0; f < 4; f++) {
+        sys = no_syscalls;
+        for (size_t i = 0; i < q; i++) {
+            char *path = f == 2 ? dirs[next_random(&state) % (no_dirs ? no_dirs : 1)]
+                                : members[next_random(&state) % opt.no_members];
+            start = now_ns();
+            lookups[f](fd, path);
+            lat[i] = now_ns() - start;
+        }
+        report(names[f], lat, q, 0, no_syscalls - sys);
+    }
+
+    sys = no_syscalls;
+    for (size_t i = 0; i < q; i++) {
+        char *path = members[next_random(&state) % opt.no_members];
+        start = now_ns();
+        tar_lookup(ar, path);
+        lat[i] = now_ns() - start;
+    }
+    report("tar_lookup", lat, q, 0, no_syscalls - sys);
+
+    size_t batch = q < opt.no_members ? q : opt.no_members;
+    tar_stat_t *results = malloc(sizeof(tar_stat_t) * batch);
+    sys = no_syscalls;
+    start = now_ns();
+    tar_lookup_batch(fd, members, batch, results);
+    lat[0] = now_ns() - start;
+    report("tar_lookup_batch", lat, 1, st.st_size, no_syscalls - sys);
+    free(results);
+
+    // Listings of every directory
+    if (no_dirs > 0) {
+        size_t cap = opt.no_members + opt.fanout;
+        char **entries = malloc(sizeof(char *) * cap);
+        for (size_t i = 0; i < cap; i++) {
+            entries[i] = malloc(TAR_PATH_MAX);
+        }
+        sys = no_syscalls;
+        for (size_t i = 0; i < no_dirs; i++) {
+            size_t no_entries = cap;
+            start = now_ns();
+            list(fd, dirs[i], entries, &no_entries);
+            lat[i] = now_ns() - start;
+        }
+        report("list", lat, no_dirs, 0, no_syscalls - sys);
+
+        // The same directories queried by glob, at any depth
+        const tar_entry_t **found = malloc(sizeof(tar_entry_t *) * cap);
+        sys = no_syscalls;
+        for (size_t i = 0; i < no_dirs; i++) {
+            char pattern[TAR_PATH_MAX + 1];
+            snprintf(pattern, sizeof(pattern), "%s*", dirs[i]);
+            size_t no_entries = cap;
+            start = now_ns();
+            tar_query(ar, pattern, 0, NULL, found, &no_entries);
+            lat[i] = now_ns() - start;
+        }
+        report("tar_query", lat, no_dirs, 0, no_syscalls - sys);
+
+        // The files of the same directories filtered by size, without matching their names
+        tar_filter_t filter = { .types = TAR_TYPE_FILE, .min_size = 1 };
+        sys = no_syscalls;
+        for (size_t i = 0; i < no_dirs; i++) {
+            filter.prefix = dirs[i];
+            size_t no_entries = cap;
+            start = now_ns();
+            tar_scan(ar, &filter, NULL, found, &no_entries);
+            lat[i] = now_ns() - start;
+        }
+        report("tar_scan", lat, no_dirs, 0, no_syscalls - sys);
+        free(found);
+        for (size_t i = 0; i < cap; i++) {
+            free(entries[i]);
+        }
+        free(entries);
+    }
+
+    // Reads of random ranges of random members
+    sys = no_syscalls;
+    bytes = 0;
+    for (size_t i = 0; i < q; i++) {
+        char *path = members[next_random(&state) % opt.no_members];
+        size_t len = 1 + next_random(&state) % 4096;
+        size_t offset = opt.max_size ? next_random(&state) % (opt.max_size / 2 + 1) : 0;
+        start = now_ns();
+        if (read_file(fd, path, offset, buf, &len) >= 0) {
+            bytes += len;
+        }
+        lat[i] = now_ns() - start;
+    }
+    report("read_file (random)", lat, q, bytes, no_syscalls - sys);
+
+    // The same reads by batches of 64, a call being a batch
+    tar_read_req_t reqs[64];
+    uint8_t *batch_buf = malloc(64 * 4096);
+    size_t no_batches = (q + 63) / 64;
+    sys = no_syscalls;
+    bytes = 0;
+    for (size_t i = 0; i < no_batches; i++) {
+        for (size_t j = 0; j < 64; j++) {
+            reqs[j].path = members[next_random(&state) % opt.no_members];
+            reqs[j].offset = opt.max_size ? next_random(&state) % (opt.max_size / 2 + 1) : 0;
+            reqs[j].dest = batch_buf + j * 4096;
+            reqs[j].len = 1 + next_random(&state) % 4096;
+        }
+        start = now_ns();
+        tar_read_batch(ar, reqs, 64);
+        lat[i] = now_ns() - start;
+        for (size_t j = 0; j < 64; j++) {
+            bytes += reqs[j].ret >= 0 ? reqs[j].len : 0;
+        }
+    }
+    report("tar_read_batch (x64)", lat, no_batches, bytes, no_syscalls - sys);
+    free(batch_buf);
+
+    // Sequential read of every member in 64 KiB chunks, a call being the read of a whole member
+    sys = no_syscalls;
+    bytes = 0;
+    for (size_t i = 0; i < opt.no_members; i++) {
+        size_t offset = 0, len;
+        ssize_t ret;
+        start = now_ns();
+        do {
+            len = 1 << 16;
+            ret = read_file(fd, members[i], offset, buf, &len);
+            if (ret >= 0) {
+                offset += len;
+                bytes += len;
+            }
+        } while (ret > 0);
+        lat[i] = now_ns() - start;
+    }
+    report("read_file (sequential)", lat, opt.no_members, bytes, no_syscalls - sys);
+
+    sys = no_syscalls;
+    bytes = 0;
+    for (size_t i = 0; i < opt.no_members; i++) {
+        tar_member_t *member = tar_open_member(ar, members[i]);
+        ssize_t n;
+        start = now_ns();
+        while ((n = tar_member_read(member, buf, 1 << 16)) > 0) {
+            bytes += n;
+        }
+        lat[i] = now_ns() - start;
+        tar_member_close(member);
+    }
+    report("tar_member_read (seq)", lat, opt.no_members, bytes, no_syscalls - sys);
+
+    // Streaming read of every member, the archive being read forward only as from a pipe
+    lseek(fd, 0, SEEK_SET);
+    sys = no_syscalls;
+    bytes = 0;
+    start = now_ns();
+    tar_stream_t *stream = tar_stream_open(fd);
+    tar_entry_t entry;
+    while (tar_stream_next(stream, &entry) == 1) {
+        ssize_t n;
+        while ((n = tar_stream_read(stream, buf, 1 << 16)) > 0) {
+            bytes += n;
+        }
+    }
+    tar_stream_close(stream);
+    lat[0] = now_ns() - start;
+    report("tar_stream", lat, 1, st.st_size, no_syscalls - sys);
+
+    // Extraction of the whole archive to a temporary directory, removed afterwards
+    char dest[] = "/tmp/lib_tar_bench_XXXXXX";
+    if (mkdtemp(dest) != NULL) {
+        sys = no_syscalls;
+        start = now_ns();
+        tar_extract(ar, dest, NULL, 0);
+        lat[0] = now_ns() - start;
+        report("tar_extract", lat, 1, st.st_size, no_syscalls - sys);
+        nftw(dest, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    }
+
+    // Digests of every file, the manifest being thrown away
+    int null_fd = open("/dev/null", O_WRONLY);
+    const char *digest_names[] = { "tar_digest (crc32c)", "tar_digest (sha256)" };
+    int digests[] = { TAR_DIGEST_CRC32C, TAR_DIGEST_SHA256 };
+    for (int d = 0; d < 2 && null_fd != -1; d++) {
+        sys = no_syscalls;
+        start = now_ns();
+        tar_digest(ar, digests[d], 0, null_fd);
+        lat[0] = now_ns() - start;
+        report(digest_names[d], lat, 1, st.st_size, no_syscalls - sys);
+    }
+    if (null_fd != -1) {
+        close(null_fd);
+    }
+
+    if (opt.stats) {
+        print_stats();
+    }
+    tar_close(ar);
+    close(fd);
+    if (!opt.keep) {
+        unlink(opt.archive);
+    }
+    for (size_t i = 0; i < opt.no_members; i++) {
+        free(members[i]);
+    }
+    for (size_t i = 0; i < no_dirs; i++) {
+        free(dirs[i]);
+    }
+    free(members);
+    free(dirs);
+    free(lat);
+    free(buf);
+    return 0;
+}
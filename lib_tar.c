@@ -1,541 +1,6053 @@
+#define _GNU_SOURCE
 #include "lib_tar.h"
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <zlib.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define HEADER_SIZE 512
-char c[HEADER_SIZE];
+// Size of the chunks handed to the kernel, and of the bounce buffer when the data has to go through user space
+#define COPY_CHUNK (1 << 20)
 
-tar_header_t *header;
+// Marks the absence of a node in the directory tree, also used as the index of the root of the archive
+#define NO_NODE ((size_t) -1)
+
+/* A run of data of a sparse file, the bytes between two runs being a hole of zeros */
+struct sparse_segment {
+    uint64_t offset;            // offset of the run in the file
+    uint64_t size;
+    uint64_t stored;            // offset of its bytes in the data stored in the archive, where runs follow each other
+};
+
+/* Map of a sparse file */
+struct sparse_file {
+    const struct sparse_segment *segments;  // in file order
+    size_t no_segments;
+    off_t data;                 // offset in the archive of the stored data
+    uint64_t size;              // real size of the file
+};
+
+/* Links of an entry in the directory tree, children are kept in archive order */
+struct tree_node {
+    size_t parent;
+    size_t first_child;
+    size_t last_child;
+    size_t next_sibling;
+    size_t target;      // entry a link finally points to, the entry itself if it is not a link, NO_NODE if it dangles
+    const struct sparse_file *sparse;   // map of a sparse file, NULL for the other entries
+};
+
+// Reader of a gzip-compressed archive, see gz_read()
+struct gz_index;
+// io_uring engine, see ring_header()
+struct uring;
+// Buffer of a streamed archive, see stream_fill()
+struct stream_buf;
+
+struct tar_archive {
+    int fd;
+    // Whole archive mapped read-only, NULL when mmap() is not possible on the fd
+    const uint8_t *map;
+    size_t map_len;
+    // Set when fd is a gzip-compressed archive, the offsets of the index are then in the uncompressed stream
+    struct gz_index *gz;
+    // Set when the archive is read through io_uring, the archive is then not mapped
+    struct uring *ring;
+    // Set when the archive is read from a pipe by the streaming reader, offsets can then only go forward
+    struct stream_buf *stream;
+    tar_entry_t *entries;
+    size_t no_entries;
+    size_t cap_entries;
+    // Names and link targets of the entries, maps of the sparse files
+    struct arena_block *arena;
+    // Directory tree, nodes[i] links entries[i] and root holds the top-level entries
+    struct tree_node *nodes;
+    struct tree_node root;
+    // Open addressing table of entry index + 1, zero marks an empty slot
+    size_t *buckets;
+    size_t no_buckets;
+    // Indices of the entries of the tree sorted by name, the paths under a prefix being a range of it
+    size_t *sorted;
+    size_t no_sorted;
+    // Identity of the file, used to know whether a cached index is still valid
+    dev_t dev;
+    ino_t ino;
+    off_t st_size;
+    struct timespec mtime;
+    // Users of the handle when it is shared by the fd-based functions, see acquire_archive()
+    int refs;
+};
+
+struct tar_member {
+    const tar_archive_t *ar;
+    off_t data;                 // offset of the first data byte in the archive
+    uint64_t size;
+    uint64_t pos;               // position of the cursor in the member
+    const struct sparse_file *sparse;   // map of the file if it is sparse, data is then unused
+};
+
+// Indexes kept for the fd-based functions, most recently used first, the last one making room for a new archive
+#define FD_CACHE_SLOTS 8
+static tar_archive_t *fd_cache[FD_CACHE_SLOTS];
+static pthread_mutex_t fd_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Statistics. Every public function opens an OP_SCOPE naming the counters it accounts to, and the I/O helpers add
+ * to the counters of the scope of their thread. Calls nested in another public function, like the tar_open()
+ * done by exists() on a new fd, are accounted to the outer one. When the statistics are off, the cost is a test
+ * of stats_on at each site.
+ */
+static int stats_on;
+static tar_stats_t stats;
+static _Thread_local int current_op = -1;
+
+struct op_scope {
+    int op;                 // -1 when the call is not accounted
+    uint64_t start;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct op_scope op_enter(int op) {
+    struct op_scope scope = { -1, 0 };
+    if (__atomic_load_n(&stats_on, __ATOMIC_RELAXED) && current_op == -1) {
+        current_op = scope.op = op;
+        scope.start = now_ns();
+    }
+    return scope;
+}
+
+static void op_leave(struct op_scope *scope) {
+    if (scope->op == -1) {
+        return;
+    }
+    uint64_t ns = now_ns() - scope->start;
+    int bucket = 63 - __builtin_clzll(ns | 1);
+    if (bucket >= TAR_HIST_BUCKETS) {
+        bucket = TAR_HIST_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&stats.ops[scope->op].calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.ops[scope->op].latency[bucket], 1, __ATOMIC_RELAXED);
+    current_op = -1;
+}
+
+// Accounts the whole function to op, the scope is closed on every return
+#define OP_SCOPE(op) struct op_scope op_scope_ __attribute__((cleanup(op_leave))) = op_enter(op)
+
+// Adds n to a counter of the scope of the calling thread
+#define STAT_ADD(field, n) do { \
+        if (current_op != -1) { \
+            __atomic_fetch_add(&stats.ops[current_op].field, (n), __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+/**
+ * Turns the statistics on or off, they are off by default.
+ */
+void tar_stats_enable(int on) {
+    __atomic_store_n(&stats_on, on != 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies the current statistics into snapshot.
+ */
+void tar_stats_snapshot(tar_stats_t *snapshot) {
+    uint64_t *dst = (uint64_t *) snapshot;
+    uint64_t *src = (uint64_t *) &stats;
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Sets every counter back to zero.
+ */
+void tar_stats_reset(void) {
+    uint64_t *counters = (uint64_t *) &stats;
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* Returns a printable name for a TAR_OP_* value */
+const char *tar_op_name(int op) {
+    static const char *names[TAR_NO_OPS] = { "check_archive", "open", "lookup", "list", "read", "send", "batch",
+                                             "write", "extract", "stream", "digest" };
+    return op >= 0 && op < TAR_NO_OPS ? names[op] : "unknown";
+}
+
+/* Number of bytes taken in the archive by the data of a member, rounded up to whole blocks */
+static off_t padded_size(uint64_t size) {
+    return (off_t) ((size + HEADER_SIZE - 1) / HEADER_SIZE * HEADER_SIZE);
+}
+
+/* Maps the archive in memory when it is a regular file, the readers below fall back to pread() otherwise */
+static void map_archive(tar_archive_t *ar, const struct stat *st) {
+    if (!S_ISREG(st->st_mode) || st->st_size <= 0) {
+        return;
+    }
+    void *map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, ar->fd, 0);
+    if (map != MAP_FAILED) {
+        ar->map = map;
+        ar->map_len = st->st_size;
+    }
+}
+
+static void unmap_archive(tar_archive_t *ar) {
+    if (ar->map != NULL) {
+        munmap((void *) ar->map, ar->map_len);
+        ar->map = NULL;
+    }
+}
+
+/*
+ * Random access to gzip-compressed archives, after zran.c of the zlib examples.
+ *
+ * A first pass inflates the whole stream and saves a checkpoint at a deflate block boundary every span bytes of
+ * output: the offsets in both streams, the bits of the compressed byte already consumed and the 32 KiB window the
+ * following blocks may refer to. A read then only inflates from the last checkpoint before its offset. The inflate
+ * stream is kept where the last read stopped, so that reads going forward, like a walk of the headers, carry on
+ * with it instead of going back to a checkpoint.
+ */
+#define GZ_WINDOW 32768
+#define GZ_CHUNK 16384
+#define GZ_SPAN (1 << 20)
+
+struct gz_point {
+    uint64_t out;               // offset in the uncompressed stream
+    uint64_t in;                // offset of the first full byte in the compressed stream
+    int bits;                   // bits of the byte before in that belong to the block, 0 to 7
+    uint8_t window[GZ_WINDOW];
+};
+
+struct gz_index {
+    int fd;
+    uint64_t span;
+    uint64_t size;              // size of the uncompressed stream
+    struct gz_point *points;
+    size_t no_points;
+    // Inflate stream of the last read, shared by the threads querying the handle
+    pthread_mutex_t lock;
+    z_stream strm;
+    int active;
+    uint64_t pos;               // uncompressed offset strm is at
+    off_t in_pos;               // compressed offset of the next input chunk
+    uint8_t input[GZ_CHUNK];
+    uint8_t discard[GZ_WINDOW];
+};
+
+static void gz_free(struct gz_index *gz) {
+    if (gz == NULL) {
+        return;
+    }
+    if (gz->active) {
+        inflateEnd(&gz->strm);
+    }
+    pthread_mutex_destroy(&gz->lock);
+    free(gz->points);
+    free(gz);
+}
+
+static int gz_add_point(struct gz_index *gz, int bits, uint64_t in, uint64_t out, unsigned left,
+                        const uint8_t *window) {
+    if ((gz->no_points & (gz->no_points - 1)) == 0) {
+        struct gz_point *points = realloc(gz->points, (gz->no_points ? gz->no_points * 2 : 8) * sizeof(struct gz_point));
+        if (points == NULL) {
+            return -1;
+        }
+        gz->points = points;
+    }
+    struct gz_point *point = &gz->points[gz->no_points++];
+    point->bits = bits;
+    point->in = in;
+    point->out = out;
+    // The window is circular, its oldest byte is at left bytes from the end
+    if (left) {
+        memcpy(point->window, window + GZ_WINDOW - left, left);
+    }
+    if (left < GZ_WINDOW) {
+        memcpy(point->window + left, window, GZ_WINDOW - left);
+    }
+    return 0;
+}
+
+/* Inflates the whole compressed stream once to place the checkpoints */
+static int gz_build(struct gz_index *gz) {
+    z_stream strm = { 0 };
+    uint8_t *window = malloc(GZ_WINDOW);
+    uint64_t totin = 0, totout = 0, last = 0;
+    off_t in_pos = 0;
+    int ret;
+
+    // 47 lets inflate detect a gzip or zlib header
+    if (window == NULL || inflateInit2(&strm, 47) != Z_OK) {
+        free(window);
+        return -1;
+    }
+    strm.avail_out = 0;
+    do {
+        ssize_t n = pread(gz->fd, gz->input, GZ_CHUNK, in_pos);
+        if (n <= 0) {
+            ret = Z_DATA_ERROR;
+            break;
+        }
+        in_pos += n;
+        strm.avail_in = n;
+        strm.next_in = gz->input;
+        do {
+            if (strm.avail_out == 0) {
+                strm.avail_out = GZ_WINDOW;
+                strm.next_out = window;
+            }
+            totin += strm.avail_in;
+            totout += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            totin -= strm.avail_in;
+            totout -= strm.avail_out;
+            if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+                ret = Z_DATA_ERROR;
+                break;
+            }
+            if (ret == Z_STREAM_END) {
+                break;
+            }
+            // Bit 128 is set at the end of a deflate block header, bit 64 after the last block
+            if ((strm.data_type & 128) && !(strm.data_type & 64) && (totout == 0 || totout - last > gz->span)) {
+                if (gz_add_point(gz, strm.data_type & 7, totin, totout, strm.avail_out, window) == -1) {
+                    ret = Z_MEM_ERROR;
+                    break;
+                }
+                last = totout;
+            }
+        } while (strm.avail_in != 0);
+    } while (ret == Z_OK || ret == Z_BUF_ERROR);
+
+    inflateEnd(&strm);
+    free(window);
+    gz->size = totout;
+    return ret == Z_STREAM_END && gz->no_points > 0 ? 0 : -1;
+}
+
+/* Inflates len bytes from the current position of the stream into out */
+static int gz_inflate(struct gz_index *gz, uint8_t *out, size_t len) {
+    gz->strm.next_out = out;
+    gz->strm.avail_out = len;
+    while (gz->strm.avail_out != 0) {
+        if (gz->strm.avail_in == 0) {
+            STAT_ADD(preads, 1);
+            ssize_t n = pread(gz->fd, gz->input, GZ_CHUNK, gz->in_pos);
+            if (n <= 0) {
+                return -1;
+            }
+            STAT_ADD(bytes_read, n);
+            gz->in_pos += n;
+            gz->strm.next_in = gz->input;
+            gz->strm.avail_in = n;
+        }
+        int ret = inflate(&gz->strm, Z_NO_FLUSH);
+        if (ret != Z_OK && !(ret == Z_STREAM_END && gz->strm.avail_out == 0)) {
+            return -1;
+        }
+    }
+    gz->pos += len;
+    return 0;
+}
+
+/* Moves the inflate stream to the last checkpoint at or before offset */
+static int gz_seek(struct gz_index *gz, uint64_t offset) {
+    size_t lo = 0, hi = gz->no_points;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (gz->points[mid].out <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    const struct gz_point *point = &gz->points[lo];
+
+    int ret = gz->active ? inflateReset2(&gz->strm, -15) : inflateInit2(&gz->strm, -15);
+    if (ret != Z_OK) {
+        return -1;
+    }
+    gz->active = 1;
+    gz->in_pos = point->in;
+    gz->strm.avail_in = 0;
+    if (point->bits) {
+        uint8_t byte;
+        if (pread(gz->fd, &byte, 1, point->in - 1) != 1) {
+            return -1;
+        }
+        inflatePrime(&gz->strm, point->bits, byte >> (8 - point->bits));
+    }
+    inflateSetDictionary(&gz->strm, point->window, GZ_WINDOW);
+    gz->pos = point->out;
+    return 0;
+}
+
+/* Reads len bytes of the uncompressed stream at offset, returns -1 if they could not all be read */
+static int gz_read(struct gz_index *gz, off_t offset, void *dest, size_t len) {
+    if (offset < 0 || (uint64_t) offset + len > gz->size) {
+        return -1;
+    }
+    pthread_mutex_lock(&gz->lock);
+    int ret = 0;
+    // Going back, or further than a checkpoint ahead, is cheaper from a checkpoint
+    if (!gz->active || (uint64_t) offset < gz->pos || (uint64_t) offset - gz->pos > gz->span) {
+        ret = gz_seek(gz, offset);
+    }
+    while (ret == 0 && gz->pos < (uint64_t) offset) {
+        uint64_t skip = offset - gz->pos;
+        ret = gz_inflate(gz, gz->discard, skip < GZ_WINDOW ? skip : GZ_WINDOW);
+    }
+    while (ret == 0 && len > 0) {
+        size_t chunk = len < (1U << 30) ? len : (1U << 30);
+        ret = gz_inflate(gz, dest, chunk);
+        dest = (uint8_t *) dest + chunk;
+        len -= chunk;
+    }
+    if (ret == -1 && gz->active) {
+        inflateEnd(&gz->strm);
+        gz->active = 0;
+    }
+    pthread_mutex_unlock(&gz->lock);
+    return ret;
+}
+
+/*
+ * io_uring engine, used instead of the mapping when selected by tar_set_io_engine().
+ *
+ * The walks of the headers read the archive by chunks held in a window of URING_DEPTH buffers. When the header at
+ * an offset is needed, the reads of the chunks that follow it are submitted along with its own, so that the device
+ * sees many reads in flight instead of one. Read-ahead only pays off while the next headers fall in the chunks
+ * read ahead: each time a header is found past the window, behind a big member, the number of chunks read ahead
+ * is halved, down to none, and it doubles each time a chunk read ahead is used.
+ */
+#ifdef __linux__
+#define URING_DEPTH 32
+#define URING_CHUNK (64 * 1024)
+#define URING_ENTRIES 64
+// Tag of the user_data of the window reads, the reads of tar_read_batch() carry the index of their request
+#define URING_WINDOW ((uint64_t) 1 << 63)
+
+#define CHUNK_FREE 0
+#define CHUNK_PENDING 1
+#define CHUNK_DONE 2
+
+struct ring_chunk {
+    off_t offset;
+    ssize_t len;                // bytes read, or -1
+    int state;                  // CHUNK_*
+    int ahead;                  // read ahead and not used yet
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+    unsigned entries;
+    unsigned tail;              // tail of the submission queue, published by ring_enter()
+    unsigned queued;            // reads queued and not submitted yet
+    unsigned in_flight;         // reads submitted and not reaped yet
+    // Taken by the walks and by tar_read_batch(), which share the completion queue
+    pthread_mutex_t lock;
+    off_t limit;                // size of the archive, 0 when unknown
+    unsigned ahead;             // chunks read ahead of the one holding the current header
+    struct ring_chunk window[URING_DEPTH];
+    uint8_t *buffers;
+};
+
+static int ring_available(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, 1, &params);
+    if (fd == -1) {
+        return 0;
+    }
+    close(fd);
+    return 1;
+}
+
+static void ring_free(struct uring *ring);
+
+static struct uring *ring_init(off_t limit) {
+    struct uring *ring = calloc(1, sizeof(struct uring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd == -1) {
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    ring->entries = params.sq_entries;
+    ring->limit = limit;
+    ring->ahead = URING_DEPTH - 1;
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_len > ring->sq_map_len) {
+            ring->sq_map_len = ring->cq_map_len;
+        }
+        ring->cq_map_len = 0;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cq_map = ring->cq_map_len == 0 ? ring->sq_map
+                   : mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    ring->buffers = malloc((size_t) URING_DEPTH * URING_CHUNK);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED
+        || ring->buffers == NULL) {
+        ring_free(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->tail = *ring->sq_tail;
+    return ring;
+}
+
+/* Queues a read, returns -1 when the queues are full and completions must be reaped first */
+static int ring_queue(struct uring *ring, int fd, void *buf, size_t len, off_t offset, uint64_t user_data) {
+    if (ring->queued + ring->in_flight >= ring->entries) {
+        return -1;
+    }
+    unsigned index = ring->tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->tail++;
+    ring->queued++;
+    STAT_ADD(ring_reads, 1);
+    return 0;
+}
+
+/* Submits the queued reads and waits for min_complete completions */
+static int ring_enter(struct uring *ring, unsigned min_complete) {
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        // Takes the queued reads back, the kernel has not seen them
+        ring->tail -= ring->queued;
+        __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+        ring->queued = 0;
+        return -1;
+    }
+    ring->queued -= ret;
+    ring->in_flight += ret;
+    return 0;
+}
+
+/* Waits for the next completion, the window reads are accounted on the way */
+static int ring_wait(struct uring *ring, uint64_t *user_data, int *res) {
+    unsigned head = *ring->cq_head;
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (ring->queued + ring->in_flight == 0 || ring_enter(ring, 1) == -1) {
+            return -1;
+        }
+    }
+    const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->in_flight--;
+    if (*res > 0) {
+        STAT_ADD(bytes_read, *res);
+    }
+    if (*user_data & URING_WINDOW) {
+        struct ring_chunk *chunk = &ring->window[*user_data & ~URING_WINDOW];
+        chunk->len = *res < 0 ? -1 : *res;
+        chunk->state = CHUNK_DONE;
+    }
+    return 0;
+}
+
+static void ring_free(struct uring *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    // The kernel still writes to the buffers of the reads in flight
+    uint64_t user_data;
+    int res;
+    while (ring->in_flight > 0 && ring_wait(ring, &user_data, &res) == 0) {
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_len);
+    }
+    close(ring->fd);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->buffers);
+    free(ring);
+}
+
+/* Queues the read of the chunk at offset into its slot of the window, once the read it holds has completed */
+static int window_queue(struct uring *ring, int fd, off_t offset, int ahead) {
+    size_t slot = (offset / URING_CHUNK) % URING_DEPTH;
+    struct ring_chunk *chunk = &ring->window[slot];
+    uint64_t user_data;
+    int res;
+    while (chunk->state == CHUNK_PENDING) {
+        if (ahead || ring_wait(ring, &user_data, &res) == -1) {
+            return -1;
+        }
+    }
+    if (ring_queue(ring, fd, ring->buffers + slot * URING_CHUNK, URING_CHUNK, offset, URING_WINDOW | slot) == -1) {
+        return -1;
+    }
+    chunk->offset = offset;
+    chunk->state = CHUNK_PENDING;
+    chunk->ahead = ahead;
+    return 0;
+}
+
+/* Returns the header block at offset out of the window, see header_at() */
+static const tar_header_t *ring_header(struct uring *ring, int fd, off_t offset, tar_header_t *scratch) {
+    if (offset < 0) {
+        return NULL;
+    }
+    off_t base = offset / URING_CHUNK * URING_CHUNK;
+    struct ring_chunk *chunk = &ring->window[(base / URING_CHUNK) % URING_DEPTH];
+    const tar_header_t *hdr = NULL;
+    uint64_t user_data;
+    int res;
+
+    pthread_mutex_lock(&ring->lock);
+    if (chunk->state == CHUNK_FREE || chunk->offset != base) {
+        // Past the window
+        ring->ahead /= 2;
+        if (window_queue(ring, fd, base, 0) == -1) {
+            chunk = NULL;
+        }
+    } else if (chunk->ahead || ring->ahead == 0) {
+        // Two headers in the same chunk start the read-ahead again
+        chunk->ahead = 0;
+        ring->ahead = ring->ahead == 0 ? 1 : ring->ahead * 2 < URING_DEPTH ? ring->ahead * 2 : URING_DEPTH - 1;
+    }
+    for (unsigned i = 1; chunk != NULL && i <= ring->ahead; i++) {
+        off_t next = base + (off_t) i * URING_CHUNK;
+        const struct ring_chunk *slot = &ring->window[(next / URING_CHUNK) % URING_DEPTH];
+        if (ring->limit > 0 && next >= ring->limit) {
+            break;
+        }
+        if (slot->state != CHUNK_FREE && slot->offset == next) {
+            continue;
+        }
+        // Stops at a slot whose read is still in flight rather than waiting for it
+        if (window_queue(ring, fd, next, 1) == -1) {
+            break;
+        }
+    }
+    if (chunk != NULL && ring->queued > 0 && ring_enter(ring, 0) == -1) {
+        chunk = NULL;
+    }
+    while (chunk != NULL && chunk->state == CHUNK_PENDING) {
+        if (ring_wait(ring, &user_data, &res) == -1) {
+            chunk = NULL;
+        }
+    }
+    if (chunk != NULL && chunk->len >= offset - base + HEADER_SIZE) {
+        hdr = (const tar_header_t *) (ring->buffers + (chunk - ring->window) * URING_CHUNK + (offset - base));
+    }
+    pthread_mutex_unlock(&ring->lock);
+    if (hdr != NULL) {
+        return hdr;
+    }
+
+    // The read failed or came short, pread() tells the end of the archive from an error
+    STAT_ADD(preads, 1);
+    if (pread(fd, scratch, HEADER_SIZE, offset) != HEADER_SIZE) {
+        return NULL;
+    }
+    STAT_ADD(bytes_read, HEADER_SIZE);
+    return scratch;
+}
+
+/*
+ * Submits the reads of tar_read_batch(), starts[i] is the archive offset reqs[i] reads at, or -1 once it is read.
+ * The reads that fail, come short or are too big for a single read are left to the caller.
+ */
+static void ring_read_batch(struct uring *ring, int fd, tar_read_req_t *reqs, off_t *starts, size_t no_reqs) {
+    size_t next = 0, pending = 0;
+    uint64_t user_data;
+    int res;
+
+    pthread_mutex_lock(&ring->lock);
+    while (next < no_reqs || pending > 0) {
+        for (; next < no_reqs; next++) {
+            if (starts[next] < 0 || reqs[next].len > (1U << 30)) {
+                continue;
+            }
+            if (ring_queue(ring, fd, reqs[next].dest, reqs[next].len, starts[next], next) == -1) {
+                break;
+            }
+            pending++;
+        }
+        unsigned queued = ring->queued;
+        if (queued > 0 && ring_enter(ring, 0) == -1) {
+            pending -= queued;
+            break;
+        }
+        // With nothing of the batch in flight, the queues are full of window reads that are reaped below
+        if ((next == no_reqs && pending == 0) || ring_wait(ring, &user_data, &res) == -1) {
+            break;
+        }
+        if (!(user_data & URING_WINDOW)) {
+            pending--;
+            if (res >= 0 && (size_t) res == reqs[user_data].len) {
+                starts[user_data] = -1;
+            }
+        }
+    }
+    // The buffers of the caller must not be written once it returns
+    while (ring->in_flight > 0 && ring_wait(ring, &user_data, &res) == 0) {
+        if (!(user_data & URING_WINDOW) && res >= 0 && (size_t) res == reqs[user_data].len) {
+            starts[user_data] = -1;
+        }
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+#else
+struct uring {
+    int fd;
+};
+
+static int ring_available(void) {
+    return 0;
+}
+
+static struct uring *ring_init(off_t limit) {
+    return NULL;
+}
+
+static void ring_free(struct uring *ring) {
+}
+
+static const tar_header_t *ring_header(struct uring *ring, int fd, off_t offset, tar_header_t *scratch) {
+    return NULL;
+}
+
+static void ring_read_batch(struct uring *ring, int fd, tar_read_req_t *reqs, off_t *starts, size_t no_reqs) {
+}
+#endif
+
+static int io_engine = TAR_IO_DEFAULT;
+
+/* Sets up the I/O engine selected by tar_set_io_engine() to read the archive */
+static void attach_io(tar_archive_t *ar, const struct stat *st) {
+    if (__atomic_load_n(&io_engine, __ATOMIC_RELAXED) == TAR_IO_URING) {
+        ar->ring = ring_init(S_ISREG(st->st_mode) ? st->st_size : 0);
+        if (ar->ring != NULL) {
+            return;
+        }
+    }
+    map_archive(ar, st);
+}
+
+static void detach_io(tar_archive_t *ar) {
+    unmap_archive(ar);
+    ring_free(ar->ring);
+    ar->ring = NULL;
+}
+
+/**
+ * Selects the way archives opened from now on are read.
+ */
+int tar_set_io_engine(int engine) {
+    if (engine != TAR_IO_DEFAULT && engine != TAR_IO_URING) {
+        return -1;
+    }
+    __atomic_store_n(&io_engine, engine, __ATOMIC_RELAXED);
+    return engine == TAR_IO_URING && !ring_available() ? -1 : 0;
+}
+
+/*
+ * Forward-only reading of an archive from a pipe or a socket, for the streaming reader.
+ *
+ * The archive is read by big read() calls into a buffer. The offsets asked for never go back, the bytes before
+ * them are dropped, and the bytes past the buffer up to them are skipped by lseek() when the fd allows it, or read
+ * and discarded otherwise. The buffer is only compacted when a block does not fit at its end.
+ */
+#define STREAM_BUFFER (1 << 20)
+
+struct stream_buf {
+    int fd;
+    int seekable;               // -1 until the first skip tells
+    off_t base;                 // archive offset of data[start]
+    size_t start, end;          // bytes buffered
+    uint8_t data[STREAM_BUFFER];
+};
+
+/* Drops the bytes before offset, returns -1 if the stream ends before it or offset is behind */
+static int stream_skip(struct stream_buf *sb, off_t offset) {
+    if (offset < sb->base) {
+        return -1;
+    }
+    uint64_t gap = offset - sb->base;
+    if (gap <= sb->end - sb->start) {
+        sb->start += gap;
+        sb->base = offset;
+        return 0;
+    }
+    gap -= sb->end - sb->start;
+    sb->base += sb->end - sb->start;
+    sb->start = sb->end = 0;
+    if (sb->seekable != 0) {
+        STAT_ADD(lseeks, 1);
+        if (lseek(sb->fd, gap, SEEK_CUR) != -1) {
+            sb->seekable = 1;
+            sb->base += gap;
+            STAT_ADD(bytes_skipped, gap);
+            return 0;
+        }
+        sb->seekable = 0;
+    }
+    while (gap > 0) {
+        STAT_ADD(reads, 1);
+        ssize_t n = read(sb->fd, sb->data, gap < STREAM_BUFFER ? gap : STREAM_BUFFER);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        STAT_ADD(bytes_read, n);
+        sb->base += n;
+        gap -= n;
+    }
+    return 0;
+}
+
+/* Makes the len bytes at offset contiguous in the buffer, returns NULL if the stream ends before */
+static const uint8_t *stream_fill(struct stream_buf *sb, off_t offset, size_t len) {
+    if (stream_skip(sb, offset) == -1) {
+        return NULL;
+    }
+    if (STREAM_BUFFER - sb->start < len) {
+        memmove(sb->data, sb->data + sb->start, sb->end - sb->start);
+        sb->end -= sb->start;
+        sb->start = 0;
+    }
+    while (sb->end - sb->start < len) {
+        STAT_ADD(reads, 1);
+        ssize_t n = read(sb->fd, sb->data + sb->end, STREAM_BUFFER - sb->end);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return NULL;
+        }
+        STAT_ADD(bytes_read, n);
+        sb->end += n;
+    }
+    return sb->data + sb->start;
+}
+
+/* Copies the len bytes at offset into dest, the reads bigger than the buffer going straight to dest */
+static int stream_read(struct stream_buf *sb, off_t offset, uint8_t *dest, size_t len) {
+    if (stream_skip(sb, offset) == -1) {
+        return -1;
+    }
+    size_t n = len < sb->end - sb->start ? len : sb->end - sb->start;
+    memcpy(dest, sb->data + sb->start, n);
+    sb->start += n;
+    sb->base += n;
+    dest += n;
+    len -= n;
+    while (len >= STREAM_BUFFER) {
+        STAT_ADD(reads, 1);
+        ssize_t got = read(sb->fd, dest, len);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        STAT_ADD(bytes_read, got);
+        sb->base += got;
+        dest += got;
+        len -= got;
+    }
+    if (len > 0) {
+        if (stream_fill(sb, sb->base, len) == NULL) {
+            return -1;
+        }
+        memcpy(dest, sb->data + sb->start, len);
+        sb->start += len;
+        sb->base += len;
+    }
+    return 0;
+}
+
+/**
+ * Returns the header block starting at offset, in place when the archive is mapped or read into scratch otherwise.
+ * NULL is returned when there is no full block at offset.
+ */
+static const tar_header_t *header_at(const tar_archive_t *ar, off_t offset, tar_header_t *scratch) {
+    STAT_ADD(headers, 1);
+    if (ar->gz != NULL) {
+        return gz_read(ar->gz, offset, scratch, HEADER_SIZE) == 0 ? scratch : NULL;
+    }
+    if (ar->ring != NULL) {
+        return ring_header(ar->ring, ar->fd, offset, scratch);
+    }
+    if (ar->stream != NULL) {
+        return (const tar_header_t *) stream_fill(ar->stream, offset, HEADER_SIZE);
+    }
+    if (ar->map != NULL) {
+        if (offset < 0 || (uint64_t) offset + HEADER_SIZE > ar->map_len) {
+            return NULL;
+        }
+        STAT_ADD(bytes_read, HEADER_SIZE);
+        return (const tar_header_t *) (ar->map + offset);
+    }
+    STAT_ADD(preads, 1);
+    if (pread(ar->fd, scratch, HEADER_SIZE, offset) != HEADER_SIZE) {
+        return NULL;
+    }
+    STAT_ADD(bytes_read, HEADER_SIZE);
+    return scratch;
+}
+
+/* Reads len bytes of fd at offset into dest by as many pread() calls as needed, returns -1 on a short file */
+static int pread_all(int fd, void *dest, size_t len, off_t offset) {
+    while (len > 0) {
+        STAT_ADD(preads, 1);
+        ssize_t n = pread(fd, dest, len, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        STAT_ADD(bytes_read, n);
+        dest = (uint8_t *) dest + n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Copies len bytes of the archive starting at offset into dest, bypassing the block cache */
+static int read_archive(const tar_archive_t *ar, off_t offset, void *dest, size_t len) {
+    if (ar->gz != NULL) {
+        return gz_read(ar->gz, offset, dest, len);
+    }
+    if (ar->stream != NULL) {
+        return stream_read(ar->stream, offset, dest, len);
+    }
+    if (ar->map != NULL) {
+        if (offset < 0 || (uint64_t) offset + len > ar->map_len) {
+            return -1;
+        }
+        memcpy(dest, ar->map + offset, len);
+        STAT_ADD(bytes_read, len);
+        return 0;
+    }
+    return pread_all(ar->fd, dest, len, offset);
+}
+
+/*
+ * Block cache.
+ *
+ * Small reads of the archives that are not mapped in memory go through a cache of fixed-size blocks shared by every
+ * handle, keyed by the identity of the archive file and the number of the block. The blocks are chained in a hash
+ * table and kept in a list ordered by last use, the least recently used one being reused once the budget is spent.
+ * A miss reads its block without holding the lock, so that the hits on other blocks go on meanwhile. Mapped
+ * archives do not go through it, the kernel caches their pages already.
+ */
+
+#define CACHE_BLOCK (16 << 10)
+// Larger reads bypass the cache, they would evict the hot blocks for data read once
+#define CACHE_MAX_READ (4 * CACHE_BLOCK)
+
+struct cache_block {
+    // Identity of the archive file and number of the block in it
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    uint64_t no;
+    size_t len;                 // bytes held, less than CACHE_BLOCK for the last block of an archive
+    size_t next;                // next block of the same hash chain, NO_NODE at its end
+    size_t newer;               // neighbours in the list by last use, NO_NODE at its ends
+    size_t older;
+};
+
+struct block_cache {
+    pthread_mutex_t lock;       // guards everything below
+    struct cache_block *blocks;
+    uint8_t *data;              // CACHE_BLOCK bytes per block
+    size_t no_blocks;
+    size_t max_blocks;
+    size_t *buckets;            // first block of each hash chain, NO_NODE if empty
+    size_t no_buckets;
+    size_t mru;
+    size_t lru;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+static int cache_on;
+static struct block_cache cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Size of the archive a handle reads, zero if it is not known */
+static uint64_t archive_size(const tar_archive_t *ar) {
+    return ar->gz != NULL ? ar->gz->size : (uint64_t) ar->st_size;
+}
+
+static size_t *cache_bucket(dev_t dev, ino_t ino, uint64_t no) {
+    uint64_t h = (uint64_t) ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t) dev ^ no * 0xff51afd7ed558ccdULL;
+    return &cache.buckets[(h ^ (h >> 29)) & (cache.no_buckets - 1)];
+}
+
+static int cache_match(const struct cache_block *block, const tar_archive_t *ar, uint64_t no) {
+    return block->no == no && block->ino == ar->ino && block->dev == ar->dev
+           && block->mtime.tv_sec == ar->mtime.tv_sec && block->mtime.tv_nsec == ar->mtime.tv_nsec;
+}
+
+/* Takes a block out of the list by last use */
+static void cache_unlink(size_t i) {
+    struct cache_block *block = &cache.blocks[i];
+    if (block->newer != NO_NODE) {
+        cache.blocks[block->newer].older = block->older;
+    } else {
+        cache.mru = block->older;
+    }
+    if (block->older != NO_NODE) {
+        cache.blocks[block->older].newer = block->newer;
+    } else {
+        cache.lru = block->newer;
+    }
+}
+
+/* Puts a block at the most recently used end of the list */
+static void cache_push(size_t i) {
+    struct cache_block *block = &cache.blocks[i];
+    block->newer = NO_NODE;
+    block->older = cache.mru;
+    if (cache.mru != NO_NODE) {
+        cache.blocks[cache.mru].newer = i;
+    } else {
+        cache.lru = i;
+    }
+    cache.mru = i;
+}
+
+/* Finds a block of an archive, the caller holding the lock, returns NO_NODE if it is not cached */
+static size_t cache_find(const tar_archive_t *ar, uint64_t no) {
+    for (size_t i = *cache_bucket(ar->dev, ar->ino, no); i != NO_NODE; i = cache.blocks[i].next) {
+        if (cache_match(&cache.blocks[i], ar, no)) {
+            return i;
+        }
+    }
+    return NO_NODE;
+}
+
+/* Stores a block read from an archive, taking a free block or the least recently used one */
+static void cache_insert(const tar_archive_t *ar, uint64_t no, const uint8_t *data, size_t len) {
+    size_t i;
+    if (cache.no_blocks < cache.max_blocks) {
+        i = cache.no_blocks++;
+    } else {
+        i = cache.lru;
+        cache_unlink(i);
+        size_t *link = cache_bucket(cache.blocks[i].dev, cache.blocks[i].ino, cache.blocks[i].no);
+        while (*link != i) {
+            link = &cache.blocks[*link].next;
+        }
+        *link = cache.blocks[i].next;
+        cache.evictions++;
+    }
+    struct cache_block *block = &cache.blocks[i];
+    *block = (struct cache_block) { ar->dev, ar->ino, ar->mtime, no, len, NO_NODE, NO_NODE, NO_NODE };
+    size_t *bucket = cache_bucket(ar->dev, ar->ino, no);
+    block->next = *bucket;
+    *bucket = i;
+    cache_push(i);
+    memcpy(cache.data + i * CACHE_BLOCK, data, len);
+}
+
+/* Copies len bytes at skip in block no of an archive into dest, reading the block on a miss */
+static int cache_copy(const tar_archive_t *ar, uint64_t no, size_t skip, uint8_t *dest, size_t len) {
+    pthread_mutex_lock(&cache.lock);
+    size_t i = cache.max_blocks > 0 ? cache_find(ar, no) : NO_NODE;
+    if (i != NO_NODE && skip + len <= cache.blocks[i].len) {
+        cache.hits++;
+        cache_unlink(i);
+        cache_push(i);
+        memcpy(dest, cache.data + i * CACHE_BLOCK + skip, len);
+        pthread_mutex_unlock(&cache.lock);
+        return 0;
+    }
+    cache.misses++;
+    pthread_mutex_unlock(&cache.lock);
+
+    uint8_t buf[CACHE_BLOCK];
+    uint64_t start = no * CACHE_BLOCK;
+    size_t block_len = archive_size(ar) - start < CACHE_BLOCK ? archive_size(ar) - start : CACHE_BLOCK;
+    if (skip + len > block_len || read_archive(ar, start, buf, block_len) == -1) {
+        return -1;
+    }
+    memcpy(dest, buf + skip, len);
+
+    // Another thread may have read the same block meanwhile, or the cache been resized
+    pthread_mutex_lock(&cache.lock);
+    if (cache.max_blocks > 0 && cache_find(ar, no) == NO_NODE) {
+        cache_insert(ar, no, buf, block_len);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return 0;
+}
+
+/* Copies len bytes of the archive starting at offset into dest, returns -1 if they could not all be read */
+static int read_at(const tar_archive_t *ar, off_t offset, void *dest, size_t len) {
+    if (!__atomic_load_n(&cache_on, __ATOMIC_RELAXED) || ar->map != NULL || ar->stream != NULL
+        || len > CACHE_MAX_READ || offset < 0 || archive_size(ar) == 0) {
+        return read_archive(ar, offset, dest, len);
+    }
+    while (len > 0) {
+        uint64_t no = offset / CACHE_BLOCK;
+        size_t skip = offset % CACHE_BLOCK;
+        size_t n = CACHE_BLOCK - skip < len ? CACHE_BLOCK - skip : len;
+        if (cache_copy(ar, no, skip, dest, n) == -1) {
+            return -1;
+        }
+        dest = (uint8_t *) dest + n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Sets the memory budget of the block cache, dropping the blocks it holds.
+ */
+int tar_cache_enable(size_t budget) {
+    size_t max_blocks = budget / CACHE_BLOCK;
+    size_t no_buckets = 1;
+    while (no_buckets < 2 * max_blocks) {
+        no_buckets *= 2;
+    }
+    struct cache_block *blocks = max_blocks > 0 ? malloc(max_blocks * sizeof(struct cache_block)) : NULL;
+    uint8_t *data = max_blocks > 0 ? malloc(max_blocks * CACHE_BLOCK) : NULL;
+    size_t *buckets = max_blocks > 0 ? malloc(no_buckets * sizeof(size_t)) : NULL;
+    if (max_blocks > 0 && (blocks == NULL || data == NULL || buckets == NULL)) {
+        free(blocks);
+        free(data);
+        free(buckets);
+        return -1;
+    }
+    for (size_t i = 0; max_blocks > 0 && i < no_buckets; i++) {
+        buckets[i] = NO_NODE;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    __atomic_store_n(&cache_on, max_blocks > 0, __ATOMIC_RELAXED);
+    free(cache.blocks);
+    free(cache.data);
+    free(cache.buckets);
+    cache.blocks = blocks;
+    cache.data = data;
+    cache.buckets = buckets;
+    cache.no_buckets = no_buckets;
+    cache.no_blocks = 0;
+    cache.max_blocks = max_blocks;
+    cache.mru = cache.lru = NO_NODE;
+    pthread_mutex_unlock(&cache.lock);
+    return 0;
+}
+
+/**
+ * Copies the counters of the block cache.
+ */
+void tar_cache_stats(tar_cache_stats_t *stats) {
+    pthread_mutex_lock(&cache.lock);
+    stats->hits = cache.hits;
+    stats->misses = cache.misses;
+    stats->evictions = cache.evictions;
+    stats->bytes_cached = cache.no_blocks * CACHE_BLOCK;
+    stats->budget = cache.max_blocks * CACHE_BLOCK;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * Finds what backs the byte at pos of a sparse file: returns the number of bytes from pos on that are all in the
+ * same run or the same hole, and sets stored to the offset in the archive of the byte at pos, -1 in a hole.
+ */
+static uint64_t sparse_piece(const struct sparse_file *file, uint64_t pos, off_t *stored) {
+    // First run ending after pos
+    size_t lo = 0, hi = file->no_segments;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (file->segments[mid].offset + file->segments[mid].size <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == file->no_segments) {
+        *stored = -1;
+        return file->size - pos;
+    }
+    const struct sparse_segment *segment = &file->segments[lo];
+    if (segment->offset > pos) {
+        *stored = -1;
+        return segment->offset - pos;
+    }
+    *stored = file->data + segment->stored + (pos - segment->offset);
+    return segment->offset + segment->size - pos;
+}
+
+/* Copies len bytes of a sparse file at pos into dest, the holes being filled with zeros without reading anything */
+static int sparse_read(const tar_archive_t *ar, const struct sparse_file *file, uint64_t pos, uint8_t *dest,
+                       size_t len) {
+    while (len > 0) {
+        off_t stored;
+        uint64_t n = sparse_piece(file, pos, &stored);
+        if (n > len) {
+            n = len;
+        }
+        if (stored == -1) {
+            memset(dest, 0, n);
+        } else if (read_at(ar, stored, dest, n) == -1) {
+            return -1;
+        }
+        pos += n;
+        dest += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Copies len bytes of a file at offset into dest, returns -1 if they could not all be read */
+static int read_entry(const tar_archive_t *ar, const tar_entry_t *entry, uint64_t offset, uint8_t *dest, size_t len) {
+    const struct sparse_file *sparse = ar->nodes[entry - ar->entries].sparse;
+    if (sparse != NULL) {
+        return sparse_read(ar, sparse, offset, dest, len);
+    }
+    return read_at(ar, entry->offset + HEADER_SIZE + offset, dest, len);
+}
+
+/* Byte sums of a header block, computed in a single pass */
+struct block_sums {
+    uint32_t sum;       // sum of the bytes taken as unsigned
+    uint32_t high;      // number of bytes above 0x7f, to derive the sum of the bytes taken as signed
+    int zero;           // whether every byte of the block is zero
+};
+
+/* Magic and version of the headers written by GNU tar in its own format */
+#define GNU_MAGIC "ustar  "
+
+/* Numeric fields of a header, decoded by check_header() */
+struct header_fields {
+    uint64_t size;
+    uint64_t mtime;
+    uint32_t mode;
+    uint32_t chksum;
+};
+
+#if defined(__x86_64__)
+static void sum_block_sse2(const uint8_t *block, struct block_sums *sums) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero, any = zero;
+    uint32_t high = 0;
+    for (int i = 0; i < HEADER_SIZE; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (block + i));
+        // psadbw against zero adds up the 8 bytes of each half into a 64-bit lane
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+        any = _mm_or_si128(any, v);
+        high += __builtin_popcount(_mm_movemask_epi8(v));
+    }
+    sums->sum = _mm_cvtsi128_si64(sum) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum));
+    sums->high = high;
+    sums->zero = _mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) == 0xffff;
+}
+
+__attribute__((target("avx2")))
+static void sum_block_avx2(const uint8_t *block, struct block_sums *sums) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sum = zero, any = zero;
+    uint32_t high = 0;
+    for (int i = 0; i < HEADER_SIZE; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (block + i));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(v, zero));
+        any = _mm256_or_si256(any, v);
+        high += __builtin_popcount((uint32_t) _mm256_movemask_epi8(v));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    sums->sum = _mm_cvtsi128_si64(half) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half));
+    sums->high = high;
+    sums->zero = _mm256_testz_si256(any, any);
+}
+#endif
+
+/* Portable kernel, used where there is no vector unit and when selected by tar_set_check_kernel() */
+static void sum_block_scalar(const uint8_t *block, struct block_sums *sums) {
+    uint32_t sum = 0, high = 0;
+    uint8_t any = 0;
+    for (int i = 0; i < HEADER_SIZE; i++) {
+        sum += block[i];
+        high += block[i] >> 7;
+        any |= block[i];
+    }
+    sums->sum = sum;
+    sums->high = high;
+    sums->zero = any == 0;
+}
+
+static int check_kernel = TAR_CHECK_DEFAULT;
+
+/* Sums a header block with the widest vector unit of the CPU, unless the portable kernel was selected */
+static void sum_block(const uint8_t *block, struct block_sums *sums) {
+#if defined(__x86_64__)
+    if (__atomic_load_n(&check_kernel, __ATOMIC_RELAXED) == TAR_CHECK_DEFAULT) {
+        if (__builtin_cpu_supports("avx2")) {
+            sum_block_avx2(block, sums);
+        } else {
+            sum_block_sse2(block, sums);
+        }
+        return;
+    }
+#endif
+    sum_block_scalar(block, sums);
+}
+
+/**
+ * Selects the kernel summing the header blocks.
+ */
+int tar_set_check_kernel(int kernel) {
+    if (kernel != TAR_CHECK_DEFAULT && kernel != TAR_CHECK_SCALAR) {
+        return -1;
+    }
+    __atomic_store_n(&check_kernel, kernel, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Decodes an octal field: leading spaces are skipped and the number ends at the first non-octal character */
+static uint64_t decode_octal(const char *field, size_t len) {
+    size_t i = 0;
+    uint64_t value = 0;
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = (value << 3) | (uint64_t) (field[i] - '0');
+    }
+    return value;
+}
+
+/**
+ * Decodes a numeric field, in octal or in the base-256 encoding of GNU tar and star for values that do not fit:
+ * the first byte has its high bit set and the remaining bits of the field are a big-endian binary number.
+ * Negative base-256 values, which only make sense for times, are decoded as zero.
+ */
+static uint64_t decode_number(const char *field, size_t len) {
+    const uint8_t *bytes = (const uint8_t *) field;
+    if ((bytes[0] & 0x80) == 0) {
+        return decode_octal(field, len);
+    }
+    if (bytes[0] & 0x40) {
+        return 0;
+    }
+    uint64_t value = bytes[0] & 0x3f;
+    for (size_t i = 1; i < len; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/**
+ * Validates a header block and decodes its numeric fields, reading the block only once.
+ *
+ * The checksum is the sum of the bytes of the block with the chksum field taken as spaces. POSIX sums the bytes
+ * as unsigned chars but some old implementations used signed chars, both are accepted like GNU tar does.
+ *
+ * @return zero if the header is valid,
+ *         1 if the block is all zeros, which marks the end of the archive,
+ *         -1, -2 or -3 for an invalid magic value, version value or checksum, as check_archive().
+ */
+static int check_header(const tar_header_t *hdr, struct header_fields *fields) {
+    const uint8_t *block = (const uint8_t *) hdr;
+    struct block_sums sums;
+    sum_block(block, &sums);
+    if (sums.zero) {
+        return 1;
+    }
+
+    uint32_t field_sum = 0, field_high = 0;
+    for (size_t i = 0; i < sizeof(hdr->chksum); i++) {
+        field_sum += block[148 + i];
+        field_high += block[148 + i] >> 7;
+    }
+    uint32_t unsigned_sum = sums.sum - field_sum + sizeof(hdr->chksum) * ' ';
+    uint32_t signed_sum = unsigned_sum - 256 * (sums.high - field_high);
+
+    fields->size = decode_number(hdr->size, sizeof(hdr->size));
+    fields->mtime = decode_number(hdr->mtime, sizeof(hdr->mtime));
+    fields->mode = decode_octal(hdr->mode, sizeof(hdr->mode));
+    fields->chksum = decode_octal(hdr->chksum, sizeof(hdr->chksum));
+
+    // GNU tar writes "ustar  " and a null over the magic and the version
+    int gnu = memcmp(hdr->magic, GNU_MAGIC, sizeof(GNU_MAGIC)) == 0;
+    if (!gnu && memcmp(hdr->magic, TMAGIC, TMAGLEN) != 0) {
+        return -1;
+    }
+    if (!gnu && decode_octal(hdr->version, TVERSLEN) != decode_octal(TVERSION, TVERSLEN)) {
+        return -2;
+    }
+    if (fields->chksum != unsigned_sum && fields->chksum != signed_sum) {
+        return -3;
+    }
+    return 0;
+}
+
+/* Attributes of PAX extended headers overriding the ustar fields, NULL or -1 when unset */
+struct pax_attrs {
+    char *path;
+    char *linkpath;
+    int64_t size;
+    int64_t mtime;
+    int64_t uid;
+    int64_t gid;
+    // GNU sparse files: the real name and size, and the map of format 0.1 or the major version of format 1.0
+    char *sparse_name;
+    char *sparse_map;
+    int64_t sparse_size;
+    int64_t sparse_major;
+};
+
+#define PAX_UNSET { NULL, NULL, -1, -1, -1, -1, NULL, NULL, -1, -1 }
+
+/* A member decoded from its header and the extension headers in front of it */
+struct member {
+    off_t offset;               // offset of the header of the member itself
+    off_t data;                 // offset of its first data byte
+    const char *name;           // points to name_buf or to long_name
+    const char *linkname;       // points to link_buf or to long_link
+    uint64_t size;
+    uint64_t mtime;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    char typeflag;
+    // prefix, slash, name and null
+    char name_buf[sizeof(((tar_header_t *) 0)->prefix) + sizeof(((tar_header_t *) 0)->name) + 2];
+    char link_buf[sizeof(((tar_header_t *) 0)->linkname) + 1];
+    char *long_name;
+    char *long_link;
+    // Set for a sparse file, size is then its real size and data the offset of the runs stored back to back
+    int sparse;
+    struct sparse_segment *segments;
+    size_t no_segments;
+};
+
+/* State of a walk over the members of an archive, see walk_next() */
+struct tar_walk {
+    const tar_archive_t *ar;
+    off_t offset;               // offset of the next header
+    struct pax_attrs global;    // attributes of the 'g' headers, which apply to every member that follows
+};
+
+static void pax_release(struct pax_attrs *attrs) {
+    free(attrs->path);
+    free(attrs->linkpath);
+    free(attrs->sparse_name);
+    free(attrs->sparse_map);
+}
+
+static void member_release(struct member *m) {
+    free(m->long_name);
+    free(m->long_link);
+    free(m->segments);
+    m->long_name = NULL;
+    m->long_link = NULL;
+    m->segments = NULL;
+}
+
+static void walk_release(struct tar_walk *walk) {
+    pax_release(&walk->global);
+}
+
+/* Returns the data of an extension header, in the mapping or in an allocated buffer that *owned is set to */
+static const char *extension_data(const tar_archive_t *ar, off_t offset, uint64_t size, char **owned) {
+    *owned = NULL;
+    // Extension headers hold a few paths, anything bigger is a corrupted archive
+    if (size > (1 << 20)) {
+        return NULL;
+    }
+    if (ar->map != NULL) {
+        return (size_t) offset + size <= ar->map_len ? (const char *) ar->map + offset : NULL;
+    }
+    *owned = malloc(size + 1);
+    if (*owned == NULL || read_at(ar, offset, *owned, size) == -1) {
+        free(*owned);
+        *owned = NULL;
+        return NULL;
+    }
+    return *owned;
+}
+
+static char *copy_string(const char *str, size_t len) {
+    char *copy = malloc(len + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/* Parses the "length key=value\n" records of a PAX extended header into attrs */
+static int parse_pax(const char *data, uint64_t size, struct pax_attrs *attrs) {
+    const char *end = data + size;
+    while (data < end && *data != '\0') {
+        uint64_t len = 0;
+        const char *p = data;
+        while (p < end && *p >= '0' && *p <= '9') {
+            len = len * 10 + (*p++ - '0');
+        }
+        // The record must hold its length, the space, a key and the newline
+        if (p == data || p >= end || *p != ' ' || len > (uint64_t) (end - data) || len < (uint64_t) (p - data) + 3) {
+            return -1;
+        }
+        const char *key = p + 1;
+        const char *record_end = data + len - 1;   // the trailing newline
+        const char *eq = memchr(key, '=', record_end - key);
+        if (eq == NULL || *record_end != '\n') {
+            return -1;
+        }
+        size_t key_len = eq - key;
+        const char *value = eq + 1;
+        size_t value_len = record_end - value;
+
+        if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+            free(attrs->path);
+            attrs->path = copy_string(value, value_len);
+        } else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0) {
+            free(attrs->linkpath);
+            attrs->linkpath = copy_string(value, value_len);
+        } else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+            attrs->size = strtoll(value, NULL, 10);
+        } else if (key_len == 5 && memcmp(key, "mtime", 5) == 0) {
+            // Fractional seconds are dropped
+            attrs->mtime = strtoll(value, NULL, 10);
+        } else if (key_len == 3 && memcmp(key, "uid", 3) == 0) {
+            attrs->uid = strtoll(value, NULL, 10);
+        } else if (key_len == 3 && memcmp(key, "gid", 3) == 0) {
+            attrs->gid = strtoll(value, NULL, 10);
+        } else if (key_len == 15 && memcmp(key, "GNU.sparse.name", 15) == 0) {
+            free(attrs->sparse_name);
+            attrs->sparse_name = copy_string(value, value_len);
+        } else if (key_len == 14 && memcmp(key, "GNU.sparse.map", 14) == 0) {
+            free(attrs->sparse_map);
+            attrs->sparse_map = copy_string(value, value_len);
+        } else if ((key_len == 15 && memcmp(key, "GNU.sparse.size", 15) == 0)
+                   || (key_len == 19 && memcmp(key, "GNU.sparse.realsize", 19) == 0)) {
+            attrs->sparse_size = strtoll(value, NULL, 10);
+        } else if (key_len == 16 && memcmp(key, "GNU.sparse.major", 16) == 0) {
+            attrs->sparse_major = strtoll(value, NULL, 10);
+        }
+        data += len;
+    }
+    return 0;
+}
+
+/*
+ * Sparse files of GNU tar. Only the runs of data are stored, back to back, and a map gives their place in the file,
+ * the rest being holes. The old GNU format ('S') keeps the map in the header and in extension blocks following it,
+ * format 1.0 of PAX in decimal lines in the first blocks of the data, and format 0.1 in the GNU.sparse.map record.
+ */
+
+// Old GNU header: 4 runs of 12-byte offset and size fields, the extension flag and the real size of the file
+#define OLDGNU_SPARSE 386
+#define OLDGNU_EXTENDED 482
+#define OLDGNU_REALSIZE 483
+#define OLDGNU_RUNS 4
+// Extension block: 21 runs, then the extension flag
+#define SPARSE_EXT_RUNS 21
+#define SPARSE_EXT_EXTENDED 504
+
+/* Appends a run to the map of a member, returns -1 if it overlaps the previous one or goes past the real size */
+static int add_segment(struct member *m, uint64_t offset, uint64_t size, uint64_t real_size, size_t *cap) {
+    uint64_t stored = 0, end = 0;
+    if (m->no_segments > 0) {
+        const struct sparse_segment *last = &m->segments[m->no_segments - 1];
+        stored = last->stored + last->size;
+        end = last->offset + last->size;
+    }
+    if (offset < end || offset > real_size || size > real_size - offset) {
+        return -1;
+    }
+    // GNU tar ends the map with an empty run at the real size when the file ends with a hole
+    if (size == 0) {
+        return 0;
+    }
+    if (m->no_segments == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 8;
+        struct sparse_segment *segments = realloc(m->segments, new_cap * sizeof(struct sparse_segment));
+        if (segments == NULL) {
+            return -1;
+        }
+        m->segments = segments;
+        *cap = new_cap;
+    }
+    m->segments[m->no_segments++] = (struct sparse_segment) { offset, size, stored };
+    return 0;
+}
+
+/* Adds the runs of an old GNU header or extension block, returns -1 if one is invalid */
+static int add_oldgnu_runs(struct member *m, const char *runs, int no_runs, uint64_t real_size, size_t *cap) {
+    for (int i = 0; i < no_runs && runs[24 * i] != '\0'; i++) {
+        uint64_t offset = decode_number(runs + 24 * i, 12);
+        uint64_t size = decode_number(runs + 24 * i + 12, 12);
+        if (add_segment(m, offset, size, real_size, cap) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Parses a number ending with a newline in the blocks of a PAX 1.0 map, moving *pos past it */
+static int map_number(const tar_archive_t *ar, off_t *pos, off_t end, tar_header_t *scratch, uint64_t *value) {
+    const char *block = NULL;
+    int digits = 0;
+    *value = 0;
+    for (; *pos < end; (*pos)++) {
+        if (block == NULL || *pos % HEADER_SIZE == 0) {
+            block = (const char *) header_at(ar, *pos - *pos % HEADER_SIZE, scratch);
+            if (block == NULL) {
+                return -1;
+            }
+        }
+        char c = block[*pos % HEADER_SIZE];
+        if (c == '\n' && digits > 0) {
+            (*pos)++;
+            return 0;
+        }
+        if (c < '0' || c > '9' || ++digits > 19) {
+            return -1;
+        }
+        *value = *value * 10 + (c - '0');
+    }
+    return -1;
+}
+
+/**
+ * Reads the map of a sparse member, whose data starts at data and takes stored bytes in the archive, and sets the
+ * real size and the offset of the runs in m.
+ *
+ * @return the offset of the header after the member, or -1 if the map is invalid or memory could not be allocated.
+ */
+static off_t parse_sparse(const tar_archive_t *ar, const tar_header_t *hdr, const struct pax_attrs *attrs,
+                          struct member *m, off_t data, uint64_t stored) {
+    size_t cap = 0;
+    tar_header_t scratch;
+    if (hdr->typeflag == GNUTYPE_SPARSE) {
+        const char *block = (const char *) hdr;
+        uint64_t real_size = decode_number(block + OLDGNU_REALSIZE, 12);
+        int extended = block[OLDGNU_EXTENDED];
+        if (add_oldgnu_runs(m, block + OLDGNU_SPARSE, OLDGNU_RUNS, real_size, &cap) == -1) {
+            return -1;
+        }
+        // The extension blocks come before the data, hdr may not be used from here on
+        for (; extended; data += HEADER_SIZE) {
+            block = (const char *) header_at(ar, data, &scratch);
+            if (block == NULL || add_oldgnu_runs(m, block, SPARSE_EXT_RUNS, real_size, &cap) == -1) {
+                return -1;
+            }
+            extended = block[SPARSE_EXT_EXTENDED];
+        }
+        m->size = real_size;
+        m->data = data;
+    } else if (attrs->sparse_size < 0) {
+        return -1;
+    } else if (attrs->sparse_major == 1) {
+        // Number of runs then offset and size of each one, the runs starting at the next block
+        off_t pos = data, end = data + stored;
+        uint64_t no_runs, offset, size;
+        if (map_number(ar, &pos, end, &scratch, &no_runs) == -1 || no_runs > stored / 4) {
+            return -1;
+        }
+        for (uint64_t i = 0; i < no_runs; i++) {
+            if (map_number(ar, &pos, end, &scratch, &offset) == -1 || map_number(ar, &pos, end, &scratch, &size) == -1
+                || add_segment(m, offset, size, attrs->sparse_size, &cap) == -1) {
+                return -1;
+            }
+        }
+        m->size = attrs->sparse_size;
+        m->data = data + padded_size(pos - data);
+        stored -= m->data - data;
+    } else {
+        // Comma-separated offsets and sizes
+        const char *p = attrs->sparse_map;
+        while (*p != '\0') {
+            char *end;
+            uint64_t offset = strtoull(p, &end, 10);
+            if (*end != ',') {
+                return -1;
+            }
+            uint64_t size = strtoull(end + 1, &end, 10);
+            if ((*end != ',' && *end != '\0') || add_segment(m, offset, size, attrs->sparse_size, &cap) == -1) {
+                return -1;
+            }
+            p = *end == ',' ? end + 1 : end;
+        }
+        m->size = attrs->sparse_size;
+        m->data = data;
+    }
+
+    const struct sparse_segment *last = m->no_segments > 0 ? &m->segments[m->no_segments - 1] : NULL;
+    if (last != NULL && last->stored + last->size > stored) {
+        return -1;
+    }
+    m->sparse = 1;
+    m->typeflag = REGTYPE;
+    return m->data + padded_size(stored);
+}
+
+/**
+ * Decodes the next member of an archive, applying the PAX ('x' and 'g') and GNU long name ('L' and 'K') headers
+ * in front of it, and moves the walk to the header that follows its data.
+ * The member must be released with member_release() once used.
+ *
+ * @return 1 if a member was decoded, zero at the end of the archive, -1 if a header fails the checks of
+ *         check_archive(), an extension header is invalid or memory could not be allocated.
+ */
+static int walk_next(struct tar_walk *walk, struct member *m) {
+    struct pax_attrs local = PAX_UNSET;
+    tar_header_t scratch;
+    const tar_header_t *hdr;
+    struct header_fields fields;
+    int ret = 0;
+
+    m->long_name = NULL;
+    m->long_link = NULL;
+    m->segments = NULL;
+    m->no_segments = 0;
+    m->sparse = 0;
+    while ((hdr = header_at(walk->ar, walk->offset, &scratch)) != NULL) {
+        // Headers are validated as by check_archive(), the walk ends at the first block of zeros
+        int valid = check_header(hdr, &fields);
+        if (valid != 0) {
+            ret = valid == 1 ? 0 : -1;
+            break;
+        }
+        uint64_t size = fields.size;
+        off_t data = walk->offset + HEADER_SIZE;
+        // Reading the extension data may reuse the buffer hdr points to, when the archive is streamed
+        char typeflag = hdr->typeflag;
+        char *owned;
+        const char *ext;
+
+        switch (typeflag) {
+            case XHDTYPE:
+            case XGLTYPE:
+                ext = extension_data(walk->ar, data, size, &owned);
+                ret = ext == NULL ? -1 : parse_pax(ext, size, typeflag == XHDTYPE ? &local : &walk->global);
+                free(owned);
+                break;
+            case GNUTYPE_LONGNAME:
+            case GNUTYPE_LONGLINK:
+                ext = extension_data(walk->ar, data, size, &owned);
+                if (ext == NULL) {
+                    ret = -1;
+                } else if (typeflag == GNUTYPE_LONGNAME) {
+                    free(m->long_name);
+                    m->long_name = copy_string(ext, strnlen(ext, size));
+                } else {
+                    free(m->long_link);
+                    m->long_link = copy_string(ext, strnlen(ext, size));
+                }
+                free(owned);
+                break;
+            default:
+                m->offset = walk->offset;
+                m->data = data;
+                m->typeflag = hdr->typeflag;
+                m->mode = decode_octal(hdr->mode, sizeof(hdr->mode));
+                m->size = local.size >= 0 ? (uint64_t) local.size : walk->global.size >= 0 ? (uint64_t) walk->global.size : size;
+                m->mtime = local.mtime >= 0 ? (uint64_t) local.mtime : walk->global.mtime >= 0 ? (uint64_t) walk->global.mtime
+                           : decode_number(hdr->mtime, sizeof(hdr->mtime));
+                // The PAX records of the entry take over the global ones, which take over the header
+                int64_t uid = local.uid >= 0 ? local.uid : walk->global.uid;
+                int64_t gid = local.gid >= 0 ? local.gid : walk->global.gid;
+                m->uid = (uint32_t) (uid >= 0 ? (uint64_t) uid : decode_number(hdr->uid, sizeof(hdr->uid)));
+                m->gid = (uint32_t) (gid >= 0 ? (uint64_t) gid : decode_number(hdr->gid, sizeof(hdr->gid)));
+
+                // A PAX path takes over a GNU long name, which takes over the ustar prefix and name
+                const char *path = local.sparse_name ? local.sparse_name : local.path ? local.path : walk->global.path;
+                if (path != NULL) {
+                    free(m->long_name);
+                    m->long_name = strdup(path);
+                }
+                if (m->long_name != NULL) {
+                    m->name = m->long_name;
+                } else {
+                    size_t prefix_len = 0;
+                    // Only POSIX ustar headers have a prefix, GNU tar stores other things in that field
+                    if (memcmp(hdr->magic, TMAGIC, TMAGLEN) == 0 && hdr->prefix[0] != '\0') {
+                        prefix_len = strnlen(hdr->prefix, sizeof(hdr->prefix));
+                        memcpy(m->name_buf, hdr->prefix, prefix_len);
+                        m->name_buf[prefix_len++] = '/';
+                    }
+                    size_t name_len = strnlen(hdr->name, sizeof(hdr->name));
+                    memcpy(m->name_buf + prefix_len, hdr->name, name_len);
+                    m->name_buf[prefix_len + name_len] = '\0';
+                    m->name = m->name_buf;
+                }
+
+                const char *linkpath = local.linkpath ? local.linkpath : walk->global.linkpath;
+                if (linkpath != NULL) {
+                    free(m->long_link);
+                    m->long_link = strdup(linkpath);
+                }
+                if (m->long_link != NULL) {
+                    m->linkname = m->long_link;
+                } else {
+                    size_t link_len = strnlen(hdr->linkname, sizeof(hdr->linkname));
+                    memcpy(m->link_buf, hdr->linkname, link_len);
+                    m->link_buf[link_len] = '\0';
+                    m->linkname = m->link_buf;
+                }
+
+                // The map of a sparse file comes last, reading it may reuse the buffer hdr points to
+                off_t next = data + padded_size(m->size);
+                if (typeflag == GNUTYPE_SPARSE || local.sparse_major == 1 || local.sparse_map != NULL) {
+                    next = parse_sparse(walk->ar, hdr, &local, m, data, m->size);
+                }
+                pax_release(&local);
+                if ((path != NULL && m->long_name == NULL) || (linkpath != NULL && m->long_link == NULL) || next == -1) {
+                    member_release(m);
+                    return -1;
+                }
+                STAT_ADD(bytes_skipped, next - data);
+                walk->offset = next;
+                return 1;
+        }
+        if (ret == -1) {
+            break;
+        }
+        walk->offset = data + padded_size(size);
+    }
+    pax_release(&local);
+    member_release(m);
+    return ret;
+}
+
+/* FNV-1a, the paths are short and this is cheap enough */
+static size_t hash_path(const char *path) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*path) {
+        h ^= (unsigned char) *path++;
+        h *= 1099511628211ULL;
+    }
+    return (size_t) h;
+}
+
+/* Same as hash_path() on the first len bytes of path */
+static size_t hash_prefix(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    while (len-- > 0) {
+        h ^= (unsigned char) *path++;
+        h *= 1099511628211ULL;
+    }
+    return (size_t) h;
+}
+
+static size_t *find_bucket(const tar_archive_t *ar, const char *path) {
+    size_t mask = ar->no_buckets - 1;
+    size_t i = hash_path(path) & mask;
+    while (ar->buckets[i] != 0 && strcmp(ar->entries[ar->buckets[i] - 1].name, path) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &ar->buckets[i];
+}
+
+/* Same as find_bucket() for the path made of the first len bytes of path, which needs no copy */
+static size_t *find_bucket_prefix(const tar_archive_t *ar, const char *path, size_t len) {
+    size_t mask = ar->no_buckets - 1;
+    size_t i = hash_prefix(path, len) & mask;
+    while (ar->buckets[i] != 0) {
+        const char *name = ar->entries[ar->buckets[i] - 1].name;
+        if (strncmp(name, path, len) == 0 && name[len] == '\0') {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &ar->buckets[i];
+}
+
+/*
+ * The names of the entries, and the maps of the sparse files, are copied into big blocks owned by the handle, so
+ * that indexing does not allocate twice per entry and closing frees a few blocks instead of every name.
+ */
+#define ARENA_BLOCK (64 << 10)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    _Alignas(8) char data[];
+};
+
+/* Returns len bytes owned by the arena, aligned on align which is a power of two, or NULL if memory ran out */
+static void *arena_alloc(struct arena_block **arena, size_t len, size_t align) {
+    struct arena_block *block = *arena;
+    size_t start = block != NULL ? (block->used + align - 1) & ~(align - 1) : 0;
+    if (block == NULL || start > block->size || block->size - start < len) {
+        size_t size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+        block = malloc(sizeof(struct arena_block) + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->used = 0;
+        block->size = size;
+        if (*arena != NULL && size > ARENA_BLOCK) {
+            // Anything bigger than a block gets its own, behind the current block which may still have room
+            block->next = (*arena)->next;
+            (*arena)->next = block;
+        } else {
+            block->next = *arena;
+            *arena = block;
+        }
+        start = 0;
+    }
+    block->used = start + len;
+    return block->data + start;
+}
+
+/* Copies the first len bytes of str as a string owned by the arena, returns NULL if memory ran out */
+static const char *arena_copy(struct arena_block **arena, const char *str, size_t len) {
+    if (len == 0) {
+        return "";
+    }
+    char *copy = arena_alloc(arena, len + 1, 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+static void arena_free(struct arena_block *arena) {
+    while (arena != NULL) {
+        struct arena_block *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+static int grow_buckets(tar_archive_t *ar) {
+    size_t *old = ar->buckets;
+    size_t old_no = ar->no_buckets;
+
+    ar->no_buckets = old_no ? old_no * 2 : 64;
+    ar->buckets = calloc(ar->no_buckets, sizeof(size_t));
+    if (ar->buckets == NULL) {
+        ar->buckets = old;
+        ar->no_buckets = old_no;
+        return -1;
+    }
+    for (size_t i = 0; i < old_no; i++) {
+        if (old[i] != 0) {
+            *find_bucket(ar, ar->entries[old[i] - 1].name) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/* Appends an entry to the index, copying the first name_len bytes of name and linkname into the arena */
+static int append_entry(tar_archive_t *ar, const char *name, size_t name_len, const char *linkname, off_t offset,
+                        uint64_t size, char typeflag) {
+    if (ar->no_entries == ar->cap_entries) {
+        size_t cap = ar->cap_entries ? ar->cap_entries * 2 : 64;
+        tar_entry_t *entries = realloc(ar->entries, cap * sizeof(tar_entry_t));
+        if (entries != NULL) {
+            ar->entries = entries;
+        }
+        struct tree_node *nodes = realloc(ar->nodes, cap * sizeof(struct tree_node));
+        if (nodes != NULL) {
+            ar->nodes = nodes;
+        }
+        if (entries == NULL || nodes == NULL) {
+            return -1;
+        }
+        ar->cap_entries = cap;
+    }
+    // Keep the load factor under one half
+    if (2 * (ar->no_entries + 1) > ar->no_buckets && grow_buckets(ar) == -1) {
+        return -1;
+    }
+
+    tar_entry_t *entry = &ar->entries[ar->no_entries];
+    entry->name = arena_copy(&ar->arena, name, name_len);
+    entry->linkname = arena_copy(&ar->arena, linkname, strlen(linkname));
+    if (entry->name == NULL || entry->linkname == NULL) {
+        return -1;
+    }
+    entry->offset = offset;
+    entry->size = size;
+    entry->typeflag = typeflag;
+    // Implied directories keep these, the walks set them from the header
+    entry->mode = typeflag == DIRTYPE ? 0755 : 0644;
+    entry->uid = 0;
+    entry->gid = 0;
+    entry->mtime = 0;
+    ar->nodes[ar->no_entries] = (struct tree_node) { NO_NODE, NO_NODE, NO_NODE, NO_NODE, NO_NODE, NULL };
+    ar->no_entries++;
+
+    // A path archived twice resolves to its last occurrence, as tar does on extraction
+    *find_bucket(ar, entry->name) = ar->no_entries;
+    return 0;
+}
+
+/* Keeps the map of sparse entry i in the arena, returns -1 if memory ran out */
+static int add_sparse(tar_archive_t *ar, size_t i, const struct sparse_segment *segments, size_t no_segments,
+                      off_t data) {
+    size_t len = sizeof(struct sparse_file) + no_segments * sizeof(struct sparse_segment);
+    struct sparse_file *file = arena_alloc(&ar->arena, len, _Alignof(struct sparse_file));
+    if (file == NULL) {
+        return -1;
+    }
+    struct sparse_segment *copy = (struct sparse_segment *) (file + 1);
+    memcpy(copy, segments, no_segments * sizeof(struct sparse_segment));
+    *file = (struct sparse_file) { copy, no_segments, data, ar->entries[i].size };
+    ar->nodes[i].sparse = file;
+    return 0;
+}
+
+static struct tree_node *tree_node(tar_archive_t *ar, size_t i) {
+    return i == NO_NODE ? &ar->root : &ar->nodes[i];
+}
+
+static int link_entry(tar_archive_t *ar, size_t i);
+
+/**
+ * Returns the directory holding an entry, NO_NODE for the root of the archive.
+ * A directory that has no header of its own but is implied by the path of the entry is added to the index,
+ * with an offset of -1. err is set to -1 if memory could not be allocated.
+ */
+static size_t parent_dir(tar_archive_t *ar, const char *name, int *err) {
+    size_t len = strlen(name);
+    // The parent is the prefix up to the last slash, a trailing slash does not count
+    if (len > 0 && name[len - 1] == '/') {
+        len--;
+    }
+    while (len > 0 && name[len - 1] != '/') {
+        len--;
+    }
+    if (len == 0) {
+        return NO_NODE;
+    }
+
+    size_t b = *find_bucket_prefix(ar, name, len);
+    if (b != 0) {
+        return b - 1;
+    }
+    // Linking the new directory may add its own implied parents after it
+    size_t i = ar->no_entries;
+    if (append_entry(ar, name, len, "", -1, 0, DIRTYPE) == -1 || link_entry(ar, i) == -1) {
+        *err = -1;
+        return NO_NODE;
+    }
+    return i;
+}
+
+/* Appends an entry to the children of its directory */
+static int link_entry(tar_archive_t *ar, size_t i) {
+    int err = 0;
+    size_t parent = parent_dir(ar, ar->entries[i].name, &err);
+    if (err != 0) {
+        return -1;
+    }
+    struct tree_node *dir = tree_node(ar, parent);
+    ar->nodes[i].parent = parent;
+    if (dir->last_child == NO_NODE) {
+        dir->first_child = i;
+    } else {
+        ar->nodes[dir->last_child].next_sibling = i;
+    }
+    dir->last_child = i;
+    return 0;
+}
+
+/*
+ * Links are resolved once, when the index is built. The target of a symlink is taken relative to the directory of
+ * the link, the target of a hard link is a path from the root of the archive. Both are canonicalized, the symlinks
+ * met in the directories of a target are followed, and chains of links are collapsed: every link ends up pointing
+ * straight at an entry that is not a link, or at nothing when it dangles or is part of a cycle.
+ */
+
+// Marks a link whose target has not been resolved yet
+#define UNRESOLVED (NO_NODE - 1)
+// Bound on the number of links followed to resolve one, as the kernel does with ELOOP
+#define MAX_HOPS 40
+
+static size_t resolve_link(tar_archive_t *ar, size_t i, int depth);
+
+static int is_link(const tar_entry_t *entry) {
+    return entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE;
+}
+
+/* Drops the "." and empty components of a path and folds its ".." in place, returns -1 if it goes above the root */
+static int canonicalize(char *path) {
+    char *out = path;
+    const char *in = path;
+    while (*in != '\0') {
+        const char *end = strchrnul(in, '/');
+        size_t len = end - in;
+        if (len == 2 && in[0] == '.' && in[1] == '.') {
+            if (out == path) {
+                return -1;
+            }
+            while (out > path && out[-1] != '/') {
+                out--;
+            }
+            if (out > path) {
+                out--;
+            }
+        } else if (len > 0 && !(len == 1 && in[0] == '.')) {
+            // The output never catches up with the input, which is at least one slash ahead
+            if (out != path) {
+                *out++ = '/';
+            }
+            memmove(out, in, len);
+            out += len;
+        }
+        in = *end == '/' ? end + 1 : end;
+    }
+    *out = '\0';
+    return 0;
+}
+
+/* Returns the canonical path of the target of a link, allocated, or NULL if it dangles or memory ran out */
+static char *link_target(const tar_archive_t *ar, size_t i) {
+    const tar_entry_t *entry = &ar->entries[i];
+    size_t dir_len = 0;
+    if (entry->typeflag == SYMTYPE && entry->linkname[0] != '/') {
+        dir_len = strlen(entry->name);
+        if (dir_len > 0 && entry->name[dir_len - 1] == '/') {
+            dir_len--;
+        }
+        while (dir_len > 0 && entry->name[dir_len - 1] != '/') {
+            dir_len--;
+        }
+    }
+    size_t link_len = strlen(entry->linkname);
+    char *path = malloc(dir_len + link_len + 1);
+    if (path == NULL) {
+        return NULL;
+    }
+    memcpy(path, entry->name, dir_len);
+    memcpy(path + dir_len, entry->linkname, link_len + 1);
+    if (canonicalize(path) == -1) {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+/* Finds a canonical path among the names of the archive, which may end with a slash or start with "./" */
+static size_t find_entry(const tar_archive_t *ar, const char *path) {
+    size_t b = *find_bucket(ar, path);
+    if (b != 0) {
+        return b - 1;
+    }
+    size_t len = strlen(path);
+    char *name = malloc(len + 4);
+    if (name == NULL) {
+        return NO_NODE;
+    }
+    // Tries "path/", "./path" and "./path/"
+    memcpy(name + 2, path, len);
+    memcpy(name + 2 + len, "/", 2);
+    b = *find_bucket(ar, name + 2);
+    if (b == 0) {
+        memcpy(name, "./", 2);
+        name[2 + len] = '\0';
+        b = *find_bucket(ar, name);
+    }
+    if (b == 0) {
+        name[2 + len] = '/';
+        b = *find_bucket(ar, name);
+    }
+    free(name);
+    return b - 1;
+}
+
+/* Finds the entry at a canonical path, following the symlinks met in its directories */
+static size_t lookup_path(tar_archive_t *ar, const char *path, int depth) {
+    size_t found = path[0] != '\0' ? find_entry(ar, path) : NO_NODE;
+    if (found != NO_NODE) {
+        return found;
+    }
+    for (const char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        char *dir = strndup(path, slash - path);
+        size_t i = dir != NULL ? find_entry(ar, dir) : NO_NODE;
+        free(dir);
+        if (i == NO_NODE) {
+            return NO_NODE;
+        }
+        if (ar->entries[i].typeflag != SYMTYPE) {
+            continue;
+        }
+        // The rest of the path is looked up again under the directory the symlink points to
+        size_t target = resolve_link(ar, i, depth + 1);
+        if (target == NO_NODE || ar->entries[target].typeflag != DIRTYPE) {
+            return NO_NODE;
+        }
+        const char *name = ar->entries[target].name;
+        size_t name_len = strlen(name);
+        char *joined = malloc(name_len + strlen(slash) + 1);
+        if (joined == NULL) {
+            return NO_NODE;
+        }
+        memcpy(joined, name, name_len);
+        strcpy(joined + name_len, slash);
+        found = canonicalize(joined) == 0 ? lookup_path(ar, joined, depth + 1) : NO_NODE;
+        free(joined);
+        return found;
+    }
+    return NO_NODE;
+}
+
+/* Returns the entry link i finally points to, or NO_NODE, memoizing it */
+static size_t resolve_link(tar_archive_t *ar, size_t i, int depth) {
+    if (ar->nodes[i].target != UNRESOLVED) {
+        return ar->nodes[i].target;
+    }
+    // Resolving a link in progress again means a cycle, which dangles
+    ar->nodes[i].target = NO_NODE;
+    size_t target = NO_NODE;
+    char *path = depth < MAX_HOPS ? link_target(ar, i) : NULL;
+    if (path != NULL) {
+        target = lookup_path(ar, path, depth);
+        free(path);
+    }
+    if (target != NO_NODE && is_link(&ar->entries[target])) {
+        target = resolve_link(ar, target, depth + 1);
+    }
+    ar->nodes[i].target = target;
+    return target;
+}
+
+/* Resolves every link of the archive, the other entries being their own target */
+static void resolve_links(tar_archive_t *ar) {
+    for (size_t i = 0; i < ar->no_entries; i++) {
+        ar->nodes[i].target = is_link(&ar->entries[i]) ? UNRESOLVED : i;
+    }
+    for (size_t i = 0; i < ar->no_entries; i++) {
+        resolve_link(ar, i, 0);
+    }
+}
+
+static int compare_names(const void *a, const void *b, void *arg) {
+    const tar_entry_t *entries = arg;
+    return strcmp(entries[*(const size_t *) a].name, entries[*(const size_t *) b].name);
+}
+
+/* Sorts the names of the entries of the tree, for tar_query() */
+static int sort_paths(tar_archive_t *ar) {
+    ar->sorted = malloc((ar->no_entries + 1) * sizeof(size_t));
+    if (ar->sorted == NULL) {
+        return -1;
+    }
+    ar->no_sorted = 0;
+    for (size_t i = 0; i < ar->no_entries; i++) {
+        if (*find_bucket(ar, ar->entries[i].name) == i + 1) {
+            ar->sorted[ar->no_sorted++] = i;
+        }
+    }
+    qsort_r(ar->sorted, ar->no_sorted, sizeof(size_t), compare_names, ar->entries);
+    return 0;
+}
+
+/* Builds the directory tree once every header has been indexed, and resolves the links */
+static int build_tree(tar_archive_t *ar) {
+    ar->root = (struct tree_node) { NO_NODE, NO_NODE, NO_NODE, NO_NODE, NO_NODE, NULL };
+    size_t no_headers = ar->no_entries;
+    for (size_t i = 0; i < no_headers; i++) {
+        // Only the last occurrence of a path archived twice is part of the tree
+        if (*find_bucket(ar, ar->entries[i].name) != i + 1) {
+            continue;
+        }
+        if (link_entry(ar, i) == -1) {
+            return -1;
+        }
+    }
+    resolve_links(ar);
+    return sort_paths(ar);
+}
+
+/* Allocates an empty handle on the archive behind fd */
+static tar_archive_t *new_archive(int fd, const struct stat *st) {
+    tar_archive_t *ar = calloc(1, sizeof(tar_archive_t));
+    if (ar == NULL) {
+        return NULL;
+    }
+    ar->fd = fd;
+    ar->dev = st->st_dev;
+    ar->ino = st->st_ino;
+    ar->st_size = st->st_size;
+    ar->mtime = st->st_mtim;
+    if (grow_buckets(ar) == -1) {
+        tar_close(ar);
+        return NULL;
+    }
+    return ar;
+}
+
+/* Indexes every header of the archive and builds the directory tree */
+static int index_headers(tar_archive_t *ar) {
+    struct tar_walk walk = { ar, 0, PAX_UNSET };
+    struct member m;
+    int ret;
+    // One pass over the headers, the data blocks are skipped
+    while ((ret = walk_next(&walk, &m)) == 1) {
+        ret = append_entry(ar, m.name, strlen(m.name), m.linkname, m.offset, m.size, m.typeflag);
+        if (ret == 0) {
+            ar->entries[ar->no_entries - 1].mode = m.mode & 07777;
+            ar->entries[ar->no_entries - 1].uid = m.uid;
+            ar->entries[ar->no_entries - 1].gid = m.gid;
+            ar->entries[ar->no_entries - 1].mtime = m.mtime;
+            if (m.sparse) {
+                ret = add_sparse(ar, ar->no_entries - 1, m.segments, m.no_segments, m.data);
+            }
+        }
+        member_release(&m);
+        if (ret == -1) {
+            break;
+        }
+    }
+    walk_release(&walk);
+    return ret == -1 ? -1 : build_tree(ar);
+}
+
+/**
+ * Indexes an archive.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file. It must stay open while the handle is used.
+ *
+ * @return a handle on the archive, or NULL if the archive could not be read, a header fails the checks of
+ *         check_archive() or memory could not be allocated.
+ */
+tar_archive_t *tar_open(int tar_fd) {
+    OP_SCOPE(TAR_OP_OPEN);
+    struct stat st;
+    if (fstat(tar_fd, &st) == -1) {
+        return NULL;
+    }
+    tar_archive_t *ar = new_archive(tar_fd, &st);
+    if (ar == NULL) {
+        return NULL;
+    }
+    attach_io(ar, &st);
+    if (index_headers(ar) == -1) {
+        tar_close(ar);
+        return NULL;
+    }
+    return ar;
+}
+
+/*
+ * Layout of the index file of a compressed archive, in host byte order since it is a local cache:
+ *  - GZ_INDEX_MAGIC, then the size and mtime of the compressed file it was built for,
+ *  - the span, the uncompressed size and the number of checkpoints, then each checkpoint,
+ *  - the number of entries, then for each one its offset, size, typeflag, mode, uid, gid, mtime, name and link target,
+ *    the strings being preceded by their length, and its sparse map: zero for a file that is not sparse, otherwise
+ *    one plus the number of runs, the offset of the stored data, then the offset, size and stored offset of each run.
+ */
+#define GZ_INDEX_MAGIC "LTARGZ04"
+
+static int write_u64(FILE *f, uint64_t value) {
+    return fwrite(&value, sizeof(value), 1, f) == 1 ? 0 : -1;
+}
+
+static int read_u64(FILE *f, uint64_t *value) {
+    return fread(value, sizeof(*value), 1, f) == 1 ? 0 : -1;
+}
+
+static int write_string(FILE *f, const char *str) {
+    size_t len = strlen(str);
+    return write_u64(f, len) == 0 && fwrite(str, 1, len, f) == len ? 0 : -1;
+}
+
+/* Reads a string into *buf, grown as needed, returns -1 on a short or corrupted file */
+static int read_string(FILE *f, char **buf, size_t *cap) {
+    uint64_t len;
+    if (read_u64(f, &len) == -1 || len > (1 << 20)) {
+        return -1;
+    }
+    if (len + 1 > *cap) {
+        char *grown = realloc(*buf, len + 1);
+        if (grown == NULL) {
+            return -1;
+        }
+        *buf = grown;
+        *cap = len + 1;
+    }
+    if (fread(*buf, 1, len, f) != len) {
+        return -1;
+    }
+    (*buf)[len] = '\0';
+    return 0;
+}
+
+/* Saves the checkpoints and the entries of a compressed archive, through a temporary file renamed at the end */
+static int gz_save(const tar_archive_t *ar, const char *index_path) {
+    const struct gz_index *gz = ar->gz;
+    size_t len = strlen(index_path);
+    char *tmp = malloc(len + 5);
+    if (tmp == NULL) {
+        return -1;
+    }
+    memcpy(tmp, index_path, len);
+    memcpy(tmp + len, ".tmp", 5);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        free(tmp);
+        return -1;
+    }
+
+    int ret = fwrite(GZ_INDEX_MAGIC, 8, 1, f) == 1 ? 0 : -1;
+    ret |= write_u64(f, ar->st_size) | write_u64(f, ar->mtime.tv_sec) | write_u64(f, ar->mtime.tv_nsec);
+    ret |= write_u64(f, gz->span) | write_u64(f, gz->size) | write_u64(f, gz->no_points);
+    for (size_t i = 0; i < gz->no_points && ret == 0; i++) {
+        const struct gz_point *point = &gz->points[i];
+        ret |= write_u64(f, point->out) | write_u64(f, point->in) | write_u64(f, point->bits);
+        ret |= fwrite(point->window, GZ_WINDOW, 1, f) == 1 ? 0 : -1;
+    }
+    // Implied directories are not saved, build_tree() adds them back
+    uint64_t no_headers = 0;
+    for (size_t i = 0; i < ar->no_entries; i++) {
+        no_headers += ar->entries[i].offset >= 0;
+    }
+    ret |= write_u64(f, no_headers);
+    for (size_t i = 0; i < ar->no_entries && ret == 0; i++) {
+        const tar_entry_t *entry = &ar->entries[i];
+        if (entry->offset >= 0) {
+            ret |= write_u64(f, entry->offset) | write_u64(f, entry->size) | write_u64(f, entry->typeflag);
+            ret |= write_u64(f, entry->mode) | write_u64(f, entry->uid) | write_u64(f, entry->gid);
+            ret |= write_u64(f, entry->mtime);
+            ret |= write_string(f, entry->name) | write_string(f, entry->linkname);
+            const struct sparse_file *sparse = ar->nodes[i].sparse;
+            ret |= write_u64(f, sparse != NULL ? sparse->no_segments + 1 : 0);
+            if (sparse != NULL) {
+                ret |= write_u64(f, sparse->data);
+                for (size_t j = 0; j < sparse->no_segments; j++) {
+                    const struct sparse_segment *segment = &sparse->segments[j];
+                    ret |= write_u64(f, segment->offset) | write_u64(f, segment->size) | write_u64(f, segment->stored);
+                }
+            }
+        }
+    }
+
+    if (fclose(f) != 0 || ret != 0 || rename(tmp, index_path) == -1) {
+        unlink(tmp);
+        ret = -1;
+    }
+    free(tmp);
+    return ret;
+}
+
+/* Loads an index saved by gz_save(), returns -1 if it is missing, unreadable or built for another file */
+static int gz_load(tar_archive_t *ar, const char *index_path) {
+    struct gz_index *gz = ar->gz;
+    FILE *f = fopen(index_path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char magic[8];
+    uint64_t size, sec, nsec, no_points, no_headers;
+    int ret = fread(magic, 8, 1, f) == 1 && memcmp(magic, GZ_INDEX_MAGIC, 8) == 0 ? 0 : -1;
+    ret |= read_u64(f, &size) | read_u64(f, &sec) | read_u64(f, &nsec);
+    if (ret != 0 || size != (uint64_t) ar->st_size || sec != (uint64_t) ar->mtime.tv_sec
+        || nsec != (uint64_t) ar->mtime.tv_nsec) {
+        fclose(f);
+        return -1;
+    }
+
+    ret |= read_u64(f, &gz->span) | read_u64(f, &gz->size) | read_u64(f, &no_points);
+    for (uint64_t i = 0; i < no_points && ret == 0; i++) {
+        uint64_t out, in, bits;
+        ret |= read_u64(f, &out) | read_u64(f, &in) | read_u64(f, &bits);
+        if (ret == 0 && gz_add_point(gz, bits, in, out, GZ_WINDOW, gz->discard) == -1) {
+            ret = -1;
+        }
+        ret |= ret == 0 && fread(gz->points[gz->no_points - 1].window, GZ_WINDOW, 1, f) == 1 ? 0 : -1;
+    }
+    ret |= read_u64(f, &no_headers);
+    // Read into buffers reused from entry to entry, append_entry() and add_sparse() copy them
+    char *name = NULL, *linkname = NULL;
+    size_t name_cap = 0, link_cap = 0;
+    struct sparse_segment *segments = NULL;
+    size_t segments_cap = 0;
+    for (uint64_t i = 0; i < no_headers && ret == 0; i++) {
+        uint64_t offset, entry_size, typeflag, mode, uid, gid, mtime, no_segments, data = 0;
+        ret |= read_u64(f, &offset) | read_u64(f, &entry_size) | read_u64(f, &typeflag);
+        ret |= read_u64(f, &mode) | read_u64(f, &uid) | read_u64(f, &gid) | read_u64(f, &mtime);
+        ret |= read_string(f, &name, &name_cap) | read_string(f, &linkname, &link_cap);
+        ret |= read_u64(f, &no_segments);
+        if (ret == 0 && no_segments > 0) {
+            no_segments--;
+            ret |= no_segments > (1 << 20) || read_u64(f, &data) == -1 ? -1 : 0;
+        }
+        if (ret == 0 && no_segments > segments_cap) {
+            struct sparse_segment *grown = realloc(segments, no_segments * sizeof(struct sparse_segment));
+            if (grown == NULL) {
+                ret = -1;
+            } else {
+                segments = grown;
+                segments_cap = no_segments;
+            }
+        }
+        for (uint64_t j = 0; j < no_segments && ret == 0; j++) {
+            ret |= read_u64(f, &segments[j].offset) | read_u64(f, &segments[j].size) | read_u64(f, &segments[j].stored);
+        }
+        if (ret != 0 || append_entry(ar, name, strlen(name), linkname, offset, entry_size, typeflag) == -1) {
+            ret = -1;
+        } else {
+            ar->entries[ar->no_entries - 1].mode = mode;
+            ar->entries[ar->no_entries - 1].uid = uid;
+            ar->entries[ar->no_entries - 1].gid = gid;
+            ar->entries[ar->no_entries - 1].mtime = mtime;
+            if (data != 0 && add_sparse(ar, ar->no_entries - 1, segments, no_segments, data) == -1) {
+                ret = -1;
+            }
+        }
+    }
+    free(name);
+    free(linkname);
+    free(segments);
+    fclose(f);
+    return ret == 0 && gz->no_points > 0 ? build_tree(ar) : -1;
+}
+
+/**
+ * Indexes a gzip-compressed archive for random access.
+ *
+ * @param gz_fd A file descriptor pointing to a .tar.gz file. It must stay open while the handle is used.
+ * @param index_path A file where the index is saved and loaded from on the next call, or NULL.
+ * @param span Distance between two checkpoints in the uncompressed stream, zero for 1 MiB.
+ *
+ * @return a handle on the archive, or NULL if the archive could not be read, a header fails the checks of
+ *         check_archive() or memory could not be allocated.
+ */
+tar_archive_t *tar_open_gz(int gz_fd, const char *index_path, size_t span) {
+    OP_SCOPE(TAR_OP_OPEN);
+    struct stat st;
+    if (fstat(gz_fd, &st) == -1) {
+        return NULL;
+    }
+    tar_archive_t *ar = new_archive(gz_fd, &st);
+    struct gz_index *gz = ar != NULL ? calloc(1, sizeof(struct gz_index)) : NULL;
+    if (gz == NULL) {
+        tar_close(ar);
+        return NULL;
+    }
+    gz->fd = gz_fd;
+    gz->span = span ? span : GZ_SPAN;
+    pthread_mutex_init(&gz->lock, NULL);
+    ar->gz = gz;
+
+    if (index_path != NULL && gz_load(ar, index_path) == 0) {
+        return ar;
+    }
+    // A stale or broken index file may have left entries and checkpoints behind
+    tar_archive_t *fresh = new_archive(gz_fd, &st);
+    if (fresh == NULL) {
+        tar_close(ar);
+        return NULL;
+    }
+    gz->no_points = 0;
+    fresh->gz = gz;
+    ar->gz = NULL;
+    tar_close(ar);
+    ar = fresh;
+
+    if (gz_build(gz) == -1 || index_headers(ar) == -1) {
+        tar_close(ar);
+        return NULL;
+    }
+    if (index_path != NULL) {
+        gz_save(ar, index_path);
+    }
+    return ar;
+}
+
+/**
+ * Releases a handle returned by tar_open(). The file descriptor is not closed.
+ *
+ * @param ar A handle returned by tar_open(), or NULL.
+ */
+void tar_close(tar_archive_t *ar) {
+    if (ar == NULL) {
+        return;
+    }
+    arena_free(ar->arena);
+    free(ar->entries);
+    free(ar->nodes);
+    free(ar->buckets);
+    free(ar->sorted);
+    detach_io(ar);
+    gz_free(ar->gz);
+    free(ar);
+}
+
+/**
+ * Looks up an entry of an indexed archive.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return the entry at the given path, owned by the handle, or NULL if no entry at the given path exists.
+ */
+const tar_entry_t *tar_lookup(const tar_archive_t *ar, const char *path) {
+    OP_SCOPE(TAR_OP_LOOKUP);
+    if (ar == NULL || path == NULL) {
+        return NULL;
+    }
+    size_t i = *find_bucket(ar, path);
+    return i ? &ar->entries[i - 1] : NULL;
+}
+
+int tar_exists(const tar_archive_t *ar, const char *path) {
+    return tar_lookup(ar, path) != NULL;
+}
+
+int tar_is_dir(const tar_archive_t *ar, const char *path) {
+    const tar_entry_t *entry = tar_lookup(ar, path);
+    return entry != NULL && entry->typeflag == DIRTYPE;
+}
+
+int tar_is_file(const tar_archive_t *ar, const char *path) {
+    const tar_entry_t *entry = tar_lookup(ar, path);
+    return entry != NULL && (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE);
+}
+
+int tar_is_symlink(const tar_archive_t *ar, const char *path) {
+    const tar_entry_t *entry = tar_lookup(ar, path);
+    return entry != NULL && (entry->typeflag == SYMTYPE || entry->typeflag == LNKTYPE);
+}
+
+/* Looks up a directory, whose path may be given without its trailing slash */
+static const tar_entry_t *lookup_dir(const tar_archive_t *ar, const char *path) {
+    const tar_entry_t *entry = tar_lookup(ar, path);
+    size_t len = strlen(path);
+    if (entry == NULL && len > 0 && path[len - 1] != '/' && len + 1 < PATH_MAX) {
+        char dir[PATH_MAX];
+        memcpy(dir, path, len);
+        dir[len] = '/';
+        dir[len + 1] = '\0';
+        entry = tar_lookup(ar, dir);
+    }
+    return entry;
+}
+
+/* Returns the entry a link finally points to, the entry itself if it is not a link, or NULL if it dangles */
+static const tar_entry_t *follow(const tar_archive_t *ar, const tar_entry_t *entry) {
+    if (entry == NULL) {
+        return NULL;
+    }
+    size_t target = ar->nodes[entry - ar->entries].target;
+    return target == NO_NODE ? NULL : &ar->entries[target];
+}
+
+/**
+ * Looks up an entry, following the links.
+ */
+const tar_entry_t *tar_resolve(const tar_archive_t *ar, const char *path) {
+    if (ar == NULL || path == NULL) {
+        return NULL;
+    }
+    return follow(ar, lookup_dir(ar, path));
+}
+
+/* Looks up the file at path, following the links, returns NULL if there is none */
+static const tar_entry_t *lookup_file(const tar_archive_t *ar, const char *path) {
+    const tar_entry_t *entry = follow(ar, tar_lookup(ar, path));
+    if (entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) {
+        return NULL;
+    }
+    return entry;
+}
+
+/* Finds the directory to list at path, following a symlink. The empty path is the root of the archive */
+static int resolve_dir(const tar_archive_t *ar, const char *path, size_t *dir) {
+    if (ar == NULL || path == NULL) {
+        return 0;
+    }
+    if (path[0] == '\0') {
+        *dir = NO_NODE;
+        return 1;
+    }
+    // A link is replaced by the entry it points to
+    const tar_entry_t *entry = follow(ar, lookup_dir(ar, path));
+    if (entry == NULL || entry->typeflag != DIRTYPE) {
+        return 0;
+    }
+    *dir = entry - ar->entries;
+    return 1;
+}
+
+/* Returns the entry listed after node under dir, going down the subdirectories in recursive mode */
+static size_t next_node(const tar_archive_t *ar, size_t dir, size_t node, int recursive) {
+    if (recursive && ar->nodes[node].first_child != NO_NODE) {
+        return ar->nodes[node].first_child;
+    }
+    while (node != dir) {
+        if (ar->nodes[node].next_sibling != NO_NODE) {
+            return ar->nodes[node].next_sibling;
+        }
+        if (!recursive) {
+            break;
+        }
+        node = ar->nodes[node].parent;
+    }
+    return NO_NODE;
+}
+
+/**
+ * Lists the entries at a given path of an indexed archive, possibly recursively and in several calls.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_list_ex(const tar_archive_t *ar, const char *path, int flags, tar_list_cursor_t *cursor,
+                char **entries, size_t *no_entries) {
+    OP_SCOPE(TAR_OP_LIST);
+    size_t dir;
+    if (!resolve_dir(ar, path, &dir) || entries == NULL || no_entries == NULL) {
+        if (no_entries != NULL) {
+            *no_entries = 0;
+        }
+        return 0;
+    }
+
+    size_t node;
+    if (cursor != NULL && cursor->done) {
+        node = NO_NODE;
+    } else if (cursor != NULL && cursor->next != 0) {
+        node = cursor->next - 1;
+    } else {
+        node = dir == NO_NODE ? ar->root.first_child : ar->nodes[dir].first_child;
+    }
+
+    size_t listed = 0;
+    while (node != NO_NODE && listed < *no_entries) {
+        strcpy(entries[listed++], ar->entries[node].name);
+        node = next_node(ar, dir, node, flags & TAR_LIST_RECURSIVE);
+    }
+    *no_entries = listed;
+    if (cursor != NULL) {
+        cursor->next = node == NO_NODE ? 0 : node + 1;
+        cursor->done = node == NO_NODE;
+    }
+    return 1;
+}
+
+/* Returns the position in the sorted names of the first one for which strncmp() with prefix is above bound */
+static size_t search_prefix(const tar_archive_t *ar, const char *prefix, size_t len, int bound) {
+    size_t lo = 0, hi = ar->no_sorted;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(ar->entries[ar->sorted[mid]].name, prefix, len) > bound) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Finds the entries of an indexed archive whose path matches a glob or starts with a prefix.
+ */
+int tar_query(const tar_archive_t *ar, const char *pattern, int flags, tar_list_cursor_t *cursor,
+              const tar_entry_t **entries, size_t *no_entries) {
+    OP_SCOPE(TAR_OP_LIST);
+    if (ar == NULL || pattern == NULL || entries == NULL || no_entries == NULL) {
+        if (no_entries != NULL) {
+            *no_entries = 0;
+        }
+        return -1;
+    }
+
+    // Only the paths starting with the literal head of the pattern can match, they are a range of the sorted names
+    size_t len = flags & TAR_QUERY_PREFIX ? strlen(pattern) : strcspn(pattern, "*?[\\");
+    size_t pos = search_prefix(ar, pattern, len, -1);
+    size_t end = search_prefix(ar, pattern, len, 0);
+    if (cursor != NULL && cursor->done) {
+        pos = end;
+    } else if (cursor != NULL && cursor->next != 0) {
+        pos = cursor->next - 1;
+    }
+
+    int match_flags = flags & TAR_QUERY_PATHNAME ? FNM_PATHNAME : 0;
+    size_t found = 0;
+    for (; pos < end && found < *no_entries; pos++) {
+        const tar_entry_t *entry = &ar->entries[ar->sorted[pos]];
+        if ((flags & TAR_QUERY_PREFIX) || fnmatch(pattern + len, entry->name + len, match_flags) == 0) {
+            entries[found++] = entry;
+        }
+    }
+    *no_entries = found;
+    if (cursor != NULL) {
+        cursor->next = pos + 1;
+        cursor->done = pos == end;
+    }
+    return 0;
+}
+
+/* TAR_TYPE_* value of an entry */
+static int entry_type(const tar_entry_t *entry) {
+    switch (entry->typeflag) {
+        case REGTYPE:
+        case AREGTYPE:
+            return TAR_TYPE_FILE;
+        case DIRTYPE:
+            return TAR_TYPE_DIR;
+        case SYMTYPE:
+            return TAR_TYPE_SYMLINK;
+        case LNKTYPE:
+            return TAR_TYPE_HARDLINK;
+        default:
+            return TAR_TYPE_OTHER;
+    }
+}
+
+/* Tells whether an entry passes the type, size and mtime predicates of a filter, its path is not looked at */
+static int filter_match(const tar_filter_t *filter, const tar_entry_t *entry) {
+    return (filter->types == 0 || (filter->types & entry_type(entry)))
+           && entry->size >= filter->min_size && (filter->max_size == 0 || entry->size <= filter->max_size)
+           && (filter->min_mtime == 0 || entry->mtime >= filter->min_mtime)
+           && (filter->max_mtime == 0 || entry->mtime <= filter->max_mtime);
+}
+
+/**
+ * Finds the entries of an indexed archive that pass a filter.
+ */
+int tar_scan(const tar_archive_t *ar, const tar_filter_t *filter, tar_list_cursor_t *cursor,
+             const tar_entry_t **entries, size_t *no_entries) {
+    OP_SCOPE(TAR_OP_LIST);
+    if (ar == NULL || entries == NULL || no_entries == NULL) {
+        if (no_entries != NULL) {
+            *no_entries = 0;
+        }
+        return -1;
+    }
+
+    static const tar_filter_t every = {0};
+    if (filter == NULL) {
+        filter = &every;
+    }
+    size_t pos = 0, end = ar->no_sorted;
+    if (filter->prefix != NULL) {
+        size_t len = strlen(filter->prefix);
+        pos = search_prefix(ar, filter->prefix, len, -1);
+        end = search_prefix(ar, filter->prefix, len, 0);
+    }
+    if (cursor != NULL && cursor->done) {
+        pos = end;
+    } else if (cursor != NULL && cursor->next != 0) {
+        pos = cursor->next - 1;
+    }
+
+    size_t found = 0;
+    for (; pos < end && found < *no_entries; pos++) {
+        const tar_entry_t *entry = &ar->entries[ar->sorted[pos]];
+        if (filter_match(filter, entry)) {
+            entries[found++] = entry;
+        }
+    }
+    *no_entries = found;
+    if (cursor != NULL) {
+        cursor->next = pos + 1;
+        cursor->done = pos == end;
+    }
+    return 0;
+}
+
+/**
+ * Lists the entries at a given path of an indexed archive, see list().
+ */
+int tar_list(const tar_archive_t *ar, const char *path, char **entries, size_t *no_entries) {
+    return tar_list_ex(ar, path, 0, NULL, entries, no_entries);
+}
+
+/* Clips a read of len bytes at offset in a file, returns what tar_read_file() returns and sets start to its offset */
+static ssize_t file_span(const tar_entry_t *entry, size_t offset, size_t *len, off_t *start) {
+    if (offset >= entry->size) {
+        return -2;
+    }
+
+    uint64_t last = entry->size - offset;
+    ssize_t ret = last - *len;
+    if (*len >= last) {
+        *len = last;
+        ret = 0;
+    }
+    *start = entry->offset + HEADER_SIZE + offset;
+    return ret;
+}
+
+
+/**
+ * Reads a file at a given path of an indexed archive, see read_file().
+ */
+ssize_t tar_read_file(const tar_archive_t *ar, const char *path, size_t offset, uint8_t *dest, size_t *len) {
+    OP_SCOPE(TAR_OP_READ);
+    const tar_entry_t *entry = lookup_file(ar, path);
+    if (entry == NULL) {
+        return -1;
+    }
+    off_t start;
+    ssize_t ret = file_span(entry, offset, len, &start);
+    if (ret < 0) {
+        return ret;
+    }
+    if (read_entry(ar, entry, offset, dest, *len) == -1) {
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * Reads parts of many files of an indexed archive at once.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param reqs The reads, each one is done as by tar_read_file() and its ret field set to what it returns.
+ * @param no_reqs The number of reads.
+ *
+ * @return the number of reads that succeeded, or -1 if memory could not be allocated.
+ */
+int tar_read_batch(const tar_archive_t *ar, tar_read_req_t *reqs, size_t no_reqs) {
+    OP_SCOPE(TAR_OP_READ);
+    off_t *starts = malloc((no_reqs ? no_reqs : 1) * sizeof(off_t));
+    if (starts == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < no_reqs; i++) {
+        const tar_entry_t *entry = lookup_file(ar, reqs[i].path);
+        reqs[i].ret = entry != NULL ? file_span(entry, reqs[i].offset, &reqs[i].len, &starts[i]) : -1;
+        if (reqs[i].ret < 0 || reqs[i].len == 0) {
+            starts[i] = -1;
+        } else if (ar->nodes[entry - ar->entries].sparse != NULL) {
+            // The holes of a sparse file need no read, its runs are read on their own
+            if (read_entry(ar, entry, reqs[i].offset, reqs[i].dest, reqs[i].len) == -1) {
+                reqs[i].ret = -1;
+            }
+            starts[i] = -1;
+        }
+    }
+    if (ar->ring != NULL) {
+        ring_read_batch(ar->ring, ar->fd, reqs, starts, no_reqs);
+    }
+
+    int done = 0;
+    for (size_t i = 0; i < no_reqs; i++) {
+        if (starts[i] >= 0 && read_at(ar, starts[i], reqs[i].dest, reqs[i].len) == -1) {
+            reqs[i].ret = -1;
+        }
+        done += reqs[i].ret >= 0;
+    }
+    free(starts);
+    return done;
+}
+
+/**
+ * Gives direct access to the data of a file of an indexed archive.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ * @param data Set to the start of the file data, which stays valid until tar_close() is called.
+ * @param size Set to the size of the file.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the archive could not be mapped in memory or the file is sparse, tar_read_file() must be used
+ *            instead.
+ */
+int tar_map_file(const tar_archive_t *ar, const char *path, const uint8_t **data, size_t *size) {
+    const tar_entry_t *entry = lookup_file(ar, path);
+    if (entry == NULL) {
+        return -1;
+    }
+    if (ar->map == NULL || (uint64_t) entry->offset + HEADER_SIZE + entry->size > ar->map_len
+        || ar->nodes[entry - ar->entries].sparse != NULL) {
+        return -2;
+    }
+    *data = ar->map + entry->offset + HEADER_SIZE;
+    *size = entry->size;
+    return 0;
+}
+
+/**
+ * Opens a cursor on a file of an indexed archive.
+ *
+ * @param ar A handle returned by tar_open(), which must outlive the cursor.
+ * @param path A path to an entry in the archive.
+ *
+ * @return a cursor positioned at the start of the file, or NULL if no entry at the given path exists in the archive,
+ *         the entry is not a file or memory could not be allocated.
+ */
+tar_member_t *tar_open_member(const tar_archive_t *ar, const char *path) {
+    const tar_entry_t *entry = lookup_file(ar, path);
+    if (entry == NULL) {
+        return NULL;
+    }
+    tar_member_t *member = malloc(sizeof(tar_member_t));
+    if (member == NULL) {
+        return NULL;
+    }
+    member->ar = ar;
+    member->data = entry->offset + HEADER_SIZE;
+    member->size = entry->size;
+    member->pos = 0;
+    member->sparse = ar->nodes[entry - ar->entries].sparse;
+    return member;
+}
+
+/**
+ * Reads from a given offset of a file without moving the cursor.
+ *
+ * @return the number of bytes copied to dest, which is less than len only at the end of the file, or -1 on error.
+ */
+ssize_t tar_member_pread(const tar_member_t *member, uint8_t *dest, size_t len, uint64_t offset) {
+    OP_SCOPE(TAR_OP_READ);
+    if (offset >= member->size) {
+        return 0;
+    }
+    if (len > member->size - offset) {
+        len = member->size - offset;
+    }
+    int ret = member->sparse != NULL ? sparse_read(member->ar, member->sparse, offset, dest, len)
+                                     : read_at(member->ar, member->data + offset, dest, len);
+    return ret == -1 ? -1 : (ssize_t) len;
+}
+
+/**
+ * Reads from the position of the cursor and moves it past the bytes read.
+ *
+ * @return the number of bytes copied to dest, zero at the end of the file, or -1 on error.
+ */
+ssize_t tar_member_read(tar_member_t *member, uint8_t *dest, size_t len) {
+    ssize_t n = tar_member_pread(member, dest, len, member->pos);
+    if (n > 0) {
+        member->pos += n;
+    }
+    return n;
+}
+
+/**
+ * Moves the cursor, like lseek() does on a file.
+ *
+ * @return the new position of the cursor, or -1 if it would be negative or whence is invalid.
+ */
+off_t tar_member_seek(tar_member_t *member, off_t offset, int whence) {
+    off_t base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = member->pos; break;
+        case SEEK_END: base = member->size; break;
+        default: return -1;
+    }
+    if (base + offset < 0) {
+        return -1;
+    }
+    member->pos = base + offset;
+    return member->pos;
+}
+
+/* Returns the size of the file a cursor is opened on */
+uint64_t tar_member_size(const tar_member_t *member) {
+    return member->size;
+}
+
+/* Releases a cursor returned by tar_open_member() */
+void tar_member_close(tar_member_t *member) {
+    free(member);
+}
+
+/* Writes a whole buffer, retrying on short writes */
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Copies len bytes of the archive at offset to out_fd through user space, straight out of the mapping if any */
+static int copy_range(const tar_archive_t *ar, off_t offset, int out_fd, size_t len) {
+    if (ar->map != NULL) {
+        if ((uint64_t) offset + len > ar->map_len) {
+            return -1;
+        }
+        return write_all(out_fd, ar->map + offset, len);
+    }
+    uint8_t *buf = malloc(len < COPY_CHUNK ? len : COPY_CHUNK);
+    if (buf == NULL) {
+        return -1;
+    }
+    int ret = 0;
+    while (len > 0 && ret == 0) {
+        size_t chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+        ret = read_at(ar, offset, buf, chunk) == -1 ? -1 : write_all(out_fd, buf, chunk);
+        offset += chunk;
+        len -= chunk;
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * Transfers len bytes of the archive at offset to out_fd, without copying them to user space when the kernel can.
+ *
+ * copy_file_range() is tried first since it lets the filesystem share the extents (reflink on XFS or btrfs), then
+ * sendfile() which works towards any file or socket, then splice() for pipes. The first one that is not supported
+ * between the two fds is not tried again, and copy_range() finishes the transfer when none of them is.
+ */
+static int send_range(const tar_archive_t *ar, off_t offset, int out_fd, size_t len) {
+#ifdef __linux__
+    // The kernel would copy the compressed bytes
+    int method = ar->gz != NULL ? 3 : 0;
+    while (len > 0 && method < 3) {
+        size_t chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+        loff_t in_off = offset;
+        ssize_t n;
+        if (method == 0) {
+            n = copy_file_range(ar->fd, &in_off, out_fd, NULL, chunk, 0);
+        } else if (method == 1) {
+            n = sendfile(out_fd, ar->fd, &in_off, chunk);
+        } else {
+            n = splice(ar->fd, &in_off, out_fd, NULL, chunk, SPLICE_F_MORE);
+        }
+
+        if (n > 0) {
+            offset += n;
+            len -= n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == 0 || errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP
+                   || errno == EBADF) {
+            // EBADF is what copy_file_range() returns when out_fd is not a regular file
+            method++;
+        } else {
+            return -1;
+        }
+    }
+#endif
+    return len > 0 ? copy_range(ar, offset, out_fd, len) : 0;
+}
+
+/* Writes len bytes of a sparse file at pos to out_fd, the runs by send_range() and the holes as zeros */
+static int send_sparse(const tar_archive_t *ar, const struct sparse_file *file, uint64_t pos, int out_fd, size_t len) {
+    static const uint8_t zeros[1 << 16];
+    while (len > 0) {
+        off_t stored;
+        uint64_t n = sparse_piece(file, pos, &stored);
+        if (n > len) {
+            n = len;
+        }
+        if (stored != -1 && send_range(ar, stored, out_fd, n) == -1) {
+            return -1;
+        }
+        for (uint64_t left = stored == -1 ? n : 0; left > 0;) {
+            size_t chunk = left < sizeof(zeros) ? left : sizeof(zeros);
+            if (write_all(out_fd, zeros, chunk) == -1) {
+                return -1;
+            }
+            left -= chunk;
+        }
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Writes a range of the file a cursor is opened on to out_fd, see tar_send_file().
+ * The position of the cursor is not changed.
+ */
+ssize_t tar_member_send(const tar_member_t *member, int out_fd, uint64_t offset, size_t len) {
+    OP_SCOPE(TAR_OP_SEND);
+    // As with read_file(), an offset at the end of the file is already past it
+    if (offset >= member->size) {
+        return -2;
+    }
+    if (len > member->size - offset) {
+        len = member->size - offset;
+    }
+    int ret = member->sparse != NULL ? send_sparse(member->ar, member->sparse, offset, out_fd, len)
+                                     : send_range(member->ar, member->data + offset, out_fd, len);
+    return ret == -1 ? -3 : (ssize_t) len;
+}
+
+/**
+ * Writes a range of a file of an indexed archive to a file descriptor, without going through a user buffer.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ * @param out_fd The destination, a file, a socket or a pipe. The data is written at its current file offset.
+ * @param offset An offset in the file from which to start, zero indicates the start of the file.
+ * @param len The number of bytes to transfer, it is cut down to what is left after offset.
+ *
+ * @return the number of bytes written to out_fd,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         -3 if the transfer failed, errno is then set by the failing call.
+ */
+ssize_t tar_send_file(const tar_archive_t *ar, const char *path, int out_fd, uint64_t offset, size_t len) {
+    OP_SCOPE(TAR_OP_SEND);
+    const tar_entry_t *entry = lookup_file(ar, path);
+    if (entry == NULL) {
+        return -1;
+    }
+    tar_member_t member = { ar, entry->offset + HEADER_SIZE, entry->size, 0, ar->nodes[entry - ar->entries].sparse };
+    return tar_member_send(&member, out_fd, offset, len);
+}
+
+/* Drops a reference taken by acquire_archive(), the last one closes the handle */
+static void release_archive(tar_archive_t *ar) {
+    if (ar == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&fd_cache_lock);
+    int refs = --ar->refs;
+    pthread_mutex_unlock(&fd_cache_lock);
+    if (refs == 0) {
+        tar_close(ar);
+    }
+}
+
+/*
+ * Moves first the cached index of the file behind tar_fd, the caller holding the lock, and tells whether it was
+ * found. Otherwise the slot moved first is the one to replace: a free one, an index of the same fd whose file
+ * changed, or else the least recently used one.
+ */
+static int find_cached(int tar_fd, const struct stat *st) {
+    // A free slot is taken before the least recently used index is given up, replaced ones leave holes
+    size_t slot = FD_CACHE_SLOTS - 1;
+    int found = 0;
+    for (size_t i = FD_CACHE_SLOTS; i-- > 0;) {
+        if (fd_cache[i] == NULL) {
+            slot = i;
+        }
+    }
+    for (size_t i = 0; i < FD_CACHE_SLOTS; i++) {
+        const tar_archive_t *ar = fd_cache[i];
+        if (ar == NULL || ar->fd != tar_fd) {
+            continue;
+        }
+        slot = i;
+        found = ar->dev == st->st_dev && ar->ino == st->st_ino && ar->st_size == st->st_size
+                 && ar->mtime.tv_sec == st->st_mtim.tv_sec && ar->mtime.tv_nsec == st->st_mtim.tv_nsec;
+        break;
+    }
+    tar_archive_t *ar = fd_cache[slot];
+    memmove(&fd_cache[1], &fd_cache[0], slot * sizeof(tar_archive_t *));
+    fd_cache[0] = ar;
+    return found;
+}
+
+/**
+ * Returns the index of the archive behind tar_fd, reusing the one cached for it if the file did not change.
+ * The cache holds a reference on each of its handles and every caller takes one, so that a thread replacing a
+ * cached index does not close it under the feet of another thread. The reference must be dropped with
+ * release_archive().
+ */
+static tar_archive_t *acquire_archive(int tar_fd) {
+    struct stat st;
+    if (fstat(tar_fd, &st) == -1) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&fd_cache_lock);
+    if (find_cached(tar_fd, &st)) {
+        tar_archive_t *ar = fd_cache[0];
+        ar->refs++;
+        pthread_mutex_unlock(&fd_cache_lock);
+        return ar;
+    }
+    pthread_mutex_unlock(&fd_cache_lock);
+
+    // Indexing is done outside of the lock, a thread that lost the race to index the same file uses the winner's
+    tar_archive_t *ar = tar_open(tar_fd);
+    if (ar == NULL) {
+        return NULL;
+    }
+    tar_archive_t *old;
+    pthread_mutex_lock(&fd_cache_lock);
+    int found = find_cached(tar_fd, &st);
+    if (found) {
+        old = ar;
+        ar = fd_cache[0];
+        ar->refs++;
+    } else {
+        old = fd_cache[0];
+        fd_cache[0] = ar;
+        ar->refs = 2;
+    }
+    pthread_mutex_unlock(&fd_cache_lock);
+    if (found) {
+        tar_close(old);
+    } else {
+        release_archive(old);
+    }
+    return ar;
+}
+
+/**
+ * Releases the indexes kept for the fd-based functions, see tar_open(). An index still used by another thread is
+ * released when that call returns. The next call on an fd indexes its archive again.
+ */
+void tar_release_fds(void) {
+    tar_archive_t *released[FD_CACHE_SLOTS];
+    pthread_mutex_lock(&fd_cache_lock);
+    memcpy(released, fd_cache, sizeof(released));
+    memset(fd_cache, 0, sizeof(fd_cache));
+    pthread_mutex_unlock(&fd_cache_lock);
+    for (size_t i = 0; i < FD_CACHE_SLOTS; i++) {
+        release_archive(released[i]);
+    }
+}
+
+/**
+ * Checks whether the archive is valid.
+ *
+ * Each non-null header of a valid archive has:
+ *  - a magic value of "ustar" and a null and a version value of "00" and no null, or the magic and version
+ *    "ustar  " and a null of the GNU format,
+ *  - a correct checksum
+ * The extension blocks of the old GNU sparse headers are skipped along with the data of their member.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ *
+ * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
+ *         -1 if the archive contains a header with an invalid magic value,
+ *         -2 if the archive contains a header with an invalid version value,
+ *         -3 if the archive contains a header with an invalid checksum value
+ */
+int check_archive(int tar_fd) {
+    OP_SCOPE(TAR_OP_CHECK);
+    struct stat st;
+    if (fstat(tar_fd, &st) == -1) {
+        return -1;
+    }
+    // Only the reading helpers of the handle are used, no index is built
+    tar_archive_t ar = { .fd = tar_fd };
+    attach_io(&ar, &st);
+
+    tar_header_t scratch;
+    const tar_header_t *hdr;
+    off_t offset = 0;
+    int nb = 0;
+
+    while ((hdr = header_at(&ar, offset, &scratch)) != NULL) {
+        struct header_fields fields;
+        int ret = check_header(hdr, &fields);
+        if (ret == 1) {
+            break;
+        }
+        if (ret != 0) {
+            detach_io(&ar);
+            return ret;
+        }
+        nb++;
+        offset += HEADER_SIZE;
+        // The map of an old GNU sparse file may go on in extension blocks, which are not headers
+        int extended = hdr->typeflag == GNUTYPE_SPARSE && ((const uint8_t *) hdr)[OLDGNU_EXTENDED] != 0;
+        while (extended) {
+            const uint8_t *block = (const uint8_t *) header_at(&ar, offset, &scratch);
+            if (block == NULL) {
+                detach_io(&ar);
+                return -1;
+            }
+            extended = block[SPARSE_EXT_EXTENDED] != 0;
+            offset += HEADER_SIZE;
+        }
+        // Skip the data blocks of the member
+        offset += padded_size(fields.size);
+        STAT_ADD(bytes_skipped, padded_size(fields.size));
+    }
+
+    detach_io(&ar);
+    return nb;
+}
+
+/**
+ * Checks whether an entry exists in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int exists(int tar_fd, char *path) {
+    OP_SCOPE(TAR_OP_LOOKUP);
+    tar_archive_t *ar = acquire_archive(tar_fd);
+    int ret = tar_exists(ar, path);
+    release_archive(ar);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a directory.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int is_dir(int tar_fd, char *path) {
+    OP_SCOPE(TAR_OP_LOOKUP);
+    tar_archive_t *ar = acquire_archive(tar_fd);
+    int ret = tar_is_dir(ar, path);
+    release_archive(ar);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a file.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int is_file(int tar_fd, char *path) {
+    OP_SCOPE(TAR_OP_LOOKUP);
+    tar_archive_t *ar = acquire_archive(tar_fd);
+    int ret = tar_is_file(ar, path);
+    release_archive(ar);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a symlink.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int is_symlink(int tar_fd, char *path) {
+    OP_SCOPE(TAR_OP_LOOKUP);
+    tar_archive_t *ar = acquire_archive(tar_fd);
+    int ret = tar_is_symlink(ar, path);
+    release_archive(ar);
+    return ret;
+}
+
+
+/**
+ * Lists the entries at a given path in the archive.
+ * list() does not recurse into the directories listed at the given path.
+ *
+ * Example:
+ *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
+ *   ├── a
+ *   ├── b
+ *   ├── c/
+ *   │   └── d
+ *   └── e/
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    OP_SCOPE(TAR_OP_LIST);
+    tar_archive_t *ar = acquire_archive(tar_fd);
+    int ret = tar_list(ar, path, entries, no_entries);
+    release_archive(ar);
+    return ret;
+}
+
+/**
+ * Reads a file at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ *
+ */
+ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    OP_SCOPE(TAR_OP_READ);
+    tar_archive_t *ar = acquire_archive(tar_fd);
+    ssize_t ret = tar_read_file(ar, path, offset, dest, len);
+    release_archive(ar);
+    return ret;
+}
+
+/**
+ * Looks up many paths in a single pass over the headers of an archive, without indexing it.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param paths The paths to look up.
+ * @param no_paths The number of paths.
+ * @param results An array of no_paths results, results[i] is filled for paths[i].
+ *
+ * @return the number of paths found in the archive, or -1 if memory could not be allocated, the archive read or
+ *         a header fails the checks of check_archive().
+ */
+int tar_lookup_batch(int tar_fd, char **paths, size_t no_paths, tar_stat_t *results) {
+    OP_SCOPE(TAR_OP_BATCH);
+    struct stat st;
+    if (fstat(tar_fd, &st) == -1) {
+        return -1;
+    }
+
+    // Open addressing table of path index + 1, first[i] is the index of the first occurrence of paths[i]
+    size_t no_buckets = 16;
+    while (no_buckets < 2 * no_paths) {
+        no_buckets *= 2;
+    }
+    size_t mask = no_buckets - 1;
+    size_t *buckets = calloc(no_buckets, sizeof(size_t));
+    size_t *first = malloc((no_paths ? no_paths : 1) * sizeof(size_t));
+    if (buckets == NULL || first == NULL) {
+        free(buckets);
+        free(first);
+        return -1;
+    }
+    for (size_t i = 0; i < no_paths; i++) {
+        size_t b = hash_path(paths[i]) & mask;
+        while (buckets[b] != 0 && strcmp(paths[buckets[b] - 1], paths[i]) != 0) {
+            b = (b + 1) & mask;
+        }
+        if (buckets[b] == 0) {
+            buckets[b] = i + 1;
+        }
+        first[i] = buckets[b] - 1;
+        memset(&results[i], 0, sizeof(tar_stat_t));
+    }
+
+    tar_archive_t ar = { .fd = tar_fd };
+    attach_io(&ar, &st);
+    struct tar_walk walk = { &ar, 0, PAX_UNSET };
+    struct member m;
+    int ret;
+
+    while ((ret = walk_next(&walk, &m)) == 1) {
+        size_t b = hash_path(m.name) & mask;
+        while (buckets[b] != 0 && strcmp(paths[buckets[b] - 1], m.name) != 0) {
+            b = (b + 1) & mask;
+        }
+        // A path archived twice keeps its last occurrence, as in the index of tar_open()
+        if (buckets[b] != 0) {
+            tar_stat_t *result = &results[buckets[b] - 1];
+            result->found = 1;
+            result->typeflag = m.typeflag;
+            result->size = m.size;
+            result->data_offset = m.data;
+            size_t len = strnlen(m.linkname, sizeof(result->linkname) - 1);
+            memcpy(result->linkname, m.linkname, len);
+            result->linkname[len] = '\0';
+        }
+        member_release(&m);
+    }
+    walk_release(&walk);
+    detach_io(&ar);
+    if (ret == -1) {
+        free(buckets);
+        free(first);
+        return -1;
+    }
+
+    int found = 0;
+    for (size_t i = 0; i < no_paths; i++) {
+        if (first[i] != i) {
+            results[i] = results[first[i]];
+        }
+        found += results[i].found;
+    }
+    free(buckets);
+    free(first);
+    return found;
+}
+
+/*
+ * Streaming reader: the walk of tar_open() over an archive read forward only, see stream_fill().
+ */
+struct tar_stream {
+    tar_archive_t ar;           // only the reading helpers are used, as in check_archive()
+    struct stream_buf buf;
+    struct tar_walk walk;
+    struct member m;            // current member, valid when has_member is set
+    int has_member;
+    uint64_t pos;               // bytes of the current member read
+};
+
+/**
+ * Starts reading an archive from a pipe, a socket or any fd, forward only.
+ */
+tar_stream_t *tar_stream_open(int fd) {
+    tar_stream_t *stream = malloc(sizeof(tar_stream_t));
+    if (stream == NULL) {
+        return NULL;
+    }
+    memset(&stream->ar, 0, sizeof(tar_archive_t));
+    stream->ar.fd = fd;
+    stream->ar.stream = &stream->buf;
+    stream->buf.fd = fd;
+    stream->buf.seekable = -1;
+    stream->buf.base = 0;
+    stream->buf.start = stream->buf.end = 0;
+    stream->walk = (struct tar_walk) { &stream->ar, 0, PAX_UNSET };
+    stream->has_member = 0;
+    return stream;
+}
+
+/**
+ * Moves to the next entry of a streamed archive.
+ */
+int tar_stream_next(tar_stream_t *stream, tar_entry_t *entry) {
+    OP_SCOPE(TAR_OP_STREAM);
+    if (stream->has_member) {
+        member_release(&stream->m);
+        stream->has_member = 0;
+    }
+    // The data left unread is dropped by the walk, as it moves to the next header
+    int ret = walk_next(&stream->walk, &stream->m);
+    if (ret != 1) {
+        return ret;
+    }
+    stream->has_member = 1;
+    stream->pos = 0;
+    entry->name = stream->m.name;
+    entry->linkname = stream->m.linkname;
+    entry->offset = stream->m.offset;
+    entry->size = stream->m.size;
+    entry->typeflag = stream->m.typeflag;
+    entry->mode = stream->m.mode & 07777;
+    entry->uid = stream->m.uid;
+    entry->gid = stream->m.gid;
+    entry->mtime = stream->m.mtime;
+    return 1;
+}
+
+/**
+ * Reads the data of the current entry of a streamed archive.
+ */
+ssize_t tar_stream_read(tar_stream_t *stream, uint8_t *dest, size_t len) {
+    OP_SCOPE(TAR_OP_STREAM);
+    if (!stream->has_member) {
+        return -1;
+    }
+    uint64_t left = stream->m.size - stream->pos;
+    if (len > left) {
+        len = left;
+    }
+    // The runs of a sparse file come in file order, so its holes can be filled going forward
+    struct sparse_file sparse = { stream->m.segments, stream->m.no_segments, stream->m.data, stream->m.size };
+    int ret = len == 0 ? 0 : stream->m.sparse ? sparse_read(&stream->ar, &sparse, stream->pos, dest, len)
+                                              : read_at(&stream->ar, stream->m.data + stream->pos, dest, len);
+    if (ret == -1) {
+        return -1;
+    }
+    stream->pos += len;
+    return len;
+}
+
+/**
+ * Releases a streaming reader. The file descriptor is not closed.
+ */
+void tar_stream_close(tar_stream_t *stream) {
+    if (stream == NULL) {
+        return;
+    }
+    if (stream->has_member) {
+        member_release(&stream->m);
+    }
+    walk_release(&stream->walk);
+    free(stream);
+}
+
+/**
+ * Reads an archive from fd forward only, calling back for each entry.
+ */
+int tar_stream_each(int fd, int (*callback)(const tar_entry_t *entry, tar_stream_t *stream, void *arg), void *arg) {
+    tar_stream_t *stream = tar_stream_open(fd);
+    if (stream == NULL) {
+        return -1;
+    }
+    tar_entry_t entry;
+    int ret;
+    while ((ret = tar_stream_next(stream, &entry)) == 1) {
+        if ((ret = callback(&entry, stream, arg)) != 0) {
+            break;
+        }
+    }
+    tar_stream_close(stream);
+    return ret;
+}
+
+/*
+ * Archive writer.
+ *
+ * tar_writer_add() only queues the paths in a ring of slots. A pool of threads takes the queued entries in order,
+ * stats them, builds their headers in their slot and reads the data of small files whole into the buffer of the
+ * slot, so that the open and read latencies of many files overlap. A single writer thread waits for the slot at the
+ * head of the ring and gathers the blocks of the consecutive loaded slots into one writev(). The data of the files
+ * too big to be buffered is sent by the writer straight from the source file.
+ */
+#define WRITER_THREADS 4
+#define WRITER_SLOTS_PER_THREAD 8
+#define WRITER_INLINE (1 << 20)
+#define WRITER_IOVS 256
+// Records of a PAX header: a path, a link target and a few numbers, in whole blocks
+#define PAX_MAX (2 * TAR_PATH_MAX + HEADER_SIZE)
+
+#define SLOT_FREE 0
+#define SLOT_QUEUED 1
+#define SLOT_LOADING 2
+#define SLOT_READY 3
+
+struct writer_slot {
+    int state;                  // SLOT_*
+    int failed;                 // the entry could not be read, it is left out of the archive
+    char src[TAR_PATH_MAX];
+    char name[TAR_PATH_MAX];
+    char link[TAR_PATH_MAX];
+    // Blocks written before the data: a PAX header and its records when pax_len is not zero, then the header
+    tar_header_t pax_hdr;
+    char pax[PAX_MAX];
+    size_t pax_len;
+    tar_header_t hdr;
+    uint64_t size;
+    uint8_t *data;              // data of a small file, the buffer is kept for the next entries of the slot
+    size_t data_cap;
+    int src_fd;                 // source of a file too big to be buffered, -1 otherwise
+};
+
+struct tar_writer {
+    int fd;
+    struct writer_slot *slots;
+    size_t no_slots;
+    // Sequence numbers of the next slot to write, to load and to queue, the slot of n is n % no_slots
+    uint64_t head, next, tail;
+    pthread_mutex_t lock;
+    pthread_cond_t queued, loaded, freed;
+    int closing;
+    int failed;                 // an entry was left out
+    int error;                  // the archive could not be written, nothing more is written
+    pthread_t *threads;
+    size_t no_threads;
+    pthread_t writer;
+};
+
+static const uint8_t zero_blocks[2 * HEADER_SIZE];
+
+/* Writes value in octal over the len - 1 first bytes of field and a null, returns -1 if it does not fit */
+static int encode_octal(char *field, size_t len, uint64_t value) {
+    field[len - 1] = '\0';
+    for (size_t i = len - 1; i-- > 0;) {
+        field[i] = '0' + (value & 7);
+        value >>= 3;
+    }
+    return value == 0 ? 0 : -1;
+}
+
+/* Appends a "length key=value\n" record to the PAX header of a slot, the length counting its own digits */
+static void pax_record(struct writer_slot *slot, const char *key, const char *value) {
+    size_t len = strlen(key) + strlen(value) + 3;
+    size_t digits = 1, limit = 10;
+    while (len + digits >= limit) {
+        digits++;
+        limit *= 10;
+    }
+    slot->pax_len += snprintf(slot->pax + slot->pax_len, PAX_MAX - slot->pax_len, "%zu %s=%s\n", len + digits, key,
+                              value);
+}
+
+/* Sets the checksum of a header block, its own field being counted as spaces */
+static void seal_header(tar_header_t *hdr) {
+    struct block_sums sums;
+    memcpy(hdr->magic, TMAGIC, TMAGLEN);
+    memcpy(hdr->version, TVERSION, TVERSLEN);
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    sum_block((const uint8_t *) hdr, &sums);
+    encode_octal(hdr->chksum, sizeof(hdr->chksum) - 1, sums.sum);
+}
+
+/* Stores a path in the name and prefix fields of hdr, returns -1 if it needs a PAX record */
+static int split_name(tar_header_t *hdr, const char *name) {
+    size_t len = strlen(name);
+    if (len <= sizeof(hdr->name)) {
+        memcpy(hdr->name, name, len);
+        return 0;
+    }
+    // The prefix ends at a slash, the rest must fit in the name field
+    for (size_t i = len - sizeof(hdr->name) - 1; i <= sizeof(hdr->prefix) && i < len - 1; i++) {
+        if (name[i] == '/') {
+            memcpy(hdr->prefix, name, i);
+            memcpy(hdr->name, name + i + 1, len - i - 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Builds the headers of the entry of a slot out of its stat */
+static void encode_headers(struct writer_slot *slot, const struct stat *st, char typeflag) {
+    tar_header_t *hdr = &slot->hdr;
+    char number[32];
+
+    memset(hdr, 0, sizeof(tar_header_t));
+    slot->pax_len = 0;
+    if (split_name(hdr, slot->name) == -1) {
+        pax_record(slot, "path", slot->name);
+        memcpy(hdr->name, slot->name, sizeof(hdr->name));
+    }
+    size_t link_len = strlen(slot->link);
+    if (link_len > sizeof(hdr->linkname)) {
+        pax_record(slot, "linkpath", slot->link);
+        link_len = sizeof(hdr->linkname);
+    }
+    memcpy(hdr->linkname, slot->link, link_len);
+    encode_octal(hdr->mode, sizeof(hdr->mode), st->st_mode & 07777);
+    if (encode_octal(hdr->uid, sizeof(hdr->uid), st->st_uid) == -1) {
+        snprintf(number, sizeof(number), "%u", (unsigned) st->st_uid);
+        pax_record(slot, "uid", number);
+        encode_octal(hdr->uid, sizeof(hdr->uid), 0);
+    }
+    if (encode_octal(hdr->gid, sizeof(hdr->gid), st->st_gid) == -1) {
+        snprintf(number, sizeof(number), "%u", (unsigned) st->st_gid);
+        pax_record(slot, "gid", number);
+        encode_octal(hdr->gid, sizeof(hdr->gid), 0);
+    }
+    if (encode_octal(hdr->size, sizeof(hdr->size), slot->size) == -1) {
+        snprintf(number, sizeof(number), "%llu", (unsigned long long) slot->size);
+        pax_record(slot, "size", number);
+        encode_octal(hdr->size, sizeof(hdr->size), 0);
+    }
+    if (st->st_mtime < 0 || encode_octal(hdr->mtime, sizeof(hdr->mtime), st->st_mtime) == -1) {
+        snprintf(number, sizeof(number), "%lld", (long long) st->st_mtime);
+        pax_record(slot, "mtime", number);
+        encode_octal(hdr->mtime, sizeof(hdr->mtime), 0);
+    }
+    hdr->typeflag = typeflag;
+    encode_octal(hdr->devmajor, sizeof(hdr->devmajor), 0);
+    encode_octal(hdr->devminor, sizeof(hdr->devminor), 0);
+    seal_header(hdr);
+
+    if (slot->pax_len > 0) {
+        tar_header_t *pax_hdr = &slot->pax_hdr;
+        memset(pax_hdr, 0, sizeof(tar_header_t));
+        memcpy(pax_hdr->name, "././@PaxHeader", sizeof("././@PaxHeader"));
+        encode_octal(pax_hdr->mode, sizeof(pax_hdr->mode), 0644);
+        memcpy(pax_hdr->uid, hdr->uid, sizeof(hdr->uid));
+        memcpy(pax_hdr->gid, hdr->gid, sizeof(hdr->gid));
+        encode_octal(pax_hdr->size, sizeof(pax_hdr->size), slot->pax_len);
+        memcpy(pax_hdr->mtime, hdr->mtime, sizeof(hdr->mtime));
+        pax_hdr->typeflag = XHDTYPE;
+        seal_header(pax_hdr);
+        memset(slot->pax + slot->pax_len, 0, padded_size(slot->pax_len) - slot->pax_len);
+    }
+}
+
+/* Stats the source of a slot, reads it when it is a small file and builds its headers */
+static int load_entry(struct writer_slot *slot) {
+    struct stat st;
+    char typeflag;
+
+    slot->src_fd = -1;
+    slot->size = 0;
+    slot->link[0] = '\0';
+    if (lstat(slot->src, &st) == -1) {
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        typeflag = REGTYPE;
+        slot->size = st.st_size;
+    } else if (S_ISDIR(st.st_mode)) {
+        typeflag = DIRTYPE;
+        size_t len = strlen(slot->name);
+        if (len > 0 && slot->name[len - 1] != '/') {
+            if (len + 1 >= TAR_PATH_MAX) {
+                return -1;
+            }
+            slot->name[len] = '/';
+            slot->name[len + 1] = '\0';
+        }
+    } else if (S_ISLNK(st.st_mode)) {
+        typeflag = SYMTYPE;
+        ssize_t len = readlink(slot->src, slot->link, TAR_PATH_MAX - 1);
+        if (len == -1) {
+            return -1;
+        }
+        slot->link[len] = '\0';
+    } else {
+        // Devices, fifos and sockets have no place in the archives read by this library
+        return -1;
+    }
+
+    if (slot->size > 0) {
+        int fd = open(slot->src, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return -1;
+        }
+        if (slot->size > WRITER_INLINE) {
+            slot->src_fd = fd;
+        } else {
+            if (slot->data_cap < slot->size) {
+                uint8_t *data = realloc(slot->data, WRITER_INLINE);
+                if (data == NULL) {
+                    close(fd);
+                    return -1;
+                }
+                slot->data = data;
+                slot->data_cap = WRITER_INLINE;
+            }
+            size_t done = 0;
+            while (done < slot->size) {
+                ssize_t n = read(fd, slot->data + done, slot->size - done);
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                done += n;
+            }
+            close(fd);
+            // The file shrank while being read
+            if (done < slot->size) {
+                return -1;
+            }
+        }
+    }
+    encode_headers(slot, &st, typeflag);
+    return 0;
+}
+
+static void *writer_worker(void *arg) {
+    tar_writer_t *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->next == w->tail && !w->closing) {
+            pthread_cond_wait(&w->queued, &w->lock);
+        }
+        if (w->next == w->tail) {
+            break;
+        }
+        struct writer_slot *slot = &w->slots[w->next++ % w->no_slots];
+        slot->state = SLOT_LOADING;
+        pthread_mutex_unlock(&w->lock);
+        int failed = load_entry(slot) == -1;
+        pthread_mutex_lock(&w->lock);
+        slot->failed = failed;
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast(&w->loaded);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static int writev_all(int fd, struct iovec *iov, int no_iov) {
+    while (no_iov > 0) {
+        ssize_t n = writev(fd, iov, no_iov);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        while (no_iov > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            no_iov--;
+        }
+        if (no_iov > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Sends the data of a big file from its source file, as long as the header says, zeros making up for a shrink */
+static int send_source(int out_fd, struct writer_slot *slot) {
+    uint64_t left = slot->size;
+    off_t offset = 0;
+#ifdef __linux__
+    while (left > 0) {
+        ssize_t n = sendfile(out_fd, slot->src_fd, &offset, left < COPY_CHUNK ? left : COPY_CHUNK);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        left -= n;
+    }
+#endif
+    uint8_t *buf = slot->data;
+    if (left > 0 && slot->data_cap < WRITER_INLINE) {
+        if ((buf = realloc(slot->data, WRITER_INLINE)) == NULL) {
+            return -1;
+        }
+        slot->data = buf;
+        slot->data_cap = WRITER_INLINE;
+    }
+    while (left > 0) {
+        size_t chunk = left < WRITER_INLINE ? left : WRITER_INLINE;
+        ssize_t n = pread(slot->src_fd, buf, chunk, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            slot->failed = 1;
+            memset(buf, 0, chunk);
+            n = chunk;
+        }
+        if (write_all(out_fd, buf, n) == -1) {
+            return -1;
+        }
+        offset += n;
+        left -= n;
+    }
+    return 0;
+}
+
+/* Frees the slots up to pos once their blocks are written */
+static void writer_release(tar_writer_t *w, uint64_t pos) {
+    for (; w->head < pos; w->head++) {
+        struct writer_slot *slot = &w->slots[w->head % w->no_slots];
+        w->failed |= slot->failed;
+        if (slot->src_fd != -1) {
+            close(slot->src_fd);
+            slot->src_fd = -1;
+        }
+        slot->state = SLOT_FREE;
+    }
+    pthread_cond_broadcast(&w->freed);
+}
+
+/* Adds the blocks of a loaded slot to iov, returns their number */
+static int gather_slot(struct writer_slot *slot, struct iovec *iov) {
+    int n = 0;
+    if (slot->pax_len > 0) {
+        iov[n++] = (struct iovec) { &slot->pax_hdr, HEADER_SIZE };
+        iov[n++] = (struct iovec) { slot->pax, padded_size(slot->pax_len) };
+    }
+    iov[n++] = (struct iovec) { &slot->hdr, HEADER_SIZE };
+    if (slot->src_fd == -1 && slot->size > 0) {
+        iov[n++] = (struct iovec) { slot->data, slot->size };
+        if (padded_size(slot->size) > (off_t) slot->size) {
+            iov[n++] = (struct iovec) { (void *) zero_blocks, padded_size(slot->size) - slot->size };
+        }
+    }
+    return n;
+}
+
+/* Writes the loaded slots in order, gathering the consecutive ones into a single writev() */
+static void *writer_loop(void *arg) {
+    tar_writer_t *w = arg;
+    struct iovec iov[WRITER_IOVS];
+    int no_iov = 0;
+    uint64_t pos;
+
+    pthread_mutex_lock(&w->lock);
+    for (pos = w->head;;) {
+        int ready = pos != w->tail && w->slots[pos % w->no_slots].state == SLOT_READY;
+        // What is gathered is written as soon as the next entry is not loaded yet
+        if (no_iov > 0 && (!ready || no_iov + 5 > WRITER_IOVS)) {
+            pthread_mutex_unlock(&w->lock);
+            int ret = w->error ? 0 : writev_all(w->fd, iov, no_iov);
+            pthread_mutex_lock(&w->lock);
+            w->error |= ret == -1;
+            no_iov = 0;
+            writer_release(w, pos);
+            continue;
+        }
+        if (!ready) {
+            if (pos == w->tail && w->closing) {
+                break;
+            }
+            pthread_cond_wait(&w->loaded, &w->lock);
+            continue;
+        }
+
+        struct writer_slot *slot = &w->slots[pos++ % w->no_slots];
+        if (slot->failed) {
+            continue;
+        }
+        no_iov += gather_slot(slot, iov + no_iov);
+        if (slot->src_fd != -1) {
+            pthread_mutex_unlock(&w->lock);
+            int ret = w->error ? 0 : writev_all(w->fd, iov, no_iov);
+            if (ret == 0 && !w->error) {
+                ret = send_source(w->fd, slot);
+            }
+            pthread_mutex_lock(&w->lock);
+            w->error |= ret == -1;
+            no_iov = 0;
+            if (padded_size(slot->size) > (off_t) slot->size) {
+                iov[no_iov++] = (struct iovec) { (void *) zero_blocks, padded_size(slot->size) - slot->size };
+            }
+            writer_release(w, pos);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void writer_free(tar_writer_t *w) {
+    for (size_t i = 0; i < w->no_slots; i++) {
+        free(w->slots[i].data);
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->queued);
+    pthread_cond_destroy(&w->loaded);
+    pthread_cond_destroy(&w->freed);
+    free(w->slots);
+    free(w->threads);
+    free(w);
+}
+
+/**
+ * Starts writing an archive.
+ *
+ * @param out_fd A file descriptor the archive is written to, which does not need to be seekable.
+ * @param no_threads The number of threads reading the source files, zero for a default.
+ *
+ * @return a writer, or NULL if memory could not be allocated or the threads could not be started.
+ */
+tar_writer_t *tar_writer_open(int out_fd, int no_threads) {
+    tar_writer_t *w = calloc(1, sizeof(tar_writer_t));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->fd = out_fd;
+    w->no_threads = no_threads > 0 ? no_threads : WRITER_THREADS;
+    w->no_slots = w->no_threads * WRITER_SLOTS_PER_THREAD;
+    w->slots = calloc(w->no_slots, sizeof(struct writer_slot));
+    w->threads = calloc(w->no_threads, sizeof(pthread_t));
+    if (w->slots == NULL || w->threads == NULL) {
+        free(w->slots);
+        free(w->threads);
+        free(w);
+        return NULL;
+    }
+    for (size_t i = 0; i < w->no_slots; i++) {
+        w->slots[i].src_fd = -1;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->queued, NULL);
+    pthread_cond_init(&w->loaded, NULL);
+    pthread_cond_init(&w->freed, NULL);
+
+    if (pthread_create(&w->writer, NULL, writer_loop, w) != 0) {
+        writer_free(w);
+        return NULL;
+    }
+    for (size_t i = 0; i < w->no_threads; i++) {
+        if (pthread_create(&w->threads[i], NULL, writer_worker, w) != 0) {
+            w->no_threads = i;
+            w->error = 1;
+            tar_writer_close(w);
+            return NULL;
+        }
+    }
+    return w;
+}
+
+/**
+ * Queues an entry of the archive being written.
+ */
+int tar_writer_add(tar_writer_t *writer, const char *src_path, const char *name) {
+    OP_SCOPE(TAR_OP_WRITE);
+    if (name == NULL) {
+        name = src_path;
+        while (*name == '/') {
+            name++;
+        }
+    }
+    size_t src_len = strlen(src_path), name_len = strlen(name);
+    // One byte is kept for the slash appended to the names of directories
+    if (src_len >= TAR_PATH_MAX || name_len + 1 >= TAR_PATH_MAX || name_len == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->tail - writer->head == writer->no_slots && !writer->error) {
+        pthread_cond_wait(&writer->freed, &writer->lock);
+    }
+    if (writer->error) {
+        pthread_mutex_unlock(&writer->lock);
+        return -1;
+    }
+    struct writer_slot *slot = &writer->slots[writer->tail++ % writer->no_slots];
+    memcpy(slot->src, src_path, src_len + 1);
+    memcpy(slot->name, name, name_len + 1);
+    slot->failed = 0;
+    slot->state = SLOT_QUEUED;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+    return 0;
+}
+
+/**
+ * Writes the queued entries and the end of the archive, then releases the writer.
+ */
+int tar_writer_close(tar_writer_t *writer) {
+    OP_SCOPE(TAR_OP_WRITE);
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = 1;
+    pthread_cond_broadcast(&writer->queued);
+    pthread_cond_broadcast(&writer->loaded);
+    pthread_mutex_unlock(&writer->lock);
+    for (size_t i = 0; i < writer->no_threads; i++) {
+        pthread_join(writer->threads[i], NULL);
+    }
+    pthread_join(writer->writer, NULL);
+
+    // Two zero blocks end the archive
+    int ret = writer->error || write_all(writer->fd, zero_blocks, sizeof(zero_blocks)) == -1 ? -1 : 0;
+    if (writer->failed) {
+        ret = -1;
+    }
+    writer_free(writer);
+    return ret;
+}
+
+/*
+ * Extraction.
+ *
+ * The entries to extract are taken from the directory tree of the index in a single pass, parents first. The
+ * directories are created up front, then the files are written by a pool of threads, each one taking the next
+ * file of the list. Hard links and symlinks come last, so that no file is written through a symlink of the archive,
+ * and every path is walked from the destination one directory at a time without following symlinks, so that none
+ * already in the destination leads out of it either.
+ * The modes and times of the directories are set at the very end, children first, since writing into a directory
+ * changes its own mtime.
+ */
+#define EXTRACT_THREADS 4
+
+struct extract_job {
+    const tar_archive_t *ar;
+    int dest_fd;
+    const size_t *files;        // indices of the files to write
+    size_t no_files;
+    size_t next;                // next file to take, atomically
+    size_t failed;              // atomically
+    int op;                     // statistics scope of the caller, see OP_SCOPE()
+};
+
+/* Returns the path an entry is extracted to, relative to the destination, or NULL if it would escape it */
+static const char *extract_path(const char *name) {
+    while (*name == '/') {
+        name++;
+    }
+    for (const char *p = name; *p != '\0';) {
+        const char *end = strchrnul(p, '/');
+        if (end - p == 2 && p[0] == '.' && p[1] == '.') {
+            return NULL;
+        }
+        p = *end == '/' ? end + 1 : end;
+    }
+    return *name != '\0' ? name : NULL;
+}
+
+/*
+ * Opens the directory an entry is extracted into, one component at a time from the destination without following
+ * any symlink, so that a symlink of the archive or one already in the destination cannot lead out of it. The last
+ * component of the path is copied to base. Returns the directory, to be closed by the caller, or -1 on failure.
+ */
+static int open_parent(int dest_fd, const char *path, char base[NAME_MAX + 1]) {
+    int dir_fd = fcntl(dest_fd, F_DUPFD_CLOEXEC, 0);
+    base[0] = '\0';
+    for (const char *p = path; dir_fd != -1 && *p != '\0';) {
+        const char *end = strchrnul(p, '/');
+        size_t len = end - p;
+        const char *name = p;
+        p = *end == '/' ? end + 1 : end;
+        if (len == 0 || (len == 1 && name[0] == '.')) {
+            continue;
+        }
+        if (len > NAME_MAX) {
+            close(dir_fd);
+            return -1;
+        }
+        if (base[0] != '\0') {
+            // The previous component is a directory on the way
+            int next = openat(dir_fd, base, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            close(dir_fd);
+            dir_fd = next;
+        }
+        memcpy(base, name, len);
+        base[len] = '\0';
+    }
+    if (dir_fd != -1 && base[0] == '\0') {
+        close(dir_fd);
+        return -1;
+    }
+    return dir_fd;
+}
+
+/* Writes a file with its data, then its mode and mtime */
+static int extract_file(const tar_archive_t *ar, int dest_fd, const tar_entry_t *entry) {
+    const char *path = extract_path(entry->name);
+    char base[NAME_MAX + 1];
+    int dir_fd = path != NULL ? open_parent(dest_fd, path, base) : -1;
+    if (dir_fd == -1) {
+        return -1;
+    }
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+    int fd = openat(dir_fd, base, flags, 0600);
+    if (fd == -1 && errno != ENOENT) {
+        // A symlink or anything else in the way is replaced
+        unlinkat(dir_fd, base, 0);
+        fd = openat(dir_fd, base, flags, 0600);
+    }
+    close(dir_fd);
+    if (fd == -1) {
+        return -1;
+    }
+    int ret = 0;
+    const struct sparse_file *sparse = ar->nodes[entry - ar->entries].sparse;
+    if (sparse != NULL) {
+        // Only the runs are written, seeking over the holes, and the size set last keeps a trailing hole one too
+        for (size_t i = 0; i < sparse->no_segments && ret == 0; i++) {
+            const struct sparse_segment *segment = &sparse->segments[i];
+            if (lseek(fd, segment->offset, SEEK_SET) == -1
+                || send_range(ar, sparse->data + segment->stored, fd, segment->size) == -1) {
+                ret = -1;
+            }
+        }
+        if (ret == 0 && ftruncate(fd, sparse->size) == -1) {
+            ret = -1;
+        }
+    } else if (entry->size > 0) {
+#ifdef __linux__
+        // Lets the filesystem lay the file out in one go, it is only a hint
+        fallocate(fd, 0, 0, entry->size);
+#endif
+        ret = send_range(ar, entry->offset + HEADER_SIZE, fd, entry->size);
+    }
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { entry->mtime, 0 } };
+    if (fchmod(fd, entry->mode) == -1 || futimens(fd, times) == -1) {
+        ret = -1;
+    }
+    if (close(fd) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
+
+static void *extract_worker(void *arg) {
+    struct extract_job *job = arg;
+    current_op = job->op;
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->no_files) {
+        if (extract_file(job->ar, job->dest_fd, &job->ar->entries[job->files[i]]) == -1) {
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    current_op = -1;
+    return NULL;
+}
+
+/* Creates a link entry, replacing what is in the way */
+static int extract_link(int dest_fd, const tar_entry_t *entry) {
+    const char *path = extract_path(entry->name);
+    char base[NAME_MAX + 1], target_base[NAME_MAX + 1];
+    int dir_fd = path != NULL ? open_parent(dest_fd, path, base) : -1;
+    if (dir_fd == -1) {
+        return -1;
+    }
+    // The target of a hard link is reached the same way, a symlink on its path would link a file from elsewhere
+    int target_fd = -1;
+    if (entry->typeflag != SYMTYPE) {
+        const char *target = extract_path(entry->linkname);
+        target_fd = target != NULL ? open_parent(dest_fd, target, target_base) : -1;
+        if (target_fd == -1) {
+            close(dir_fd);
+            return -1;
+        }
+    }
+    int ret = 0;
+    for (int tries = 0; tries < 2; tries++) {
+        if (entry->typeflag == SYMTYPE) {
+            ret = symlinkat(entry->linkname, dir_fd, base);
+        } else {
+            ret = linkat(target_fd, target_base, dir_fd, base, 0);
+        }
+        if (ret == 0 || errno != EEXIST || tries == 1) {
+            break;
+        }
+        unlinkat(dir_fd, base, 0);
+    }
+    if (ret == 0 && entry->typeflag == SYMTYPE) {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, { entry->mtime, 0 } };
+        utimensat(dir_fd, base, times, AT_SYMLINK_NOFOLLOW);
+    }
+    if (target_fd != -1) {
+        close(target_fd);
+    }
+    close(dir_fd);
+    return ret;
+}
+
+/* Creates a directory owner-writable until its children are in, or keeps the one already there */
+static int extract_dir(int dest_fd, const tar_entry_t *entry) {
+    const char *path = extract_path(entry->name);
+    char base[NAME_MAX + 1];
+    int dir_fd = path != NULL ? open_parent(dest_fd, path, base) : -1;
+    if (dir_fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    int ret = 0;
+    if (mkdirat(dir_fd, base, 0700) == -1
+        && (errno != EEXIST || fstatat(dir_fd, base, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISDIR(st.st_mode))) {
+        ret = -1;
+    }
+    close(dir_fd);
+    return ret;
+}
+
+/* Sets the mode and mtime of a directory once its children are in, a skipped one having failed already */
+static int finish_dir(int dest_fd, const tar_entry_t *entry) {
+    const char *path = extract_path(entry->name);
+    if (path == NULL) {
+        return 0;
+    }
+    char base[NAME_MAX + 1];
+    int dir_fd = open_parent(dest_fd, path, base);
+    if (dir_fd == -1) {
+        return -1;
+    }
+    // Opened without following a symlink that replaced it meanwhile, the mode is then set on what was created
+    int fd = openat(dir_fd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    close(dir_fd);
+    if (fd == -1) {
+        return -1;
+    }
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { entry->mtime, 0 } };
+    int ret = fchmod(fd, entry->mode) == -1 || (entry->offset >= 0 && futimens(fd, times) == -1) ? -1 : 0;
+    close(fd);
+    return ret;
+}
 
 /**
- * Checks whether the archive is valid.
+ * Extracts an indexed archive, or part of it, to a directory.
+ */
+int tar_extract(const tar_archive_t *ar, const char *dest_dir, const char *prefix, int no_threads) {
+    OP_SCOPE(TAR_OP_EXTRACT);
+    size_t top = NO_NODE;
+    if (prefix != NULL && prefix[0] != '\0') {
+        const tar_entry_t *entry = lookup_dir(ar, prefix);
+        if (entry == NULL) {
+            return -1;
+        }
+        top = entry - ar->entries;
+    }
+    int dest_fd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dest_fd == -1) {
+        return -1;
+    }
+    size_t *order = malloc((ar->no_entries + 1) * sizeof(size_t));
+    size_t *files = malloc((ar->no_entries + 1) * sizeof(size_t));
+    if (order == NULL || files == NULL) {
+        free(order);
+        free(files);
+        close(dest_fd);
+        return -1;
+    }
+
+    // The directories above the prefix, top down, then the prefix and what is under it, parents first
+    size_t no_order = 0, no_files = 0;
+    if (top != NO_NODE) {
+        for (size_t dir = ar->nodes[top].parent; dir != NO_NODE; dir = ar->nodes[dir].parent) {
+            order[no_order++] = dir;
+        }
+        for (size_t i = 0; i < no_order / 2; i++) {
+            size_t tmp = order[i];
+            order[i] = order[no_order - 1 - i];
+            order[no_order - 1 - i] = tmp;
+        }
+        order[no_order++] = top;
+    }
+    const struct tree_node *start = top == NO_NODE ? &ar->root : &ar->nodes[top];
+    for (size_t node = start->first_child; node != NO_NODE; node = next_node(ar, top, node, 1)) {
+        order[no_order++] = node;
+    }
+
+    size_t failed = 0;
+    for (size_t i = 0; i < no_order; i++) {
+        const tar_entry_t *entry = &ar->entries[order[i]];
+        if (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE) {
+            files[no_files++] = order[i];
+        } else if (entry->typeflag == DIRTYPE) {
+            if (extract_dir(dest_fd, entry) == -1) {
+                failed++;
+            }
+        } else if (entry->typeflag != SYMTYPE && entry->typeflag != LNKTYPE) {
+            failed++;
+        }
+    }
+
+    struct extract_job job = { ar, dest_fd, files, no_files, 0, 0, current_op };
+    size_t no_workers = no_threads > 0 ? no_threads : EXTRACT_THREADS;
+    if (no_workers > no_files) {
+        no_workers = no_files > 0 ? no_files : 1;
+    }
+    pthread_t *threads = malloc(no_workers * sizeof(pthread_t));
+    size_t started = 0;
+    // The calling thread is a worker too
+    while (threads != NULL && started + 1 < no_workers
+           && pthread_create(&threads[started], NULL, extract_worker, &job) == 0) {
+        started++;
+    }
+    extract_worker(&job);
+    current_op = job.op;
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    failed += job.failed;
+
+    for (size_t i = 0; i < no_order; i++) {
+        const tar_entry_t *entry = &ar->entries[order[i]];
+        if (entry->typeflag == LNKTYPE && extract_link(dest_fd, entry) == -1) {
+            failed++;
+        }
+    }
+    for (size_t i = 0; i < no_order; i++) {
+        const tar_entry_t *entry = &ar->entries[order[i]];
+        if (entry->typeflag == SYMTYPE && extract_link(dest_fd, entry) == -1) {
+            failed++;
+        }
+    }
+    for (size_t i = no_order; i-- > 0;) {
+        const tar_entry_t *entry = &ar->entries[order[i]];
+        if (entry->typeflag == DIRTYPE && finish_dir(dest_fd, entry) == -1) {
+            failed++;
+        }
+    }
+
+    free(order);
+    free(files);
+    close(dest_fd);
+    return failed > INT_MAX ? INT_MAX : (int) failed;
+}
+
+/*
+ * Digests of the data of the members.
  *
- * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
- *  - a correct checksum
+ * The files are cut in pieces shared by a pool of threads, the biggest first so that a huge one does not end up
+ * alone at the end, and each piece is hashed by a single thread in chunks, every byte being read once. A file is a
+ * single piece when its SHA-256 is asked for, as the blocks of SHA-256 chain, while the CRC-32C of pieces of
+ * DIGEST_PIECE bytes are combined into the one of the file. The data is hashed in place in the mapping when the
+ * archive is mapped, the next chunk being prefetched while the current one is hashed, and read chunk by chunk
+ * otherwise. The manifest is written in archive order once every file has been hashed.
+ */
+#define DIGEST_THREADS 4
+#define DIGEST_PIECE (4 * COPY_CHUNK)
+
+/* Digests of a file, filled by digest_file() */
+struct file_digest {
+    uint32_t crc32c;
+    uint8_t sha256[32];
+    int failed;
+};
+
+/* A range of the data of a file, hashed by one thread */
+struct digest_piece {
+    size_t file;                // position in the files of the job
+    uint64_t start;
+    uint64_t len;
+    uint32_t crc32c;            // of the range alone, without the initial and final inversions
+};
+
+struct digest_job {
+    const tar_archive_t *ar;
+    int digests;                // TAR_DIGEST_* flags
+    const size_t *files;        // indices of the files, in archive order
+    struct digest_piece *pieces;    // in archive order, the pieces of a file following each other
+    const size_t *order;        // positions in pieces, biggest piece first
+    size_t no_pieces;
+    struct file_digest *results;    // one per file
+    size_t next;                // next position of order to take, atomically
+    int op;                     // statistics scope of the caller, see OP_SCOPE()
+};
+
+// CRC-32C of the bytes, computed a byte at a time when the CPU has no crc32 instruction
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            // Reflected Castagnoli polynomial
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, const uint8_t *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    while (len-- > 0) {
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len) {
+    uint64_t c = crc;
+    for (; len > 0 && ((uintptr_t) data & 7) != 0; len--) {
+        c = _mm_crc32_u8(c, *data++);
+    }
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    for (; len > 0; len--) {
+        c = _mm_crc32_u8(c, *data++);
+    }
+    return c;
+}
+#endif
+
+/* Updates a CRC-32C, without the initial and final inversions, with the crc32 instruction when the CPU has it */
+static uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42(crc, data, len);
+    }
+#endif
+    return crc32c_scalar(crc, data, len);
+}
+
+/* Multiplies two polynomials modulo the Castagnoli polynomial, bit-reflected like the CRC, a not being zero */
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t product = 0;
+    for (;;) {
+        if (a & m) {
+            product ^= b;
+            if ((a & (m - 1)) == 0) {
+                return product;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0x82f63b78 : b >> 1;
+    }
+}
+
+/*
+ * Returns the CRC-32C register crc once len zero bytes are added, crc times x^(8 len). The register over two ranges
+ * is then the one over the first shifted by the length of the second, xored with the CRC of the second alone.
+ */
+static uint32_t crc32c_shift(uint32_t crc, uint64_t len) {
+    // x^(8 2^k) at the k-th bit of len, starting with x^8
+    uint32_t power = 1u << 23;
+    for (; len > 0; len >>= 1) {
+        if (len & 1) {
+            crc = crc32c_multiply(power, crc);
+        }
+        power = crc32c_multiply(power, power);
+    }
+    return crc;
+}
+
+/* State of a SHA-256 computation, FIPS 180-4 */
+struct sha256 {
+    uint32_t h[8];
+    uint64_t len;               // bytes hashed so far
+    uint8_t block[64];          // partial block, len % 64 bytes long
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(uint32_t h[8], const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+static void sha256_init(struct sha256 *sha) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(sha->h, iv, sizeof(iv));
+    sha->len = 0;
+}
+
+static void sha256_update(struct sha256 *sha, const uint8_t *data, size_t len) {
+    size_t fill = sha->len % 64;
+    sha->len += len;
+    if (fill > 0) {
+        size_t n = len < 64 - fill ? len : 64 - fill;
+        memcpy(sha->block + fill, data, n);
+        data += n;
+        len -= n;
+        if (fill + n < 64) {
+            return;
+        }
+        sha256_block(sha->h, sha->block);
+    }
+    for (; len >= 64; data += 64, len -= 64) {
+        sha256_block(sha->h, data);
+    }
+    memcpy(sha->block, data, len);
+}
+
+static void sha256_final(struct sha256 *sha, uint8_t out[32]) {
+    uint64_t bits = sha->len * 8;
+    uint8_t pad[72] = { 0x80 };
+    // Pads to 56 bytes modulo 64, then appends the length in bits, big-endian
+    size_t pad_len = (sha->len % 64 < 56 ? 56 : 120) - sha->len % 64;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = bits >> (56 - 8 * i);
+    }
+    sha256_update(sha, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = sha->h[i] >> 24;
+        out[4 * i + 1] = sha->h[i] >> 16;
+        out[4 * i + 2] = sha->h[i] >> 8;
+        out[4 * i + 3] = sha->h[i];
+    }
+}
+
+/*
+ * Hashes a piece of the data of a file, buf being COPY_CHUNK bytes of scratch space. The SHA-256 is only asked for
+ * when the piece is the whole file.
+ */
+static int digest_piece(const tar_archive_t *ar, const tar_entry_t *entry, int digests, uint8_t *buf,
+                        struct digest_piece *piece, struct file_digest *result) {
+    uint32_t crc = 0;
+    struct sha256 sha;
+    sha256_init(&sha);
+    // The mapping of a compressed archive holds the compressed bytes, a sparse file has holes to fill
+    int in_place = ar->map != NULL && ar->gz == NULL && ar->nodes[entry - ar->entries].sparse == NULL;
+    off_t offset = entry->offset + HEADER_SIZE + piece->start;
+    uint64_t left = piece->len;
+    long page = sysconf(_SC_PAGESIZE);
+    while (left > 0) {
+        size_t n = left < COPY_CHUNK ? left : COPY_CHUNK;
+        const uint8_t *data = buf;
+        if (in_place) {
+            if ((uint64_t) offset + n > ar->map_len) {
+                return -1;
+            }
+            data = ar->map + offset;
+            STAT_ADD(bytes_read, n);
+            if (left > n) {
+                // Pages the next chunk in while this one is hashed
+                off_t next = (offset + n) & ~(off_t) (page - 1);
+                size_t ahead = left - n < COPY_CHUNK ? left - n : COPY_CHUNK;
+                madvise((void *) (ar->map + next), offset + n + ahead - next, MADV_WILLNEED);
+            }
+        } else if (read_entry(ar, entry, piece->start + piece->len - left, buf, n) == -1) {
+            return -1;
+        }
+        if (digests & TAR_DIGEST_CRC32C) {
+            crc = crc32c(crc, data, n);
+        }
+        if (digests & TAR_DIGEST_SHA256) {
+            sha256_update(&sha, data, n);
+        }
+        offset += n;
+        left -= n;
+    }
+    piece->crc32c = crc;
+    if (digests & TAR_DIGEST_SHA256) {
+        sha256_final(&sha, result->sha256);
+    }
+    return 0;
+}
+
+static void *digest_worker(void *arg) {
+    struct digest_job *job = arg;
+    current_op = job->op;
+    uint8_t *buf = malloc(COPY_CHUNK);
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->no_pieces) {
+        struct digest_piece *piece = &job->pieces[job->order[i]];
+        struct file_digest *result = &job->results[piece->file];
+        const tar_entry_t *entry = &job->ar->entries[job->files[piece->file]];
+        if (buf == NULL || digest_piece(job->ar, entry, job->digests, buf, piece, result) == -1) {
+            __atomic_store_n(&result->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(buf);
+    current_op = -1;
+    return NULL;
+}
+
+static int compare_sizes(const void *a, const void *b, void *arg) {
+    const struct digest_job *job = arg;
+    uint64_t size_a = job->pieces[*(const size_t *) a].len;
+    uint64_t size_b = job->pieces[*(const size_t *) b].len;
+    return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+}
+
+/* Writes the line of a file to the manifest */
+static int write_digest(FILE *manifest, const char *name, int digests, const struct file_digest *digest) {
+    if (digests & TAR_DIGEST_CRC32C) {
+        fprintf(manifest, "%08x%s", (unsigned) digest->crc32c, digests & TAR_DIGEST_SHA256 ? " " : "");
+    }
+    if (digests & TAR_DIGEST_SHA256) {
+        for (int i = 0; i < 32; i++) {
+            fprintf(manifest, "%02x", digest->sha256[i]);
+        }
+    }
+    return fprintf(manifest, "  %s\n", name) < 0 ? -1 : 0;
+}
+
+/**
+ * Computes digests of the data of every file of an indexed archive and writes them as a manifest.
+ */
+int tar_digest(const tar_archive_t *ar, int digests, int no_threads, int manifest_fd) {
+    OP_SCOPE(TAR_OP_DIGEST);
+    if (ar == NULL || (digests & (TAR_DIGEST_CRC32C | TAR_DIGEST_SHA256)) == 0) {
+        return -1;
+    }
+    // A file is cut in pieces only when its CRC-32C alone is asked for
+    uint64_t piece_len = digests & TAR_DIGEST_SHA256 ? UINT64_MAX : DIGEST_PIECE;
+
+    // The files of the tree, a path archived twice being digested as it would be extracted
+    size_t *files = malloc((ar->no_entries + 1) * sizeof(size_t));
+    size_t no_files = 0, no_pieces = 0;
+    for (size_t i = 0; files != NULL && i < ar->no_entries; i++) {
+        const tar_entry_t *entry = &ar->entries[i];
+        if ((entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE) && *find_bucket(ar, entry->name) == i + 1) {
+            files[no_files++] = i;
+            no_pieces += entry->size > piece_len ? (entry->size - 1) / piece_len + 1 : 1;
+        }
+    }
+    struct digest_piece *pieces = malloc((no_pieces + 1) * sizeof(struct digest_piece));
+    size_t *order = malloc((no_pieces + 1) * sizeof(size_t));
+    struct file_digest *results = calloc(no_files + 1, sizeof(struct file_digest));
+    int dup_fd = dup(manifest_fd);
+    FILE *manifest = dup_fd != -1 ? fdopen(dup_fd, "w") : NULL;
+    if (files == NULL || pieces == NULL || order == NULL || results == NULL || manifest == NULL) {
+        free(files);
+        free(pieces);
+        free(order);
+        free(results);
+        if (manifest != NULL) {
+            fclose(manifest);
+        } else if (dup_fd != -1) {
+            close(dup_fd);
+        }
+        return -1;
+    }
+
+    size_t next = 0;
+    for (size_t i = 0; i < no_files; i++) {
+        uint64_t size = ar->entries[files[i]].size;
+        uint64_t start = 0;
+        do {
+            uint64_t len = size - start < piece_len ? size - start : piece_len;
+            order[next] = next;
+            pieces[next++] = (struct digest_piece) { i, start, len, 0 };
+            start += len;
+        } while (start < size);
+    }
+    struct digest_job job = { ar, digests, files, pieces, order, no_pieces, results, 0, current_op };
+    qsort_r(order, no_pieces, sizeof(size_t), compare_sizes, &job);
+
+    size_t no_workers = no_threads > 0 ? no_threads : DIGEST_THREADS;
+    if (no_workers > no_pieces) {
+        no_workers = no_pieces > 0 ? no_pieces : 1;
+    }
+    pthread_t *threads = malloc(no_workers * sizeof(pthread_t));
+    size_t started = 0;
+    // The calling thread is a worker too
+    while (threads != NULL && started + 1 < no_workers
+           && pthread_create(&threads[started], NULL, digest_worker, &job) == 0) {
+        started++;
+    }
+    digest_worker(&job);
+    current_op = job.op;
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    // The CRC-32C of a file chains the ones of its pieces, see crc32c_shift()
+    for (size_t i = 0; i < no_pieces; i++) {
+        const struct digest_piece *piece = &pieces[i];
+        struct file_digest *result = &results[piece->file];
+        uint32_t crc = piece->start == 0 ? ~0u : ~result->crc32c;
+        result->crc32c = ~(crc32c_shift(crc, piece->len) ^ piece->crc32c);
+    }
+
+    size_t failed = 0;
+    int ret = 0;
+    for (size_t i = 0; i < no_files && ret == 0; i++) {
+        if (results[i].failed) {
+            failed++;
+        } else {
+            ret = write_digest(manifest, ar->entries[files[i]].name, digests, &results[i]);
+        }
+    }
+    if (fclose(manifest) == EOF) {
+        ret = -1;
+    }
+    free(files);
+    free(pieces);
+    free(order);
+    free(results);
+    if (ret == -1) {
+        return -1;
+    }
+    return failed > INT_MAX ? INT_MAX : (int) failed;
+}
+
+/*
+ * Catalog of many archives.
  *
- * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * The entries of every shard are merged into a single index, a handle without an fd whose offsets point into the
+ * shards, another array telling the shard of each entry. The shards are indexed once and their fds are then kept in
+ * a list ordered by last use, the least recently used one being closed when a shard must be opened over the limit.
+ * A shard is checked against its identity when it is opened again, so that a replaced file is not read through
+ * offsets of the old one.
+ */
+
+/* An archive of a catalog */
+struct shard {
+    char *path;
+    int fd;                     // -1 while closed
+    int users;                  // reads in progress, fd is not closed under them
+    size_t newer;               // neighbours in the list of open shards, NO_NODE at its ends
+    size_t older;
+    // Identity of the file when it was indexed
+    dev_t dev;
+    ino_t ino;
+    off_t st_size;
+    struct timespec mtime;
+};
+
+struct tar_catalog {
+    tar_archive_t *index;       // merged index, without an fd
+    size_t *shard_of;           // shard of each entry of the index, NO_NODE for the implied directories
+    struct shard *shards;
+    size_t no_shards;
+    size_t max_open;
+    size_t no_open;
+    size_t mru;                 // ends of the list of open shards
+    size_t lru;
+    pthread_mutex_t lock;       // guards the fds and the list of open shards
+};
+
+/* Takes an open shard out of the list of open shards */
+static void unlink_shard(tar_catalog_t *cat, size_t i) {
+    struct shard *shard = &cat->shards[i];
+    if (shard->newer != NO_NODE) {
+        cat->shards[shard->newer].older = shard->older;
+    } else {
+        cat->mru = shard->older;
+    }
+    if (shard->older != NO_NODE) {
+        cat->shards[shard->older].newer = shard->newer;
+    } else {
+        cat->lru = shard->newer;
+    }
+    shard->newer = shard->older = NO_NODE;
+}
+
+/* Puts an open shard at the most recently used end of the list */
+static void push_shard(tar_catalog_t *cat, size_t i) {
+    struct shard *shard = &cat->shards[i];
+    shard->newer = NO_NODE;
+    shard->older = cat->mru;
+    if (cat->mru != NO_NODE) {
+        cat->shards[cat->mru].newer = i;
+    } else {
+        cat->lru = i;
+    }
+    cat->mru = i;
+}
+
+/* Closes the least recently used shards nobody reads until one more can be opened, or none is left to close */
+static void evict_shards(tar_catalog_t *cat) {
+    for (size_t i = cat->lru; i != NO_NODE && cat->no_open >= cat->max_open;) {
+        size_t newer = cat->shards[i].newer;
+        if (cat->shards[i].users == 0) {
+            unlink_shard(cat, i);
+            close(cat->shards[i].fd);
+            cat->shards[i].fd = -1;
+            cat->no_open--;
+        }
+        i = newer;
+    }
+}
+
+/* Returns an fd on a shard, opened if needed, which stays open until release_shard(), or -1 */
+static int acquire_shard(tar_catalog_t *cat, size_t i) {
+    struct shard *shard = &cat->shards[i];
+    pthread_mutex_lock(&cat->lock);
+    if (shard->fd != -1) {
+        unlink_shard(cat, i);
+    } else {
+        evict_shards(cat);
+        struct stat st;
+        int fd = open(shard->path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && (fstat(fd, &st) == -1 || st.st_dev != shard->dev || st.st_ino != shard->ino
+                         || st.st_size != shard->st_size || st.st_mtim.tv_sec != shard->mtime.tv_sec
+                         || st.st_mtim.tv_nsec != shard->mtime.tv_nsec)) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            pthread_mutex_unlock(&cat->lock);
+            return -1;
+        }
+        shard->fd = fd;
+        cat->no_open++;
+    }
+    push_shard(cat, i);
+    shard->users++;
+    int fd = shard->fd;
+    pthread_mutex_unlock(&cat->lock);
+    return fd;
+}
+
+static void release_shard(tar_catalog_t *cat, size_t i) {
+    pthread_mutex_lock(&cat->lock);
+    cat->shards[i].users--;
+    pthread_mutex_unlock(&cat->lock);
+}
+
+/* Indexes a shard and adds its entries to the catalog, keeping its fd open if the limit allows */
+static int add_shard(tar_catalog_t *cat, size_t i, size_t *cap_shard_of) {
+    struct shard *shard = &cat->shards[i];
+    int fd = open(shard->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    shard->dev = st.st_dev;
+    shard->ino = st.st_ino;
+    shard->st_size = st.st_size;
+    shard->mtime = st.st_mtim;
+    tar_archive_t *ar = tar_open(fd);
+    if (ar == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    int ret = 0;
+    tar_archive_t *index = cat->index;
+    for (size_t e = 0; e < ar->no_entries && ret == 0; e++) {
+        const tar_entry_t *entry = &ar->entries[e];
+        // The implied directories are implied again by the merged index
+        if (entry->offset < 0 || *find_bucket(ar, entry->name) != e + 1) {
+            continue;
+        }
+        if (index->no_entries == *cap_shard_of) {
+            size_t cap = *cap_shard_of ? *cap_shard_of * 2 : 64;
+            size_t *shard_of = realloc(cat->shard_of, cap * sizeof(size_t));
+            if (shard_of == NULL) {
+                ret = -1;
+                break;
+            }
+            cat->shard_of = shard_of;
+            *cap_shard_of = cap;
+        }
+        cat->shard_of[index->no_entries] = i;
+        ret = append_entry(index, entry->name, strlen(entry->name), entry->linkname, entry->offset, entry->size,
+                           entry->typeflag);
+        const struct sparse_file *sparse = ar->nodes[e].sparse;
+        if (ret == 0) {
+            index->entries[index->no_entries - 1].mode = entry->mode;
+            index->entries[index->no_entries - 1].uid = entry->uid;
+            index->entries[index->no_entries - 1].gid = entry->gid;
+            index->entries[index->no_entries - 1].mtime = entry->mtime;
+        }
+        if (ret == 0 && sparse != NULL) {
+            ret = add_sparse(index, index->no_entries - 1, sparse->segments, sparse->no_segments, sparse->data);
+        }
+    }
+    tar_close(ar);
+    if (ret == 0 && cat->no_open < cat->max_open) {
+        shard->fd = fd;
+        cat->no_open++;
+        push_shard(cat, i);
+    } else {
+        close(fd);
+    }
+    return ret;
+}
+
+/**
+ * Indexes many archives as a single namespace.
+ */
+tar_catalog_t *tar_catalog_open(const char *const *paths, size_t no_paths, size_t max_open) {
+    OP_SCOPE(TAR_OP_OPEN);
+    tar_catalog_t *cat = calloc(1, sizeof(tar_catalog_t));
+    if (cat == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&cat->lock, NULL);
+    cat->max_open = max_open > 0 ? max_open : 1;
+    cat->mru = cat->lru = NO_NODE;
+    cat->index = calloc(1, sizeof(tar_archive_t));
+    cat->shards = calloc(no_paths + 1, sizeof(struct shard));
+    if (cat->index == NULL || cat->shards == NULL) {
+        tar_catalog_close(cat);
+        return NULL;
+    }
+    cat->index->fd = -1;
+    if (grow_buckets(cat->index) == -1) {
+        tar_catalog_close(cat);
+        return NULL;
+    }
+
+    size_t cap_shard_of = 0;
+    for (size_t i = 0; i < no_paths; i++) {
+        struct shard *shard = &cat->shards[i];
+        shard->fd = -1;
+        shard->newer = shard->older = NO_NODE;
+        shard->path = strdup(paths[i]);
+        cat->no_shards++;
+        if (shard->path == NULL || add_shard(cat, i, &cap_shard_of) == -1) {
+            tar_catalog_close(cat);
+            return NULL;
+        }
+    }
+    // The tree may add implied directories, which belong to no shard
+    size_t no_headers = cat->index->no_entries;
+    if (build_tree(cat->index) == -1) {
+        tar_catalog_close(cat);
+        return NULL;
+    }
+    size_t *shard_of = realloc(cat->shard_of, (cat->index->no_entries + 1) * sizeof(size_t));
+    if (shard_of == NULL) {
+        tar_catalog_close(cat);
+        return NULL;
+    }
+    cat->shard_of = shard_of;
+    for (size_t i = no_headers; i < cat->index->no_entries; i++) {
+        cat->shard_of[i] = NO_NODE;
+    }
+    return cat;
+}
+
+/**
+ * Closes a catalog.
+ */
+void tar_catalog_close(tar_catalog_t *cat) {
+    if (cat == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < cat->no_shards; i++) {
+        if (cat->shards[i].fd != -1) {
+            close(cat->shards[i].fd);
+        }
+        free(cat->shards[i].path);
+    }
+    free(cat->shards);
+    free(cat->shard_of);
+    tar_close(cat->index);
+    pthread_mutex_destroy(&cat->lock);
+    free(cat);
+}
+
+/**
+ * Returns the merged index of a catalog.
+ */
+const tar_archive_t *tar_catalog_index(const tar_catalog_t *cat) {
+    return cat != NULL ? cat->index : NULL;
+}
+
+/**
+ * Looks up an entry of a catalog.
+ */
+const tar_entry_t *tar_catalog_lookup(const tar_catalog_t *cat, const char *path, const char **archive) {
+    const tar_entry_t *entry = cat != NULL ? tar_lookup(cat->index, path) : NULL;
+    if (entry != NULL && archive != NULL) {
+        size_t shard = cat->shard_of[entry - cat->index->entries];
+        *archive = shard != NO_NODE ? cat->shards[shard].path : NULL;
+    }
+    return entry;
+}
+
+/**
+ * Checks whether an entry exists in a catalog, see exists().
+ */
+int tar_catalog_exists(const tar_catalog_t *cat, const char *path) {
+    return cat != NULL && tar_exists(cat->index, path);
+}
+
+/**
+ * Lists the entries at a given path of a catalog, see list().
+ */
+int tar_catalog_list(const tar_catalog_t *cat, const char *path, char **entries, size_t *no_entries) {
+    return cat != NULL ? tar_list(cat->index, path, entries, no_entries) : 0;
+}
+
+/**
+ * Reads a file at a given path of a catalog, see read_file().
+ */
+ssize_t tar_catalog_read_file(tar_catalog_t *cat, const char *path, size_t offset, uint8_t *dest, size_t *len) {
+    OP_SCOPE(TAR_OP_READ);
+    const tar_entry_t *entry = cat != NULL ? lookup_file(cat->index, path) : NULL;
+    if (entry == NULL) {
+        return -1;
+    }
+    off_t start;
+    ssize_t ret = file_span(entry, offset, len, &start);
+    if (ret < 0) {
+        return ret;
+    }
+    size_t shard = cat->shard_of[entry - cat->index->entries];
+    int fd = acquire_shard(cat, shard);
+    if (fd == -1) {
+        return -1;
+    }
+    // The index read through the fd of the shard, which the block cache knows it by
+    tar_archive_t view = *cat->index;
+    view.fd = fd;
+    view.dev = cat->shards[shard].dev;
+    view.ino = cat->shards[shard].ino;
+    view.st_size = cat->shards[shard].st_size;
+    view.mtime = cat->shards[shard].mtime;
+    if (read_entry(&view, entry, offset, dest, *len) == -1) {
+        ret = -1;
+    }
+    release_shard(cat, shard);
+    return ret;
+}
+
+/*
+ * Archive server.
  *
- * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
- *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+ * A server indexes its archives once and answers the clients of a Unix socket, with a thread per connection. A
+ * request is a fixed header followed by the path of the archive and the path of the entry, a reply a fixed header
+ * followed by a payload. The bytes of a plain file do not go through the socket: the reply gives the range of the
+ * archive holding them, and passes the fd of the archive by SCM_RIGHTS the first time a client reads from it, the
+ * client then reads the range itself. Only the files of compressed archives and the sparse files, whose bytes are
+ * not laid out as such in the archive, come back in the payload.
  */
-int check_archive(int tar_fd) {
 
-    off_t position=lseek(tar_fd, 0, SEEK_SET);
-    if(position==-1){
-        printf("position failed\n");
-        return -1;
-    }
-    header = malloc(sizeof(tar_header_t));
+#define SERVE_EXISTS 1
+#define SERVE_LIST   2
+#define SERVE_READ   3
+
+// Flag of a read whose client has no fd of the archive yet
+#define SERVE_WANT_FD 1
+
+// Most bytes of a file copied in a reply, a longer read is partial
+#define SERVE_MAX_PAYLOAD (1 << 20)
+
+// Names listed per call of tar_list_ex() while filling a reply
+#define SERVE_LIST_PAGE 64
+
+// Pause of the accept loop while the process is out of fds or memory, in nanoseconds
+#define SERVE_BACKOFF_NS 50000000
+
+// Connections served at once unless tar_server_set_max_conns() is called
+#define SERVE_MAX_CONNS 64
+
+struct serve_request {
+    uint32_t op;
+    uint32_t flags;
+    uint64_t offset;            // read: offset in the file
+    uint64_t len;               // read: size of the buffer, list: number of entries
+    uint32_t archive_len;       // lengths of the paths that follow, without their null
+    uint32_t path_len;
+};
+
+struct serve_reply {
+    int64_t ret;                // what the function answered by the server returns
+    uint64_t offset;            // read of a plain file: offset of the bytes in the archive
+    uint64_t len;               // read: number of bytes, list: number of entries
+    uint64_t payload_len;       // bytes following the reply
+};
+
+/* An archive of a server */
+struct served_archive {
+    char *path;
+    int fd;
+    tar_archive_t *ar;
+};
 
-    int n=512;
-    int nb=0;
+struct tar_server {
+    int listen_fd;
+    char *socket_path;
+    struct served_archive *archives;
+    size_t no_archives;
+    // Connections being served, shut down when the server stops
+    int *conns;
+    size_t no_conns;
+    size_t cap_conns;
+    size_t max_conns;
+    int stopping;
+    int stopped;                // set by tar_server_stop(), atomically as it may run in a signal handler
+    pthread_mutex_t lock;       // guards the connections
+    pthread_cond_t idle;        // signalled when the last connection ends
+    pthread_cond_t room;        // signalled when a connection ends
+};
 
-    while((read(tar_fd, header,HEADER_SIZE)) > 0){
-        int c_chksum = 0;
-        int nbr_blocs=0;
+/* A connection and the server it belongs to, passed to its thread */
+struct serve_conn {
+    tar_server_t *server;
+    int fd;
+};
 
-        int i=0;
-        while (i<HEADER_SIZE){
-            char* c = (char*) header+i;
-            //checksum
-            if(i<148 || i>155){ 
-                c_chksum += *c;
-            }
-            else{
-                c_chksum += ' ';
-            }
-            i++;
+struct tar_client {
+    int fd;
+    pthread_mutex_t lock;       // serializes the requests on the connection
+    // fds of the archives received from the server, by archive path
+    char **archives;
+    int *fds;
+    size_t no_archives;
+};
+
+/* Reads exactly len bytes of a socket, returns -1 if it closed or failed first */
+static int recv_all(int fd, void *dest, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, dest, len, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
         }
-        if(c_chksum==256){
-            break;
+        if (n <= 0) {
+            return -1;
         }
+        dest = (uint8_t *) dest + n;
+        len -= n;
+    }
+    return 0;
+}
 
-        if(strcmp(header->magic,TMAGIC)!=0){
-            free(header);
+/* Writes a whole buffer to a socket, without raising SIGPIPE if the peer went away */
+static int send_all(int fd, const void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
             return -1;
         }
-        if(TAR_INT(header->version) != TAR_INT(TVERSION)){
-            free(header);
-            return -2;
+        buf = (const uint8_t *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Sends a reply and its payload, with the fd attached to it unless attach_fd is -1 */
+static int send_reply(int fd, const struct serve_reply *reply, const void *payload, int attach_fd) {
+    struct iovec iov = { (void *) reply, sizeof(*reply) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (attach_fd != -1) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &attach_fd, sizeof(int));
+    }
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    // The fd went with the first byte, the rest of a short send follows as plain data
+    if (n <= 0 || send_all(fd, (const uint8_t *) reply + n, sizeof(*reply) - n) == -1) {
+        return -1;
+    }
+    return send_all(fd, payload, reply->payload_len);
+}
+
+/* Receives a reply, setting received_fd to the fd attached to it or to -1 */
+static int recv_reply(int fd, struct serve_reply *reply, int *received_fd) {
+    struct iovec iov = { reply, sizeof(*reply) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf) };
+    ssize_t n;
+    while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+    }
+    *received_fd = -1;
+    for (struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(received_fd, CMSG_DATA(cmsg), sizeof(int));
         }
-        if(TAR_INT(header->chksum)!= c_chksum){
-            free(header);
-            return -3;
+    }
+    if (n <= 0 || recv_all(fd, (uint8_t *) reply + n, sizeof(*reply) - n) == -1) {
+        if (*received_fd != -1) {
+            close(*received_fd);
+            *received_fd = -1;
         }
-        nb++;
-        // Calcul du nombre de bloc à passer si size n'est pas égale à 0 et que du coup, il y a des blocs de data
-        if (*(header->size)!=0)
-        {
-            int siz = TAR_INT(header->size);
-            float number_blocs= siz/512.00;
-            if(number_blocs != (int) number_blocs){
-                nbr_blocs=(int) number_blocs +1;
-            } else {
-                nbr_blocs=(int) number_blocs;
-            }
-            
-            n=512*nbr_blocs;
+        return -1;
+    }
+    return 0;
+}
+
+/* Grows a buffer to hold at least len bytes */
+static int reserve(uint8_t **buf, size_t *cap, size_t len) {
+    if (len <= *cap) {
+        return 0;
+    }
+    size_t new_cap = *cap > 0 ? *cap : 4096;
+    while (new_cap < len) {
+        new_cap *= 2;
+    }
+    uint8_t *grown = realloc(*buf, new_cap);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buf = grown;
+    *cap = new_cap;
+    return 0;
+}
 
-            position=lseek(tar_fd, n, SEEK_CUR);
-            if(position==-1){
-                printf("position failed\n");
+/* Lists up to max entries of a directory into the payload of a reply, the names separated by nulls */
+static int serve_list(const tar_archive_t *ar, const char *path, uint64_t max, char **names, struct serve_reply *reply,
+                      uint8_t **payload, size_t *cap) {
+    tar_list_cursor_t cursor = {0};
+    reply->ret = 1;
+    while (reply->len < max && !cursor.done) {
+        size_t no_names = max - reply->len < SERVE_LIST_PAGE ? max - reply->len : SERVE_LIST_PAGE;
+        if (tar_list_ex(ar, path, 0, &cursor, names, &no_names) == 0) {
+            reply->ret = 0;
+            return 0;
+        }
+        for (size_t i = 0; i < no_names; i++) {
+            size_t len = strlen(names[i]) + 1;
+            if (reserve(payload, cap, reply->payload_len + len) == -1) {
                 return -1;
             }
+            memcpy(*payload + reply->payload_len, names[i], len);
+            reply->payload_len += len;
         }
+        reply->len += no_names;
     }
+    return 0;
+}
 
-    free(header);
-    return nb;
+/* Answers a read, with the range of the archive holding the bytes or with the bytes themselves in the payload */
+static int serve_read(const tar_archive_t *ar, const char *path, const struct serve_request *req,
+                      struct serve_reply *reply, uint8_t **payload, size_t *cap, int *attach_fd) {
+    const tar_entry_t *entry = lookup_file(ar, path);
+    if (entry == NULL) {
+        reply->ret = -1;
+        return 0;
+    }
+    size_t len = req->len;
+    off_t start;
+    reply->ret = file_span(entry, req->offset, &len, &start);
+    if (reply->ret < 0) {
+        return 0;
+    }
+    if (ar->gz == NULL && ar->nodes[entry - ar->entries].sparse == NULL) {
+        reply->offset = start;
+        reply->len = len;
+        *attach_fd = req->flags & SERVE_WANT_FD ? ar->fd : -1;
+        return 0;
+    }
+    if (len > SERVE_MAX_PAYLOAD) {
+        len = SERVE_MAX_PAYLOAD;
+        reply->ret = entry->size - req->offset - len;
+    }
+    if (reserve(payload, cap, len) == -1 || read_entry(ar, entry, req->offset, *payload, len) == -1) {
+        reply->ret = -1;
+        return 0;
+    }
+    reply->len = len;
+    reply->payload_len = len;
+    return 0;
 }
 
-/**
- * Checks whether an entry exists in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive,
- *         any other value otherwise.
- */
-int exists(int tar_fd, char *path) {
-    off_t position=lseek(tar_fd, 0, SEEK_SET);
-    if(position==-1){
-        printf("position failed\n");
-        return -1;
-    }
-    header = malloc(sizeof(tar_header_t));
-    int n=512;
-    // Lecture de tout les blocs du fichier TAR
-    while((read(tar_fd, header,HEADER_SIZE)) > 0){
-        int nbr_blocs=0;
-
-        // Calcul du nombre de bloc à passer si size n'est pas égale à 0 et que du coup, il y a des blocs de data
-        if (*(header->size)!=0)
-        {
-            int siz = TAR_INT(header->size);
-            float number_blocs= siz/512.00;
-            if(number_blocs != (int) number_blocs){
-                nbr_blocs=(int) number_blocs +1;
-            } else {
-                nbr_blocs=(int) number_blocs;
-            }
-            
-            n=512*nbr_blocs;
+/* Serves the requests of a connection until the client closes it */
+static void *serve_connection(void *arg) {
+    struct serve_conn *conn = arg;
+    tar_server_t *server = conn->server;
+    char *archive = malloc(2 * (TAR_PATH_MAX + 1));
+    char *names_buf = malloc(SERVE_LIST_PAGE * TAR_PATH_MAX);
+    char *names[SERVE_LIST_PAGE];
+    uint8_t *payload = NULL;
+    size_t cap = 0;
+    struct serve_request req;
+    for (size_t i = 0; i < SERVE_LIST_PAGE; i++) {
+        names[i] = names_buf + i * TAR_PATH_MAX;
+    }
 
-            position=lseek(tar_fd, n, SEEK_CUR);
-            if(position==-1){
-                printf("position failed\n");
-                return -1;
+    while (archive != NULL && names_buf != NULL && recv_all(conn->fd, &req, sizeof(req)) == 0) {
+        if (req.archive_len > TAR_PATH_MAX || req.path_len > TAR_PATH_MAX) {
+            break;
+        }
+        char *path = archive + req.archive_len + 1;
+        if (recv_all(conn->fd, archive, req.archive_len) == -1 || recv_all(conn->fd, path, req.path_len) == -1) {
+            break;
+        }
+        archive[req.archive_len] = '\0';
+        path[req.path_len] = '\0';
+
+        const tar_archive_t *ar = NULL;
+        for (size_t i = 0; i < server->no_archives && ar == NULL; i++) {
+            if (strcmp(server->archives[i].path, archive) == 0) {
+                ar = server->archives[i].ar;
             }
         }
-        
-        //Comparaison entre notre nom de fichier et le nom qu'on cherche
-        if(strcmp(header->name,path)==0){
-            free(header);
-            return *path;
+        struct serve_reply reply = { -3, 0, 0, 0 };
+        int attach_fd = -1;
+        int ret = 0;
+        if (ar != NULL && req.op == SERVE_EXISTS) {
+            reply.ret = tar_exists(ar, path);
+        } else if (ar != NULL && req.op == SERVE_LIST) {
+            ret = serve_list(ar, path, req.len, names, &reply, &payload, &cap);
+        } else if (ar != NULL && req.op == SERVE_READ) {
+            ret = serve_read(ar, path, &req, &reply, &payload, &cap, &attach_fd);
+        }
+        if (ret == -1) {
+            reply = (struct serve_reply) { -3, 0, 0, 0 };
         }
+        if (send_reply(conn->fd, &reply, payload, attach_fd) == -1) {
+            break;
+        }
+    }
+    free(archive);
+    free(names_buf);
+    free(payload);
+
+    pthread_mutex_lock(&server->lock);
+    for (size_t i = 0; i < server->no_conns; i++) {
+        if (server->conns[i] == conn->fd) {
+            server->conns[i] = server->conns[--server->no_conns];
+            break;
+        }
+    }
+    close(conn->fd);
+    pthread_cond_signal(&server->room);
+    if (server->no_conns == 0) {
+        pthread_cond_signal(&server->idle);
+    }
+    pthread_mutex_unlock(&server->lock);
+    free(conn);
+    return NULL;
+}
+
+/* Opens and indexes an archive of a server, compressed or not, leaving no fd open on failure */
+static int open_served(struct served_archive *served) {
+    served->fd = open(served->path, O_RDONLY | O_CLOEXEC);
+    if (served->fd == -1) {
+        return -1;
+    }
+    // A file too short for the gzip magic is no archive either
+    uint8_t magic[2];
+    if (pread(served->fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic)) {
+        served->ar = magic[0] == 0x1f && magic[1] == 0x8b ? tar_open_gz(served->fd, NULL, 0) : tar_open(served->fd);
+    }
+    if (served->ar == NULL) {
+        close(served->fd);
+        served->fd = -1;
+        return -1;
     }
-    
-    free(header);
     return 0;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a directory.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
- *         any other value otherwise.
+ * Indexes archives and listens for the clients of a Unix socket.
  */
-int is_dir(int tar_fd, char *path) {
-    off_t position=lseek(tar_fd, 0, SEEK_SET);
-    if(position==-1){
-        printf("position failed\n");
-        return -1;
-    }
-    header = malloc(sizeof(tar_header_t));
-    int n=512;
-    // Lecture de tout les blocs du fichier TAR
-    while((read(tar_fd, header,HEADER_SIZE)) > 0){
-        int nbr_blocs=0;
-
-        // Calcul du nombre de bloc à passer si size n'est pas égale à 0 et que du coup, il y a des blocs de data
-        if (*(header->size)!=0)
-        {
-            int siz = TAR_INT(header->size);
-            float number_blocs= siz/512.00;
-            if(number_blocs != (int) number_blocs){
-                nbr_blocs=(int) number_blocs +1;
-            } else {
-                nbr_blocs=(int) number_blocs;
-            }
-            
-            n=512*nbr_blocs;
-
-            position=lseek(tar_fd, n, SEEK_CUR);
-            if(position==-1){
-                printf("position failed\n");
-                return -1;
-            }
+tar_server_t *tar_server_open(const char *socket_path, const char *const *paths, size_t no_paths) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return NULL;
+    }
+    strcpy(addr.sun_path, socket_path);
+    tar_server_t *server = calloc(1, sizeof(tar_server_t));
+    if (server == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->idle, NULL);
+    pthread_cond_init(&server->room, NULL);
+    server->listen_fd = -1;
+    server->max_conns = SERVE_MAX_CONNS;
+    server->archives = calloc(no_paths + 1, sizeof(struct served_archive));
+    if (server->archives == NULL) {
+        tar_server_close(server);
+        return NULL;
+    }
+    for (size_t i = 0; i < no_paths; i++) {
+        struct served_archive *served = &server->archives[i];
+        served->fd = -1;
+        served->path = strdup(paths[i]);
+        server->no_archives++;
+        if (served->path == NULL || open_served(served) == -1) {
+            tar_server_close(server);
+            return NULL;
         }
+    }
 
-        //Comparaison entre notre nom de fichier et le nom qu'on cherche
-        if(strcmp(header->name,path)==0 && header->typeflag==DIRTYPE){
-            free(header);
-            return *path;
-        }
+    // A socket left behind by a server that did not close is replaced
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);
     }
-    
-    free(header);
-    return 0;
-    
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->listen_fd == -1 || bind(server->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        tar_server_close(server);
+        return NULL;
+    }
+    server->socket_path = strdup(socket_path);
+    if (server->socket_path == NULL || listen(server->listen_fd, SOMAXCONN) == -1) {
+        unlink(socket_path);
+        tar_server_close(server);
+        return NULL;
+    }
+    return server;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a file.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
- *         any other value otherwise.
+ * Serves the clients of a server until tar_server_stop() is called.
  */
-int is_file(int tar_fd, char *path) {  
-    off_t position=lseek(tar_fd, 0, SEEK_SET);
-    if(position==-1){
-        printf("position failed\n");
-        return -1;
-    }
-    header = malloc(sizeof(tar_header_t));
-    int n=512;
-    // Lecture de tout les blocs du fichier TAR
-    while((read(tar_fd, header,HEADER_SIZE)) > 0){
-        int nbr_blocs=0;
-
-        // Calcul du nombre de bloc à passer si size n'est pas égale à 0 et que du coup, il y a des blocs de data
-        if (*(header->size)!=0)
-        {
-            int siz = TAR_INT(header->size);
-            float number_blocs= siz/512.00;
-            if(number_blocs != (int) number_blocs){
-                nbr_blocs=(int) number_blocs +1;
-            } else {
-                nbr_blocs=(int) number_blocs;
-            }
-            
-            n=512*nbr_blocs;
+int tar_server_run(tar_server_t *server) {
+    int ret = 0;
+    for (;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1 && (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)) {
+            // The client gave up before it was accepted
+            continue;
+        }
+        if (fd == -1 && (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)) {
+            // Out of fds or memory for a while, the connections being served release some when they end
+            struct timespec pause = { 0, SERVE_BACKOFF_NS };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        if (fd == -1) {
+            // The listening socket is shut down by tar_server_stop()
+            ret = errno == EINVAL ? 0 : -1;
+            break;
+        }
 
-            position=lseek(tar_fd, n, SEEK_CUR);
-            if(position==-1){
-                printf("position failed\n");
-                return -1;
+        pthread_mutex_lock(&server->lock);
+        struct serve_conn *conn = malloc(sizeof(struct serve_conn));
+        if (conn != NULL && server->no_conns == server->cap_conns) {
+            size_t cap = server->cap_conns ? server->cap_conns * 2 : 16;
+            int *conns = realloc(server->conns, cap * sizeof(int));
+            if (conns != NULL) {
+                server->conns = conns;
+                server->cap_conns = cap;
+            }
+        }
+        pthread_t thread;
+        if (conn == NULL || server->no_conns == server->cap_conns) {
+            free(conn);
+            close(fd);
+        } else {
+            *conn = (struct serve_conn) { server, fd };
+            server->conns[server->no_conns++] = fd;
+            if (pthread_create(&thread, NULL, serve_connection, conn) == 0) {
+                pthread_detach(thread);
+            } else {
+                server->no_conns--;
+                free(conn);
+                close(fd);
             }
         }
-        
-        //Comparaison entre notre nom de fichier et le nom qu'on cherche
-        if(strcmp(header->name,path)==0 && (header->typeflag==REGTYPE || header->typeflag==AREGTYPE)){
-            free(header);
-            return 1;
+        // At the limit, new clients wait in the backlog of the socket until a connection ends. The wait is cut in
+        // pauses to see tar_server_stop(), which cannot signal the condition from a signal handler.
+        while (server->no_conns >= server->max_conns && !__atomic_load_n(&server->stopped, __ATOMIC_RELAXED)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += SERVE_BACKOFF_NS;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&server->room, &server->lock, &deadline);
         }
+        pthread_mutex_unlock(&server->lock);
     }
-    
-    free(header);
-    return 0;
+
+    // The connections still open are cut, and their threads waited for
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+    for (size_t i = 0; i < server->no_conns; i++) {
+        shutdown(server->conns[i], SHUT_RDWR);
+    }
+    while (server->no_conns > 0) {
+        pthread_cond_wait(&server->idle, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return ret;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a symlink.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
- *         any other value otherwise.
+ * Makes tar_server_run() return.
  */
-int is_symlink(int tar_fd, char *path) {
-    
-     off_t position=lseek(tar_fd, 0, SEEK_SET);
-    if(position==-1){
-        printf("position failed\n");
-        return -1;
-    }
-    header = malloc(sizeof(tar_header_t));
-    int n=512; 
-    // Lecture de tout les blocs du fichier TAR
-    while((read(tar_fd, header,HEADER_SIZE)) > 0){
-        int nbr_blocs=0;
-
-        // Calcul du nombre de bloc à passer si size n'est pas égale à 0 et que du coup, il y a des blocs de data
-        if (*(header->size)!=0)
-        {
-            int siz = TAR_INT(header->size);
-            float number_blocs= siz/512.00;
-            if(number_blocs != (int) number_blocs){
-                nbr_blocs=(int) number_blocs +1;
-            } else {
-                nbr_blocs=(int) number_blocs;
-            }
-            
-            n=512*nbr_blocs;
-
-            position=lseek(tar_fd, n, SEEK_CUR);
-            if(position==-1){
-                printf("position failed\n");
-                return -1;
-            }
-        }
-
-        //printf("SYMLINK:\n\tTypeflag: %d\nName:%s\n\n", header->typeflag, header->name);
+void tar_server_stop(tar_server_t *server) {
+    __atomic_store_n(&server->stopped, 1, __ATOMIC_RELAXED);
+    shutdown(server->listen_fd, SHUT_RDWR);
+}
 
-        //Comparaison entre notre nom de fichier et le nom qu'on cherche
-        if(strcmp(header->name,path)==0){
-            if(header->typeflag==SYMTYPE || header->typeflag==LNKTYPE){
-                free(header);
-                return 1;
-            }
-        }
+/**
+ * Sets the number of connections a server serves at once.
+ */
+int tar_server_set_max_conns(tar_server_t *server, size_t max_conns) {
+    if (max_conns == 0) {
+        return -1;
     }
-    
-    free(header);
+    pthread_mutex_lock(&server->lock);
+    server->max_conns = max_conns;
+    pthread_mutex_unlock(&server->lock);
     return 0;
 }
 
-
 /**
- * Lists the entries at a given path in the archive.
- * list() does not recurse into the directories listed at the given path.
- *
- * Example:
- *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
- *   ├── a
- *   ├── b
- *   ├── c/
- *   │   └── d
- *   └── e/
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
- * @param no_entries An in-out argument.
- *                   The caller set it to the number of entries in `entries`.
- *                   The callee set it to the number of entries listed.
- *
- * @return zero if no directory at the given path exists in the archive,
- *         any other value otherwise.
+ * Closes a server, removing its socket.
  */
-int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
-
-    int index = 0;
-    char *slash = "/\0";
-    if(tar_fd<0){
-        *no_entries = index;
-        return 0;
+void tar_server_close(tar_server_t *server) {
+    if (server == NULL) {
+        return;
     }
-
-    if(path==NULL){
-        printf("path is wrong\n");
-        *no_entries = index;
-        return 0;
+    if (server->socket_path != NULL) {
+        unlink(server->socket_path);
+        free(server->socket_path);
     }
-
-    if(*entries==NULL){
-        printf("entries is wrong\n");
-        *no_entries = index;
-        return 0;
+    if (server->listen_fd != -1) {
+        close(server->listen_fd);
+    }
+    for (size_t i = 0; i < server->no_archives; i++) {
+        tar_close(server->archives[i].ar);
+        if (server->archives[i].fd != -1) {
+            close(server->archives[i].fd);
+        }
+        free(server->archives[i].path);
     }
-    printf("%ld\n", *no_entries);
+    free(server->archives);
+    free(server->conns);
+    pthread_cond_destroy(&server->room);
+    pthread_cond_destroy(&server->idle);
+    pthread_mutex_destroy(&server->lock);
+    free(server);
+}
 
-    if(no_entries==NULL && *no_entries>0){
-        printf("no_entries is wrong\n");
-        *no_entries = index;
-        return 0;
+/**
+ * Connects to a server.
+ */
+tar_client_t *tar_client_open(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return NULL;
+    }
+    strcpy(addr.sun_path, socket_path);
+    tar_client_t *client = calloc(1, sizeof(tar_client_t));
+    if (client == NULL) {
+        return NULL;
+    }
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd == -1 || connect(client->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        if (client->fd != -1) {
+            close(client->fd);
+        }
+        free(client);
+        return NULL;
     }
+    pthread_mutex_init(&client->lock, NULL);
+    return client;
+}
 
-    if(check_archive(tar_fd)<0){
-        printf("check_archive is wrong\n");
-        *no_entries = index;
-        return 0;
+/**
+ * Closes the connection of a client and the fds of archives it received.
+ */
+void tar_client_close(tar_client_t *client) {
+    if (client == NULL) {
+        return;
     }
+    close(client->fd);
+    for (size_t i = 0; i < client->no_archives; i++) {
+        close(client->fds[i]);
+        free(client->archives[i]);
+    }
+    free(client->archives);
+    free(client->fds);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+}
 
-    int sym = is_symlink(tar_fd,path);
-
-    header = malloc(sizeof(tar_header_t));
-    printf("linkname: %s\n", header->linkname);
-    
-    // Si c'est un lien symbolic, remplacer le chemin par celui du linkname
-    if(sym!=0){
-        lseek(tar_fd, sym*HEADER_SIZE, SEEK_SET);
-        read(tar_fd,header,HEADER_SIZE);
-        printf("IN SYMLINK\n\nLinkname: %s\n",header->linkname);
-        path = header->linkname;
-        strcat(path,slash);
-        printf("oui %s\n",path);
-    } else if (is_dir(tar_fd,path)==0) {
-        printf("dir is wrong\n");
-        *no_entries = index;
-        return 0;
+/*
+ * Sends a request and receives the header of its reply, the caller holding the lock of the client. Returns -2
+ * without sending anything if a path is too long for the server, and -1 if the connection failed.
+ */
+static int client_call(tar_client_t *client, struct serve_request *req, const char *archive, const char *path,
+                       struct serve_reply *reply, int *received_fd) {
+    req->archive_len = strlen(archive);
+    req->path_len = strlen(path);
+    if (req->archive_len > TAR_PATH_MAX || req->path_len > TAR_PATH_MAX) {
+        return -2;
     }
-    lseek(tar_fd, 0, SEEK_SET);
-
-    int n=HEADER_SIZE;
-    int size;
-
-    //Iteration à travers tous les fichiers de l'archive
-    while(read(tar_fd,header, HEADER_SIZE)>0){
-
-        // Taille de chacun des headers
-        size=TAR_INT(header->size);
-        int nbr_blocs=0;
-        char *copy_name=malloc(sizeof(char)*(strlen(header->name)+1));
-        strcpy(copy_name,header->name);
-        char delims[]="/";
-        char* word=strtok(copy_name, delims);
-        //printf("Name:\n\tBase: %s\n\tConcat: %s\n\tPath wanted: %s\n\n", header->name, word, path);
-
-        // Prendre seulement les fichiers avec un nom plus grand que 0 dans l'archive
-        //(Ne prendre que les fichiers avec un nom)
-        if(strlen(header->name)>0){
-            if(strcmp(strcat(word, "/"),path)==0){
-                int testing =0;
-                strcpy(copy_name,header->name);
-                word=strtok(copy_name, delims);
-                //printf("1ERE: entries from loop: %s\n", word);
-                word=strtok(NULL, delims);
-                //printf("Name: %s\nword: %s \n\n\n", header->name, word);
-                if(!word){
-                    //printf("AM IN \n");
-                    testing=1;
-                }
-                //printf("2EME entries from loop: %s\n\n", word);
-                for(int i=0; i<sizeof(entries); i++){
-                    char * copy_entry=malloc(sizeof(entries[i]));
-                    strcpy(copy_entry,entries[i]);
-                    char * strToken=strtok(copy_entry, delims);
-                    strToken=strtok(NULL, delims);
-                    if(word && strToken){
-                        if (strcmp(strToken, word)==0)
-                        {
-                            testing=1;
-                            //printf("entries: %s\n", entries[i]);
-                        }
-                    }
-                    
-                }
-                if(testing==0){
-                    //printf("HEADER NAME: %s\n\n\n", header->name);
-                    // Retourner la liste des fichiers dans l'argument entries (pour y acceder en dehors ex: dans tests.c)
-                    strcpy(entries[index],header->name);
-                    // Iterer l'index en fonction du nombre de fichier dans le dossier
-                    index++;
-                }
-            }
-        }
+    if (send_all(client->fd, req, sizeof(*req)) == -1 || send_all(client->fd, archive, req->archive_len) == -1
+        || send_all(client->fd, path, req->path_len) == -1) {
+        return -1;
+    }
+    return recv_reply(client->fd, reply, received_fd);
+}
 
-        // Calcul du nombre de bloc à passer si size n'est pas égale à 0 et que du coup, il y a des blocs de data
-        if (*(header->size)!=0){
-            float number_blocs= size/512.00;
-            if(number_blocs != (int) number_blocs){
-                nbr_blocs=(int) number_blocs +1;
-            } else {
-                nbr_blocs=(int) number_blocs;
-            }
-            
-            n=512*nbr_blocs;
+/*
+ * Cuts the connection of a client after a send or a receive failed, the reply being maybe partly unread, so that
+ * later calls fail. A call that failed with -2 left the connection in step and keeps it.
+ */
+static void client_check(tar_client_t *client, int ret) {
+    if (ret == -1) {
+        shutdown(client->fd, SHUT_RDWR);
+    }
+}
 
-            lseek(tar_fd, n, SEEK_CUR);
+/* Returns the fd of an archive received from the server, or -1 if none was */
+static int client_archive_fd(const tar_client_t *client, const char *archive) {
+    for (size_t i = 0; i < client->no_archives; i++) {
+        if (strcmp(client->archives[i], archive) == 0) {
+            return client->fds[i];
         }
     }
-    // Mettre le nombre de fichier dans l'argument pour y acceder en dehors
-    *no_entries=index;
-    lseek(tar_fd,0,SEEK_SET);
+    return -1;
+}
 
-    free(header);
-    // Retourne le nombre de fichier listé
-    return *no_entries;
+/* Keeps an fd received for an archive, returns -1 if memory ran out */
+static int client_keep_fd(tar_client_t *client, const char *archive, int fd) {
+    size_t n = client->no_archives + 1;
+    char **archives = realloc(client->archives, n * sizeof(char *));
+    if (archives != NULL) {
+        client->archives = archives;
+    }
+    int *fds = realloc(client->fds, n * sizeof(int));
+    if (fds != NULL) {
+        client->fds = fds;
+    }
+    char *copy = strdup(archive);
+    if (archives == NULL || fds == NULL || copy == NULL) {
+        free(copy);
+        return -1;
+    }
+    client->archives[client->no_archives] = copy;
+    client->fds[client->no_archives++] = fd;
+    return 0;
 }
 
 /**
- * Reads a file at a given path in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
- * @param dest A destination buffer to read the given file into.
- * @param len An in-out argument.
- *            The caller set it to the size of dest.
- *            The callee set it to the number of bytes written to dest.
- *
- * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
- *         -2 if the offset is outside the file total length,
- *         zero if the file was read in its entirety into the destination buffer,
- *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
- *         the end of the file.
- *
+ * Checks whether an entry exists in an archive of a server.
  */
-ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
-    printf("1ER ESSAI: offset: %ld\nlength: %ld\n",offset, *len);
+int tar_client_exists(tar_client_t *client, const char *archive, const char *path) {
+    struct serve_request req = { SERVE_EXISTS, 0, 0, 0, 0, 0 };
+    struct serve_reply reply;
+    int received_fd;
+    pthread_mutex_lock(&client->lock);
+    int ret = client_call(client, &req, archive, path, &reply, &received_fd);
+    client_check(client, ret);
+    pthread_mutex_unlock(&client->lock);
+    return ret != 0 || reply.ret < 0 ? -1 : (int) reply.ret;
+}
 
-    if(is_file(tar_fd, path)==0){
-        return -1;
+/**
+ * Lists the entries at a given path of an archive of a server.
+ */
+int tar_client_list(tar_client_t *client, const char *archive, const char *path, char **entries, size_t *no_entries) {
+    struct serve_request req = { SERVE_LIST, 0, 0, *no_entries, 0, 0 };
+    struct serve_reply reply;
+    int received_fd;
+    *no_entries = 0;
+    pthread_mutex_lock(&client->lock);
+    int ret = client_call(client, &req, archive, path, &reply, &received_fd);
+    char *names = NULL;
+    if (ret == 0 && reply.payload_len > 0) {
+        names = reply.payload_len <= req.len * TAR_PATH_MAX ? malloc(reply.payload_len) : NULL;
+        ret = names != NULL ? recv_all(client->fd, names, reply.payload_len) : -1;
     }
-    
-    lseek(tar_fd, 0, SEEK_SET);
-   
-    header = malloc(sizeof(tar_header_t));
-
-    int size;
-    int n=512;
-
-    // Lecture de tout les blocs du fichier TAR
-    while((read(tar_fd, header,HEADER_SIZE)) > 0){
-        int nbr_blocs=0;
-
-        if(strcmp(header->name,path)==0 ) {
-            printf("Path: %s\nName: %s\nSize of the file: %d\n\n", path, header->name, (int) TAR_INT(header->size));
+    client_check(client, ret);
+    pthread_mutex_unlock(&client->lock);
+    // The names are separated by nulls, the server listing no more than asked
+    for (uint64_t pos = 0; ret == 0 && pos < reply.payload_len && *no_entries < req.len; (*no_entries)++) {
+        size_t len = strnlen(names + pos, reply.payload_len - pos);
+        if (len >= TAR_PATH_MAX || pos + len == reply.payload_len) {
+            ret = -1;
             break;
         }
-        // Calcul du nombre de bloc à passer si size n'est pas égale à 0 et que du coup, il y a des blocs de data
-        if (*(header->size)!=0)
-        {
-            size = TAR_INT(header->size);
-            float number_blocs= size/512.00;
-            if(number_blocs != (int) number_blocs){
-                nbr_blocs=(int) number_blocs +1;
-            } else {
-                nbr_blocs=(int) number_blocs;
-            }
-            
-            n=512*nbr_blocs;
+        memcpy(entries[*no_entries], names + pos, len + 1);
+        pos += len + 1;
+    }
+    free(names);
+    return ret != 0 || reply.ret < 0 ? -1 : (int) reply.ret;
+}
 
-            lseek(tar_fd, n, SEEK_CUR);
+/**
+ * Reads a file of an archive of a server.
+ */
+ssize_t tar_client_read_file(tar_client_t *client, const char *archive, const char *path, size_t offset,
+                             uint8_t *dest, size_t *len) {
+    pthread_mutex_lock(&client->lock);
+    int fd = client_archive_fd(client, archive);
+    struct serve_request req = { SERVE_READ, fd == -1 ? SERVE_WANT_FD : 0, offset, *len, 0, 0 };
+    struct serve_reply reply;
+    int received_fd;
+    int ret = client_call(client, &req, archive, path, &reply, &received_fd);
+    if (ret == 0 && received_fd != -1) {
+        if (client_keep_fd(client, archive, received_fd) == -1) {
+            // The reply carries no payload along with an fd, the connection stays in step
+            close(received_fd);
+            ret = -2;
         }
+        fd = received_fd;
     }
-
-    size = TAR_INT(header->size);
-    if(size<=offset) return -2;
-    lseek(tar_fd,offset,SEEK_CUR);
-
-    printf("finished the loop.\nName: %s\nSize of the file: %d\n\n", header->name, size);
-    printf("2 EME ESSAI: offset: %ld\nlength: %ld\n",offset, *len);
-    int last = size - offset;
-    int ret = last-*len;
-    if(*len>last) {
-        *len = last;
-        ret = 0;
+    if (ret == 0 && reply.payload_len > 0) {
+        ret = reply.payload_len <= *len ? recv_all(client->fd, dest, reply.payload_len) : -1;
     }
-    printf("3 EME ESSAI: offset: %ld\nlength: %ld\n",offset, *len);
-
-    read(tar_fd, dest, *len);
-    printf("4 EME ESSAI: offset: %ld\nlength: %ld\n",offset, *len);
-    
-    free(header);
-    return ret;
-}
\ No newline at end of file
+    client_check(client, ret);
+    pthread_mutex_unlock(&client->lock);
+    if (ret != 0 || reply.ret == -3) {
+        *len = 0;
+        return -3;
+    }
+    if (reply.ret < 0) {
+        return reply.ret;
+    }
+    // The bytes of a plain file are read from the archive by the client
+    if (reply.payload_len == 0 && reply.len > 0 && (fd == -1 || pread_all(fd, dest, reply.len, reply.offset) == -1)) {
+        *len = 0;
+        return -3;
+    }
+    *len = reply.len;
+    return reply.ret;
+}
@@ -37,17 +37,172 @@ typedef struct posix_header
 #define LNKTYPE  '1'            /* link */
 #define SYMTYPE  '2'            /* reserved */
 #define DIRTYPE  '5'            /* directory */
+#define XHDTYPE  'x'            /* PAX extended header for the next member */
+#define XGLTYPE  'g'            /* PAX global extended header */
+#define GNUTYPE_LONGNAME 'L'    /* GNU long name of the next member */
+#define GNUTYPE_LONGLINK 'K'    /* GNU long link target of the next member */
+#define GNUTYPE_SPARSE   'S'    /* GNU sparse file, indexed as a regular file */
+
+/* Longest path or link target kept in fixed-size buffers */
+#define TAR_PATH_MAX 4096
 
 /* Converts an ASCII-encoded octal-based number into a regular integer */
 #define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
 
+/* Opaque handle on an archive whose headers have been indexed once by tar_open() */
+typedef struct tar_archive tar_archive_t;
+
+/* Result of a lookup by tar_lookup_batch() */
+typedef struct tar_stat
+{
+    int found;                    /* zero if the path is not in the archive, the fields below are then unset */
+    char typeflag;
+    uint64_t size;                /* size of the entry data in bytes */
+    off_t data_offset;            /* offset of the first data byte in the archive */
+    char linkname[TAR_PATH_MAX];  /* link target, empty if the entry is not a link */
+} tar_stat_t;
+
+/* Resumable position of a listing, see tar_list_ex() and tar_query() */
+typedef struct tar_list_cursor
+{
+    size_t next;                  /* internal, zero before the first call */
+    int done;                     /* set once every entry has been listed */
+} tar_list_cursor_t;
+
+/* Flags of tar_list_ex() */
+#define TAR_LIST_RECURSIVE 1      /* also list the content of the subdirectories */
+
+/* Flags of tar_query() */
+#define TAR_QUERY_PREFIX   1      /* the pattern is a literal prefix of the paths, not a glob */
+#define TAR_QUERY_PATHNAME 2      /* a wildcard of the glob does not match a slash */
+
+/* Groups of functions accounted separately by the statistics, see tar_stats_snapshot() */
+#define TAR_OP_CHECK  0           /* check_archive() */
+#define TAR_OP_OPEN   1           /* tar_open(), tar_catalog_open() */
+#define TAR_OP_LOOKUP 2           /* exists(), is_dir(), is_file(), is_symlink() and their tar_* variants */
+#define TAR_OP_LIST   3           /* list(), tar_list(), tar_list_ex(), tar_query(), tar_scan() */
+#define TAR_OP_READ   4           /* read_file(), tar_read_file(), tar_catalog_read_file(), tar_member_*read() */
+#define TAR_OP_SEND   5           /* tar_send_file(), tar_member_send() */
+#define TAR_OP_BATCH  6           /* tar_lookup_batch() */
+#define TAR_OP_WRITE  7           /* tar_writer_add(), tar_writer_close() */
+#define TAR_OP_EXTRACT 8          /* tar_extract() */
+#define TAR_OP_STREAM 9           /* tar_stream_next(), tar_stream_read() */
+#define TAR_OP_DIGEST 10          /* tar_digest() */
+#define TAR_NO_OPS    11
+
+/* Number of buckets of the latency histograms, bucket i counts the calls that took [2^i, 2^(i+1)) ns */
+#define TAR_HIST_BUCKETS 40
+
+/* Counters of a group of functions */
+typedef struct tar_op_stats
+{
+    uint64_t calls;
+    uint64_t headers;             /* header blocks parsed */
+    uint64_t reads;               /* read() calls */
+    uint64_t lseeks;              /* lseek() calls */
+    uint64_t preads;              /* pread() calls */
+    uint64_t ring_reads;          /* reads submitted to io_uring */
+    uint64_t bytes_read;          /* bytes read from the archive, by a system call or out of the mapping */
+    uint64_t bytes_skipped;       /* member data jumped over by walks of the headers */
+    uint64_t latency[TAR_HIST_BUCKETS];
+} tar_op_stats_t;
+
+typedef struct tar_stats
+{
+    tar_op_stats_t ops[TAR_NO_OPS];   /* indexed by TAR_OP_* */
+} tar_stats_t;
+
+/* I/O engines, see tar_set_io_engine() */
+#define TAR_IO_DEFAULT 0          /* the archive is mapped in memory, or read by pread() when it cannot be */
+#define TAR_IO_URING   1          /* io_uring, with many reads in flight */
+
+/* Counters of the block cache, see tar_cache_enable() */
+typedef struct tar_cache_stats
+{
+    uint64_t hits;                /* blocks copied out of the cache */
+    uint64_t misses;              /* blocks read from an archive */
+    uint64_t evictions;           /* blocks dropped to make room for others */
+    size_t bytes_cached;
+    size_t budget;
+} tar_cache_stats_t;
+
+/* Kernels summing the header blocks, see tar_set_check_kernel() */
+#define TAR_CHECK_DEFAULT 0       /* the widest vector unit of the CPU, AVX2 or SSE2 on x86-64 */
+#define TAR_CHECK_SCALAR  1       /* a portable loop over the bytes, the default on other architectures */
+
+/* Digests of tar_digest() */
+#define TAR_DIGEST_CRC32C 1       /* CRC-32C, with the crc32 instruction of SSE4.2 when the CPU has it */
+#define TAR_DIGEST_SHA256 2       /* SHA-256 */
+
+/* A read of tar_read_batch() */
+typedef struct tar_read_req
+{
+    const char *path;             /* path of a file in the archive */
+    size_t offset;                /* offset in the file of the first byte to read */
+    uint8_t *dest;
+    size_t len;                   /* in: size of dest, out: number of bytes read */
+    ssize_t ret;                  /* set to what tar_read_file() would return */
+} tar_read_req_t;
+
+/* Archive read forward only, see tar_stream_open() */
+typedef struct tar_stream tar_stream_t;
+
+/* Archive being written, see tar_writer_open() */
+typedef struct tar_writer tar_writer_t;
+
+/* Many archives indexed as one, see tar_catalog_open() */
+typedef struct tar_catalog tar_catalog_t;
+
+/* Archives served over a Unix socket, see tar_server_open() */
+typedef struct tar_server tar_server_t;
+
+/* Connection to a server, see tar_client_open() */
+typedef struct tar_client tar_client_t;
+
+/* Cursor on a file of an indexed archive, see tar_open_member() */
+typedef struct tar_member tar_member_t;
+
+/* A member of an indexed archive, as returned by tar_lookup() */
+typedef struct tar_entry
+{
+    const char *name;             /* path of the entry in the archive */
+    const char *linkname;         /* link target, empty if the entry is not a link */
+    off_t offset;                 /* offset of the entry header in the archive, -1 for a directory that has no header
+                                     of its own but is implied by the paths of its children */
+    uint64_t size;                /* size of the entry data in bytes */
+    char typeflag;                /* one of the *TYPE values above */
+    uint32_t mode;                /* permission bits */
+    uint32_t uid;                 /* owner, zero for implied directories */
+    uint32_t gid;
+    int64_t mtime;                /* modification time in seconds since the epoch, zero for implied directories */
+} tar_entry_t;
+
+/* Types of entries selected by a tar_filter_t */
+#define TAR_TYPE_FILE     1       /* regular files, sparse ones included */
+#define TAR_TYPE_DIR      2
+#define TAR_TYPE_SYMLINK  4
+#define TAR_TYPE_HARDLINK 8
+#define TAR_TYPE_OTHER    16      /* devices, fifos and any other type */
+
+/* Predicates of tar_scan(), a zero-initialized filter selects every entry */
+typedef struct tar_filter
+{
+    const char *prefix;           /* NULL, or a literal prefix of the paths to scan */
+    int types;                    /* mask of TAR_TYPE_* values, zero for every type */
+    uint64_t min_size;            /* bounds are inclusive, a bound of zero is no bound */
+    uint64_t max_size;
+    int64_t min_mtime;
+    int64_t max_mtime;
+} tar_filter_t;
+
 /**
  * Checks whether the archive is valid.
  *
  * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
+ *  - a magic value of "ustar" and a null and a version value of "00" and no null, or the magic and version
+ *    "ustar  " and a null of the GNU format,
  *  - a correct checksum
+ * The extension blocks of the old GNU sparse headers are skipped along with the data of their member.
  *
  * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
  *
@@ -139,7 +294,7 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  *            The callee set it to the number of bytes written to dest.
  *
  * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
- *         -2 if the offset is outside the file total length,
+ *         -2 if the offset is not below the file total length, an empty file having no valid offset,
  *         zero if the file was read in its entirety into the destination buffer,
  *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
  *         the end of the file.
@@ -147,4 +302,660 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * Indexes an archive.
+ *
+ * The headers of the archive are walked once and every entry is stored in a hash table keyed by its path,
+ * so that the tar_* queries below answer without touching the archive again.
+ *
+ * GNU sparse files, old style or in PAX format 0.1 or 1.0, are indexed as regular files of their real size along
+ * with the map of their data runs. Reads return zeros for their holes without any I/O.
+ *
+ * The tar_* functions only read the handle and use positional I/O, they never move the file offset of tar_fd.
+ * A handle can thus be queried by many threads at once. The fd-based functions above share a lock-protected
+ * index per fd and are safe to call concurrently as well. The indexes of the 8 fds used last are kept, each one
+ * until its fd is used for another file, the file is modified or tar_release_fds() is called.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file. It must stay open while the handle is used.
+ *
+ * @return a handle on the archive, or NULL if the archive could not be read, a header fails the checks of
+ *         check_archive() or memory could not be allocated.
+ */
+tar_archive_t *tar_open(int tar_fd);
+
+/**
+ * Indexes a gzip-compressed archive (.tar.gz) for random access.
+ *
+ * The compressed stream is inflated once to save a checkpoint every span bytes of uncompressed data, holding the
+ * state needed to resume inflating from there. Reads then only inflate from the checkpoint before them, and reads
+ * going forward carry on from where the previous one stopped. When index_path is given, the checkpoints and the
+ * entries are saved there, and later calls load them instead of inflating the archive again, as long as the
+ * compressed file keeps the same size and mtime.
+ *
+ * The handle is used with the tar_* functions like one returned by tar_open(), except for tar_map_file().
+ * Reads of a compressed archive are serialized between threads.
+ *
+ * @param gz_fd A file descriptor pointing to a .tar.gz file. It must stay open while the handle is used.
+ * @param index_path A file where the index is saved and loaded from on the next call, or NULL.
+ * @param span Distance between two checkpoints in the uncompressed stream, zero for 1 MiB. Each checkpoint takes
+ *             32 KiB of memory.
+ *
+ * @return a handle on the archive, or NULL if the archive could not be read, a header fails the checks of
+ *         check_archive() or memory could not be allocated.
+ */
+tar_archive_t *tar_open_gz(int gz_fd, const char *index_path, size_t span);
+
+/**
+ * Releases a handle returned by tar_open(). The file descriptor is not closed.
+ *
+ * @param ar A handle returned by tar_open(), or NULL.
+ */
+void tar_close(tar_archive_t *ar);
+
+/**
+ * Releases the indexes kept for the fd-based functions, see tar_open(). An index still used by another thread is
+ * released when that call returns. The next call on an fd indexes its archive again.
+ */
+void tar_release_fds(void);
+
+/**
+ * Looks up an entry of an indexed archive.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return the entry at the given path, owned by the handle, or NULL if no entry at the given path exists.
+ */
+const tar_entry_t *tar_lookup(const tar_archive_t *ar, const char *path);
+
+/**
+ * Looks up an entry of an indexed archive and follows it when it is a symlink or a hard link.
+ *
+ * Links are resolved once by tar_open(): their targets are canonicalized, symlinks being relative to their directory
+ * and absolute ones to the root of the archive, and chains of links are collapsed, so following one costs a lookup.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param path A path to an entry in the archive, a directory may be given without its trailing slash.
+ *
+ * @return the entry that is not a link the given path finally points to, owned by the handle, or NULL if no entry
+ *         at the given path exists, or the link dangles, goes out of the archive or is part of a cycle.
+ */
+const tar_entry_t *tar_resolve(const tar_archive_t *ar, const char *path);
+
+/**
+ * Same as exists(), is_dir(), is_file() and is_symlink(), answered from the index of the handle.
+ */
+int tar_exists(const tar_archive_t *ar, const char *path);
+int tar_is_dir(const tar_archive_t *ar, const char *path);
+int tar_is_file(const tar_archive_t *ar, const char *path);
+int tar_is_symlink(const tar_archive_t *ar, const char *path);
+
+/**
+ * Same as list() and read_file(), answered from the index of the handle.
+ * The data is copied out of the memory mapping of the archive when it could be mapped.
+ */
+int tar_list(const tar_archive_t *ar, const char *path, char **entries, size_t *no_entries);
+ssize_t tar_read_file(const tar_archive_t *ar, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Lists the entries at a given path of an indexed archive, possibly recursively and in several calls.
+ *
+ * The index keeps the children of each directory, so a listing costs the number of entries listed, not the size of
+ * the archive. Directories implied by the paths of their children are listed like the ones that have a header.
+ * A recursive listing walks the tree depth first, each directory being followed by its content.
+ *
+ * Example, listing a huge directory by pages of 100 entries:
+ *   tar_list_cursor_t cursor = {0};
+ *   do {
+ *       size_t no_entries = 100;
+ *       tar_list_ex(ar, "dir/", 0, &cursor, entries, &no_entries);
+ *   } while (!cursor.done);
+ *
+ * @param ar A handle returned by tar_open().
+ * @param path A path to a directory in the archive, the empty path being the root of the archive.
+ *             If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param flags Zero or TAR_LIST_RECURSIVE.
+ * @param cursor NULL to list from the start, or a zero-initialized cursor updated by each call to resume the
+ *               listing where the previous call stopped. The same path and flags must be given on every call.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_list_ex(const tar_archive_t *ar, const char *path, int flags, tar_list_cursor_t *cursor,
+                char **entries, size_t *no_entries);
+
+/**
+ * Finds the entries of an indexed archive whose path matches a glob, or starts with a prefix, in path order.
+ *
+ * The index keeps the paths sorted, so the entries under the literal head of the pattern, the part before its first
+ * wildcard, are found by binary search and only those are matched against the rest of the pattern. A query costs
+ * the number of entries under that head, not the size of the archive. Entries are matched on their name as stored,
+ * a directory ending with a slash. Links are not followed.
+ *
+ * Example, all the JSON files under data/2026/, at any depth, by pages of 100 entries:
+ *   tar_list_cursor_t cursor = {0};
+ *   do {
+ *       size_t no_entries = 100;
+ *       tar_query(ar, "data/2026/?*.json", 0, &cursor, entries, &no_entries);
+ *   } while (!cursor.done);
+ *
+ * @param ar A handle returned by tar_open().
+ * @param pattern A glob as understood by fnmatch(), or a prefix with TAR_QUERY_PREFIX.
+ * @param flags Zero or more of TAR_QUERY_PREFIX and TAR_QUERY_PATHNAME.
+ * @param cursor NULL to query from the start, or a zero-initialized cursor updated by each call to resume the
+ *               query where the previous call stopped. The same pattern and flags must be given on every call.
+ * @param entries An array of pointers set to the entries found, owned by the handle.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries found.
+ *
+ * @return zero on success, -1 if an argument is NULL.
+ */
+int tar_query(const tar_archive_t *ar, const char *pattern, int flags, tar_list_cursor_t *cursor,
+              const tar_entry_t **entries, size_t *no_entries);
+
+/**
+ * Finds the entries of an indexed archive that pass a filter, in path order.
+ *
+ * The records are the ones of the index, decoded once by tar_open(), so nothing is read or copied: the type, size
+ * and mtime of an entry are tested before its path is looked at, and the paths under the prefix of the filter are
+ * a range found by binary search. Only the last occurrence of a path archived twice is scanned. The data of a file
+ * starts HEADER_SIZE bytes after the offset of its entry.
+ *
+ * Example, all the regular files bigger than 1 GiB modified since a date, by pages of 100 entries:
+ *   tar_filter_t filter = { .types = TAR_TYPE_FILE, .min_size = (1ULL << 30) + 1, .min_mtime = since };
+ *   tar_list_cursor_t cursor = {0};
+ *   do {
+ *       size_t no_entries = 100;
+ *       tar_scan(ar, &filter, &cursor, entries, &no_entries);
+ *   } while (!cursor.done);
+ *
+ * @param ar A handle returned by tar_open().
+ * @param filter The predicates an entry must all pass, or NULL to scan every entry.
+ * @param cursor NULL to scan from the start, or a zero-initialized cursor updated by each call to resume the
+ *               scan where the previous call stopped. The same filter must be given on every call.
+ * @param entries An array of pointers set to the entries found, owned by the handle.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries found.
+ *
+ * @return zero on success, -1 if an argument is NULL.
+ */
+int tar_scan(const tar_archive_t *ar, const tar_filter_t *filter, tar_list_cursor_t *cursor,
+             const tar_entry_t **entries, size_t *no_entries);
+
+/**
+ * Reads parts of many files of an indexed archive at once.
+ *
+ * With the io_uring engine, the reads are all submitted before any completes, which keeps the device busy where
+ * reading the files one after the other would wait for each read in turn. Otherwise they are done one by one.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param reqs The reads, each one is done as by tar_read_file() and its ret field set to what it returns.
+ * @param no_reqs The number of reads.
+ *
+ * @return the number of reads that succeeded, or -1 if memory could not be allocated.
+ */
+int tar_read_batch(const tar_archive_t *ar, tar_read_req_t *reqs, size_t no_reqs);
+
+/**
+ * Gives direct access to the data of a file of an indexed archive, without copying it.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ * @param data Set to the start of the file data, which stays valid until tar_close() is called.
+ * @param size Set to the size of the file.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the archive could not be mapped in memory or the file is sparse, tar_read_file() must be used
+ *            instead.
+ */
+int tar_map_file(const tar_archive_t *ar, const char *path, const uint8_t **data, size_t *size);
+
+/**
+ * Opens a cursor on a file of an indexed archive.
+ *
+ * The cursor remembers where the data of the file starts in the archive, so that reading a large file in chunks
+ * costs one positional read per chunk instead of a lookup per call like read_file().
+ *
+ * @param ar A handle returned by tar_open(), which must outlive the cursor.
+ * @param path A path to an entry in the archive.
+ *
+ * @return a cursor positioned at the start of the file, or NULL if no entry at the given path exists in the archive,
+ *         the entry is not a file or memory could not be allocated.
+ */
+tar_member_t *tar_open_member(const tar_archive_t *ar, const char *path);
+
+/**
+ * Reads from the position of the cursor and moves it past the bytes read.
+ *
+ * @return the number of bytes copied to dest, zero at the end of the file, or -1 on error.
+ */
+ssize_t tar_member_read(tar_member_t *member, uint8_t *dest, size_t len);
+
+/**
+ * Reads from a given offset of the file without moving the cursor. Concurrent calls on one cursor are safe.
+ *
+ * @return the number of bytes copied to dest, which is less than len only at the end of the file, or -1 on error.
+ */
+ssize_t tar_member_pread(const tar_member_t *member, uint8_t *dest, size_t len, uint64_t offset);
+
+/**
+ * Moves the cursor, like lseek() does on a file. The cursor may be moved past the end of the file.
+ *
+ * @return the new position of the cursor, or -1 if it would be negative or whence is invalid.
+ */
+off_t tar_member_seek(tar_member_t *member, off_t offset, int whence);
+
+/* Returns the size of the file a cursor is opened on */
+uint64_t tar_member_size(const tar_member_t *member);
+
+/* Releases a cursor returned by tar_open_member() */
+void tar_member_close(tar_member_t *member);
+
+/**
+ * Writes a range of a file of an indexed archive to a file descriptor, without going through a user buffer.
+ *
+ * The data is moved by the kernel with copy_file_range(), which can share the extents on filesystems supporting
+ * reflinks, sendfile() or splice(). A buffered copy is used when none of them works between the two fds.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ * @param out_fd The destination, a file, a socket or a pipe. The data is written at its current file offset.
+ * @param offset An offset in the file from which to start, zero indicates the start of the file.
+ * @param len The number of bytes to transfer, it is cut down to what is left after offset.
+ *
+ * @return the number of bytes written to out_fd,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is not below the file total length, an empty file having no valid offset,
+ *         -3 if the transfer failed, errno is then set by the failing call.
+ */
+ssize_t tar_send_file(const tar_archive_t *ar, const char *path, int out_fd, uint64_t offset, size_t len);
+
+/**
+ * Same as tar_send_file() on the file a cursor is opened on. The position of the cursor is not changed.
+ */
+ssize_t tar_member_send(const tar_member_t *member, int out_fd, uint64_t offset, size_t len);
+
+/**
+ * Looks up many paths in a single pass over the headers of an archive, without indexing it.
+ *
+ * The requested paths are put in a temporary hash table that every header is matched against, which is cheaper
+ * than tar_open() when an archive is only queried once for a batch of paths.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param paths The paths to look up.
+ * @param no_paths The number of paths.
+ * @param results An array of no_paths results, results[i] is filled for paths[i].
+ *
+ * @return the number of paths found in the archive, or -1 if memory could not be allocated, the archive read or
+ *         a header fails the checks of check_archive().
+ */
+int tar_lookup_batch(int tar_fd, char **paths, size_t no_paths, tar_stat_t *results);
+
+/**
+ * Starts reading an archive forward only, from a pipe, a socket, standard input or any fd.
+ *
+ * The archive is read by big read() calls into a buffer of a fixed size, whatever the size of the archive. The
+ * entries come one after the other from tar_stream_next(), and the data of the current entry from
+ * tar_stream_read(). The data left unread when moving to the next entry is skipped, by lseek() when the fd allows
+ * it, or by reading and discarding it otherwise. PAX and GNU long names are applied as by tar_open().
+ *
+ * Example, as in curl ... | tool:
+ *   tar_stream_t *stream = tar_stream_open(STDIN_FILENO);
+ *   tar_entry_t entry;
+ *   while (tar_stream_next(stream, &entry) == 1) {
+ *       if (entry.typeflag == REGTYPE && want(entry.name)) {
+ *           while ((n = tar_stream_read(stream, buf, sizeof(buf))) > 0) { ... }
+ *       }
+ *   }
+ *   tar_stream_close(stream);
+ *
+ * @param fd A file descriptor positioned at the start of an archive. It must stay open while the reader is used.
+ *
+ * @return a reader, or NULL if memory could not be allocated.
+ */
+tar_stream_t *tar_stream_open(int fd);
+
+/**
+ * Moves to the next entry of a streamed archive.
+ *
+ * @param stream A reader returned by tar_stream_open().
+ * @param entry Set to the entry, whose name and linkname stay valid until the next call. Its offset is the offset
+ *              of its header from the start of the stream.
+ *
+ * @return 1 if there is an entry, zero at the end of the archive, -1 if the archive could not be read, a header
+ *         fails the checks of check_archive() or an extended header is invalid.
+ */
+int tar_stream_next(tar_stream_t *stream, tar_entry_t *entry);
+
+/**
+ * Reads the data of the current entry of a streamed archive, from where the previous call stopped.
+ *
+ * @param stream A reader returned by tar_stream_open().
+ * @param dest A buffer of len bytes.
+ * @param len The number of bytes to read.
+ *
+ * @return the number of bytes read, zero once the whole data of the entry has been read, -1 if there is no
+ *         current entry or the archive ends before the data.
+ */
+ssize_t tar_stream_read(tar_stream_t *stream, uint8_t *dest, size_t len);
+
+/**
+ * Releases a reader returned by tar_stream_open(). The file descriptor is not closed.
+ */
+void tar_stream_close(tar_stream_t *stream);
+
+/**
+ * Reads an archive forward only and calls back for each entry, see tar_stream_open().
+ *
+ * @param fd A file descriptor positioned at the start of an archive.
+ * @param callback Called with each entry and the reader, which tar_stream_read() reads the data of the entry
+ *                 from. A non-zero return value stops the reading.
+ * @param arg Passed to the callback.
+ *
+ * @return zero once every entry has been called back, the non-zero value returned by the callback if it stopped the
+ *         reading, -1 if the archive could not be read or memory could not be allocated.
+ */
+int tar_stream_each(int fd, int (*callback)(const tar_entry_t *entry, tar_stream_t *stream, void *arg), void *arg);
+
+/**
+ * Turns the statistics on or off, they are off by default.
+ *
+ * While they are on, every call is accounted to the TAR_OP_* group of the public function called, including the
+ * work of the functions it calls itself: an exists() that indexes a new archive accounts the headers parsed to
+ * TAR_OP_LOOKUP. Slow calls can so be told apart between walks of the archive and data I/O.
+ * While they are off, the cost is a test of a flag.
+ *
+ * @param on Non-zero to turn the statistics on.
+ */
+void tar_stats_enable(int on);
+
+/**
+ * Copies the current statistics, which are shared by every thread, into snapshot.
+ */
+void tar_stats_snapshot(tar_stats_t *snapshot);
+
+/**
+ * Sets every counter of the statistics back to zero.
+ */
+void tar_stats_reset(void);
+
+/* Returns a printable name for a TAR_OP_* value */
+const char *tar_op_name(int op);
+
+/**
+ * Selects how the archives opened from now on are read, by check_archive(), tar_lookup_batch(), tar_open() and
+ * the functions taking a file descriptor. Archives already indexed keep their engine.
+ *
+ * With TAR_IO_URING, the walks of the headers read ahead the blocks that follow the current header, so that many
+ * reads are in flight at once. This pays off on devices that are slow to answer a single read, like cold disks or
+ * network block devices, but wastes bandwidth on archives of big members, whose headers are far apart: the read-
+ * ahead shrinks as headers are found past it. The data of tar_read_batch() is read through io_uring too.
+ *
+ * @param engine TAR_IO_DEFAULT or TAR_IO_URING.
+ *
+ * @return zero on success, -1 if the engine is unknown or io_uring is not available on this system, in which case
+ *         the archives are read as with TAR_IO_DEFAULT.
+ */
+int tar_set_io_engine(int engine);
+
+/**
+ * Selects the kernel summing the header blocks for their checksum, by check_archive() and the walks of the headers.
+ * Both kernels give the same results, the scalar one can be selected to test it against the vector ones.
+ *
+ * @param kernel TAR_CHECK_DEFAULT or TAR_CHECK_SCALAR.
+ *
+ * @return zero on success, -1 if the kernel is unknown.
+ */
+int tar_set_check_kernel(int kernel);
+
+/**
+ * Turns on the block cache, which keeps the blocks of the archives recently read in memory, or turns it off.
+ *
+ * The cache is shared by every handle and thread. It is keyed by the archive file, whatever the handle or fd it is
+ * read through, and by blocks of 16 KiB. Reads of at most 64 KiB of the archives that are not mapped in memory go
+ * through it: compressed archives, whose blocks would otherwise be inflated again, archives read through io_uring
+ * or that could not be mapped, and the shards of catalogs. Mapped archives are cached by the kernel already. Once
+ * the budget is spent, the least recently used block makes room for the next one.
+ *
+ * @param budget The most memory the blocks take, zero to turn the cache off. The blocks held so far are dropped,
+ *               the counters are kept.
+ *
+ * @return zero on success, -1 if memory could not be allocated, the cache then being left as it was.
+ */
+int tar_cache_enable(size_t budget);
+
+/**
+ * Copies the counters of the block cache into stats.
+ */
+void tar_cache_stats(tar_cache_stats_t *stats);
+
+/**
+ * Starts writing a POSIX ustar archive, which check_archive() accepts.
+ *
+ * The entries are queued by tar_writer_add() and read by a pool of threads, each one building the headers of an
+ * entry and reading the whole data of a small file ahead of the writer. The entries are written in the order they
+ * were queued by a single thread, which gathers the blocks of many of them into one vectored write. Only a bounded
+ * number of entries are read ahead, tar_writer_add() waits for the writer when they are all taken.
+ *
+ * Names and link targets that do not fit the ustar fields, as well as numbers out of their range, are stored in
+ * PAX extended headers.
+ *
+ * Example:
+ *   tar_writer_t *writer = tar_writer_open(out_fd, 0);
+ *   tar_writer_add(writer, "/srv/data/", "data");
+ *   tar_writer_add(writer, "/srv/data/a.txt", "data/a.txt");
+ *   if (tar_writer_close(writer) == -1) { ... }
+ *
+ * @param out_fd A file descriptor the archive is written to, which does not need to be seekable.
+ * @param no_threads The number of threads reading the source files, zero for a default.
+ *
+ * @return a writer, or NULL if memory could not be allocated or the threads could not be started.
+ */
+tar_writer_t *tar_writer_open(int out_fd, int no_threads);
+
+/**
+ * Queues an entry of the archive being written. Regular files, directories and symlinks are supported, a symlink
+ * being archived as such. The content of a directory is not added, each entry is queued on its own.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param src_path The path of the file to archive, which is only read once the call returned.
+ * @param name The path of the entry in the archive, or NULL for src_path without its leading slashes.
+ *
+ * @return zero if the entry was queued, -1 if a path is too long or the archive could not be written.
+ */
+int tar_writer_add(tar_writer_t *writer, const char *src_path, const char *name);
+
+/**
+ * Writes the queued entries and the end of the archive, then releases the writer. The file descriptor is not
+ * closed.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ *
+ * @return zero on success, -1 if the archive could not be written or an entry could not be read. An entry that
+ *         could not be read, because it is missing or is not a file, a directory or a symlink, is left out of the
+ *         archive, which stays valid.
+ */
+int tar_writer_close(tar_writer_t *writer);
+
+/**
+ * Extracts an indexed archive, or the part of it under a path, to a directory.
+ *
+ * The entries are taken from the index in a single pass, without reading the headers again. The directories are
+ * created first, then the files are written by a pool of threads, the data going from the archive to the file by
+ * copy_file_range() or sendfile() when the kernel can, after the space of the file is reserved by fallocate(). The
+ * mode and mtime of an entry are set once its data is written, and those of the directories once all their
+ * children are in. Hard links and symlinks are created after every file. Owners are not restored. Only the data runs
+ * of a sparse file are written, so its holes stay holes on filesystems that support them.
+ *
+ * Entries whose path goes up with a ".." component are not extracted, and leading slashes are dropped. Symlinks
+ * are never followed on the way to an entry, so one in the archive or in the destination cannot lead out of it: an
+ * entry under a symlink is not extracted. A file, link or empty directory already at the path of an entry is
+ * replaced.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param dest_dir The directory to extract to, which must exist.
+ * @param prefix NULL or the empty path to extract the whole archive, or the path of an entry of the archive, which
+ *               is extracted with the directories above it and, for a directory, everything under it.
+ * @param no_threads The number of threads writing files, zero for a default.
+ *
+ * @return zero if every entry was extracted, the number of entries that could not be, or -1 if no entry is at
+ *         prefix, the destination could not be opened or memory could not be allocated.
+ */
+int tar_extract(const tar_archive_t *ar, const char *dest_dir, const char *prefix, int no_threads);
+
+/**
+ * Verifies the data of the files of an indexed archive by computing digests of each one, and writes them as a
+ * manifest.
+ *
+ * The files are hashed by a pool of threads, the biggest first, each byte of data being read once: in place when
+ * the archive is mapped, by chunks of 1 MiB otherwise. With TAR_DIGEST_CRC32C alone, files over 4 MiB are cut in
+ * pieces hashed by several threads, whose CRCs are combined, the SHA-256 of a file being computed by a single
+ * thread. The manifest has one line per file, in archive order: the
+ * CRC-32C in 8 hex digits and the SHA-256 in 64, separated by a space when both are asked for, then two spaces and
+ * the path. With only TAR_DIGEST_SHA256, it can be checked by `sha256sum -c` against an extracted copy.
+ *
+ * @param ar A handle returned by tar_open().
+ * @param digests TAR_DIGEST_CRC32C, TAR_DIGEST_SHA256 or both.
+ * @param no_threads The number of threads hashing files, zero for a default.
+ * @param manifest_fd The file descriptor the manifest is written to, from its current position.
+ *
+ * @return zero if every file was hashed, the number of files whose data could not be read, which are left out of
+ *         the manifest, or -1 if no digest is asked for, the manifest could not be written or memory could not be
+ *         allocated.
+ */
+int tar_digest(const tar_archive_t *ar, int digests, int no_threads, int manifest_fd);
+
+/**
+ * Indexes many archives, the shards of a dataset, as a single namespace.
+ *
+ * Every shard is indexed once and its entries are merged into one index, which maps each path to the shard holding
+ * it and its offset there, so that a lookup costs one hash lookup and a read touches one shard. A path found in
+ * several shards resolves to the one of the last shard, and the directories of all the shards are merged. Links
+ * are resolved in the merged namespace. The fds of the shards are kept open up to a limit, the least recently
+ * used one being closed to open another one; a shard whose file changed since it was indexed cannot be read.
+ *
+ * The catalog may be used by several threads at once.
+ *
+ * @param paths The paths of the archives.
+ * @param no_paths The number of archives.
+ * @param max_open The most fds kept open at once, exceeded only while every open shard is being read.
+ *
+ * @return a catalog to close with tar_catalog_close(), or NULL if an archive could not be opened or indexed, or
+ *         memory could not be allocated.
+ */
+tar_catalog_t *tar_catalog_open(const char *const *paths, size_t no_paths, size_t max_open);
+
+/**
+ * Closes a catalog and the fds of its shards.
+ */
+void tar_catalog_close(tar_catalog_t *cat);
+
+/**
+ * Returns the merged index of a catalog, owned by the catalog, for the tar_* functions that only use the index:
+ * tar_lookup(), tar_resolve(), tar_is_dir() and the like, tar_list_ex() and tar_query(). The data of the files must be
+ * read by tar_catalog_read_file().
+ */
+const tar_archive_t *tar_catalog_index(const tar_catalog_t *cat);
+
+/**
+ * Looks up an entry of a catalog.
+ *
+ * @param cat A catalog returned by tar_catalog_open().
+ * @param path A path to an entry in the catalog.
+ * @param archive NULL, or set to the path of the archive holding the entry, NULL for a directory only implied by
+ *                the paths of its children. Its offset is an offset in that archive.
+ *
+ * @return the entry at the given path, owned by the catalog, or NULL if no entry at the given path exists.
+ */
+const tar_entry_t *tar_catalog_lookup(const tar_catalog_t *cat, const char *path, const char **archive);
+
+/**
+ * Same as exists(), list() and read_file(), answered from the merged index of the catalog.
+ * tar_catalog_read_file() reads from the shard holding the file, opening it if needed.
+ */
+int tar_catalog_exists(const tar_catalog_t *cat, const char *path);
+int tar_catalog_list(const tar_catalog_t *cat, const char *path, char **entries, size_t *no_entries);
+ssize_t tar_catalog_read_file(tar_catalog_t *cat, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Indexes archives once and serves them to the processes of the host over a Unix socket, see tar_client_open().
+ *
+ * The server answers exists, list and read requests from its indexes. The bytes of a file are not copied through
+ * the socket: the server replies with their range in the archive and passes the fd of the archive along by
+ * SCM_RIGHTS, once per client and archive, the client then reading the range itself with pread(). Only the files of
+ * compressed archives and the sparse files are sent in the reply, at most 1 MiB per read. Archives whose first
+ * bytes are the gzip magic are opened by tar_open_gz(), without a saved index. With the block cache turned on, see
+ * tar_cache_enable(), the blocks of compressed archives read by the server are not inflated again.
+ *
+ * @param socket_path The path of the socket to create, a socket already there is replaced.
+ * @param paths The paths of the archives, which the clients name them by.
+ * @param no_paths The number of archives.
+ *
+ * @return a server to run with tar_server_run(), or NULL if an archive could not be opened or indexed, the socket
+ *         could not be created or memory could not be allocated.
+ */
+tar_server_t *tar_server_open(const char *socket_path, const char *const *paths, size_t no_paths);
+
+/**
+ * Accepts clients, each one served by a thread of its own, until tar_server_stop() is called. The connections still
+ * open are then cut and their threads waited for. Clients that hang up before being accepted are skipped, and
+ * accepting pauses for a moment while the process is out of fds or memory. Once 64 connections are served, or the
+ * number set by tar_server_set_max_conns(), new clients wait to be accepted until one of them ends.
+ *
+ * @return zero once stopped, -1 if the listening socket failed for good.
+ */
+int tar_server_run(tar_server_t *server);
+
+/**
+ * Makes tar_server_run() return. Safe to call from a signal handler.
+ */
+void tar_server_stop(tar_server_t *server);
+
+/**
+ * Sets the number of connections a server serves at once, 64 by default. Called while the server runs, the limit
+ * holds from the next client accepted, and the connections already served above it are kept.
+ *
+ * @return zero on success, -1 if max_conns is zero.
+ */
+int tar_server_set_max_conns(tar_server_t *server, size_t max_conns);
+
+/**
+ * Closes a server that is not running, removing its socket.
+ */
+void tar_server_close(tar_server_t *server);
+
+/**
+ * Connects to a server created by tar_server_open(). The client may be used by several threads at once, their
+ * requests then going over the connection one at a time.
+ *
+ * @return a client to close with tar_client_close(), or NULL if the server could not be reached.
+ */
+tar_client_t *tar_client_open(const char *socket_path);
+
+/**
+ * Closes the connection of a client and the fds of the archives it received.
+ */
+void tar_client_close(tar_client_t *client);
+
+/**
+ * Same as exists(), list() and read_file(), answered by the server for one of its archives, named by the path it
+ * was given to tar_server_open().
+ *
+ * tar_client_exists() and tar_client_list() return -1 if the server could not be reached or does not serve the
+ * archive. tar_client_read_file() returns -3 in that case or if the file could not be read, and reads at most
+ * 1 MiB at a time from the files sent in the reply. A path longer than TAR_PATH_MAX fails the same way without
+ * being sent, the client staying usable. Once the connection failed, every later call fails.
+ */
+int tar_client_exists(tar_client_t *client, const char *archive, const char *path);
+int tar_client_list(tar_client_t *client, const char *archive, const char *path, char **entries, size_t *no_entries);
+ssize_t tar_client_read_file(tar_client_t *client, const char *archive, const char *path, size_t offset,
+                             uint8_t *dest, size_t *len);
+
 #endif
@@ -0,0 +1,60 @@
+/*
+ * Serves archives to the processes of the host over a Unix socket, see tar_server_open().
+ *
+ * Usage: tar_served [-c cache_mib] [-n max_conns] socket_path archive...
+ * -c keeps up to cache_mib MiB of the blocks read in the block cache, see tar_cache_enable().
+ * -n serves at most max_conns clients at once, 64 by default, see tar_server_set_max_conns().
+ * The server runs until it gets SIGINT or SIGTERM.
+ */
+#include "lib_tar.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static tar_server_t *server;
+
+static void stop(int sig) {
+    tar_server_stop(server);
+}
+
+int main(int argc, char **argv) {
+    size_t cache_mib = 0, max_conns = 0;
+    int usage = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:")) != -1) {
+        if (opt == 'c') {
+            cache_mib = strtoul(optarg, NULL, 10);
+            usage |= cache_mib == 0;
+        } else if (opt == 'n') {
+            max_conns = strtoul(optarg, NULL, 10);
+            usage |= max_conns == 0;
+        } else {
+            usage = 1;
+        }
+    }
+    if (usage || argc - optind < 2) {
+        printf("Usage: %s [-c cache_mib] [-n max_conns] socket_path archive...\n", argv[0]);
+        return -1;
+    }
+    if (cache_mib > 0 && tar_cache_enable(cache_mib << 20) == -1) {
+        perror("tar_cache_enable");
+        return -1;
+    }
+
+    server = tar_server_open(argv[optind], (const char *const *) argv + optind + 1, argc - optind - 1);
+    if (server == NULL) {
+        perror("tar_server_open");
+        return -1;
+    }
+    if (max_conns > 0) {
+        tar_server_set_max_conns(server, max_conns);
+    }
+    struct sigaction action = { .sa_handler = stop };
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int ret = tar_server_run(server);
+    tar_server_close(server);
+    return ret;
+}
@@ -1,11 +1,21 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <zlib.h>
 
 #include "lib_tar.h"
 
+#define NO_THREADS 8
+#define NO_READS 5000
+#define NO_QUERIES 100
+
 /**
  * You are free to use this file to write tests for your implementation
  */
@@ -25,6 +35,1509 @@ void debug_dump(const uint8_t *bytes, size_t len) {
     }
 }
 
+struct reader_args {
+    int fd;
+    tar_archive_t *ar;
+    char *path;
+    const uint8_t *expected;
+    size_t size;
+    unsigned int seed;
+    int failed;
+};
+
+/* Reads random ranges of a file, alternating between the fd-based and the handle-based functions */
+void *reader(void *arg) {
+    struct reader_args *args = arg;
+    uint8_t buf[256];
+
+    for (int i = 0; i < NO_READS; i++) {
+        size_t offset = rand_r(&args->seed) % args->size;
+        size_t len = rand_r(&args->seed) % sizeof(buf) + 1;
+        size_t asked = len;
+        ssize_t ret;
+        if (i % 2) {
+            ret = read_file(args->fd, args->path, offset, buf, &len);
+        } else {
+            ret = tar_read_file(args->ar, args->path, offset, buf, &len);
+        }
+
+        size_t last = args->size - offset;
+        size_t want = asked < last ? asked : last;
+        if (ret != (ssize_t) (last - want) || len != want || memcmp(buf, args->expected + offset, len) != 0
+            || !is_file(args->fd, args->path)) {
+            args->failed++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Hammers a single fd and a single handle with concurrent reads of the same file.
+ *
+ * @return the number of reads that returned a wrong result.
+ */
+int test_concurrent_reads(int fd, char *path) {
+    size_t size = 1 << 20;
+    uint8_t *expected = malloc(size);
+    if (read_file(fd, path, 0, expected, &size) != 0 || size == 0) {
+        printf("test_concurrent_reads: cannot read %s\n", path);
+        free(expected);
+        return 1;
+    }
+
+    tar_archive_t *ar = tar_open(fd);
+    pthread_t threads[NO_THREADS];
+    struct reader_args args[NO_THREADS];
+    for (int i = 0; i < NO_THREADS; i++) {
+        args[i] = (struct reader_args) { fd, ar, path, expected, size, i + 1, 0 };
+        pthread_create(&threads[i], NULL, reader, &args[i]);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < NO_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        failed += args[i].failed;
+    }
+    tar_close(ar);
+    free(expected);
+    return failed;
+}
+
+/* Heap allocations of the library and the tests, counted through the --wrap options of the Makefile */
+static size_t no_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+char *__real_strndup(const char *s, size_t n);
+
+void *__wrap_malloc(size_t size) {
+    __atomic_fetch_add(&no_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    __atomic_fetch_add(&no_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&no_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s) {
+    __atomic_fetch_add(&no_allocs, 1, __ATOMIC_RELAXED);
+    return __real_strdup(s);
+}
+
+char *__wrap_strndup(const char *s, size_t n) {
+    __atomic_fetch_add(&no_allocs, 1, __ATOMIC_RELAXED);
+    return __real_strndup(s, n);
+}
+
+/**
+ * Runs the query functions over and over once the archive is indexed, none of them should allocate.
+ *
+ * @return the number of heap allocations they made.
+ */
+int test_no_allocs(int fd) {
+    char names[8][TAR_PATH_MAX];
+    char *entries[8];
+    const tar_entry_t *found[8];
+    tar_filter_t filter = { .prefix = "test/", .types = TAR_TYPE_FILE, .min_size = 1 };
+    for (int i = 0; i < 8; i++) {
+        entries[i] = names[i];
+    }
+    uint8_t buf[256];
+
+    // The first fd-based call indexes the archive
+    tar_archive_t *ar = tar_open(fd);
+    exists(fd, "test/tests.c");
+    size_t before = no_allocs;
+    for (int i = 0; i < NO_QUERIES; i++) {
+        size_t no_entries = 8, no_found = 8, len = sizeof(buf);
+        exists(fd, "test/tests.c");
+        is_dir(fd, "test/folder1/");
+        is_file(fd, "test/tests.c");
+        is_symlink(fd, "test/S1_exo6");
+        list(fd, "test/folder1/", entries, &no_entries);
+        read_file(fd, "test/tests.c", i, buf, &len);
+        check_archive(fd);
+        tar_resolve(ar, "test/folder1");
+        tar_query(ar, "test/*.c", 0, NULL, found, &no_found);
+        no_found = 8;
+        tar_scan(ar, &filter, NULL, found, &no_found);
+    }
+    size_t allocs = no_allocs - before;
+    tar_close(ar);
+    return (int) allocs;
+}
+
+/* Sets the checksum of a header block after its fields were changed */
+void seal_header(uint8_t *block) {
+    tar_header_t *hdr = (tar_header_t *) block;
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    unsigned sum = 0;
+    for (int i = 0; i < sizeof(tar_header_t); i++) {
+        sum += block[i];
+    }
+    sprintf(hdr->chksum, "%06o", sum);
+}
+
+/* Fills a ustar header block, checksum included */
+void fill_header(uint8_t *block, const char *name, char typeflag, uint64_t size) {
+    tar_header_t *hdr = (tar_header_t *) block;
+    memset(block, 0, sizeof(tar_header_t));
+    memcpy(hdr->name, name, strlen(name));
+    sprintf(hdr->mode, "%07o", 0644);
+    sprintf(hdr->size, "%011llo", (unsigned long long) size);
+    sprintf(hdr->mtime, "%011o", 0);
+    hdr->typeflag = typeflag;
+    memcpy(hdr->magic, TMAGIC, TMAGLEN);
+    memcpy(hdr->version, TVERSION, TVERSLEN);
+    seal_header(block);
+}
+
+/* Returns an fd on an unlinked temporary file holding len bytes of data */
+int temp_file(const void *data, size_t len) {
+    char path[] = "/tmp/lib_tar_testXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        return -1;
+    }
+    unlink(path);
+    if (write(fd, data, len) != (ssize_t) len) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Lays out an archive of small files, given as pairs of a name and a content, and returns its length */
+size_t craft_archive(uint8_t *archive, const char *const (*files)[2], size_t no_files) {
+    size_t offset = 0;
+    for (size_t i = 0; i < no_files; i++) {
+        size_t size = strlen(files[i][1]);
+        fill_header(archive + offset, files[i][0], REGTYPE, size);
+        memset(archive + offset + 512, 0, (size + 511) / 512 * 512);
+        memcpy(archive + offset + 512, files[i][1], size);
+        offset += 512 + (size + 511) / 512 * 512;
+    }
+    memset(archive + offset, 0, 1024);
+    return offset + 1024;
+}
+
+/* Creates a file holding len bytes of data with a given mode */
+int write_file(const char *path, const void *data, size_t len, mode_t mode) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd == -1) {
+        return -1;
+    }
+    int ret = write(fd, data, len) == (ssize_t) len ? 0 : -1;
+    close(fd);
+    return chmod(path, mode) == -1 ? -1 : ret;
+}
+
+/* Tells whether a file holds exactly len bytes of data */
+int same_file(const char *path, const void *data, size_t len) {
+    static uint8_t buf[1 << 20];
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t got = read(fd, buf, sizeof(buf));
+    close(fd);
+    return got == (ssize_t) len && memcmp(buf, data, len) == 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+/* Removes a temporary directory and everything under it */
+void remove_tree(const char *path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Maps the files of the archive, an empty one included, and compares their data with a pread() at the offset of
+ * their entry. Paths that are not files must not be mapped.
+ *
+ * @return the number of checks that failed.
+ */
+int test_map_file(int fd) {
+    static uint8_t expected[1 << 16];
+    const char *const files[] = { "test/tests.c", "test/tests", "test/folder1/hello.c" };
+    tar_archive_t *ar = tar_open(fd);
+    int failed = ar == NULL;
+    for (int i = 0; ar != NULL && i < 3; i++) {
+        const tar_entry_t *entry = tar_lookup(ar, files[i]);
+        const uint8_t *data = NULL;
+        size_t size = 0;
+        int mapped = entry != NULL && tar_map_file(ar, files[i], &data, &size) == 0 && size == entry->size;
+        failed += !mapped || pread(fd, expected, size, entry->offset + 512) != (ssize_t) size
+                  || memcmp(data, expected, size) != 0;
+    }
+    const uint8_t *data;
+    size_t size;
+    failed += ar == NULL || tar_map_file(ar, "test/folder1/", &data, &size) != -1;
+    failed += ar == NULL || tar_map_file(ar, "test/nothing", &data, &size) != -1;
+    tar_close(ar);
+    return failed;
+}
+
+/**
+ * Reads a file of the archive through a cursor: in chunks up to and past its end, after seeks from each origin and
+ * at offsets given to tar_member_pread(), comparing every byte with read_file().
+ *
+ * @return the number of checks that failed.
+ */
+int test_member(int fd) {
+    static uint8_t expected[1 << 16], buf[1 << 16];
+    size_t size = sizeof(expected);
+    if (read_file(fd, "test/tests", 0, expected, &size) != 0) {
+        return 1;
+    }
+    tar_archive_t *ar = tar_open(fd);
+    tar_member_t *member = ar != NULL ? tar_open_member(ar, "test/tests") : NULL;
+    if (member == NULL) {
+        tar_close(ar);
+        return 1;
+    }
+    int failed = tar_member_size(member) != size || tar_open_member(ar, "test/folder1/") != NULL;
+
+    // Chunks of 1000 bytes, the last one cut at the end of the file, then nothing
+    size_t got = 0;
+    ssize_t n;
+    while ((n = tar_member_read(member, buf + got, 1000)) > 0) {
+        failed += n != (ssize_t) (size - got < 1000 ? size - got : 1000);
+        got += n;
+    }
+    failed += n != 0 || got != size || memcmp(buf, expected, size) != 0 || tar_member_read(member, buf, 1) != 0;
+
+    failed += tar_member_seek(member, 100, SEEK_SET) != 100;
+    failed += tar_member_read(member, buf, 10) != 10 || memcmp(buf, expected + 100, 10) != 0;
+    failed += tar_member_seek(member, 40, SEEK_CUR) != 150;
+    failed += tar_member_read(member, buf, 10) != 10 || memcmp(buf, expected + 150, 10) != 0;
+    failed += tar_member_seek(member, -20, SEEK_END) != (off_t) size - 20;
+    failed += tar_member_read(member, buf, 100) != 20 || memcmp(buf, expected + size - 20, 20) != 0;
+    failed += tar_member_seek(member, 10, SEEK_END) != (off_t) size + 10 || tar_member_read(member, buf, 10) != 0;
+    failed += tar_member_seek(member, -1, SEEK_SET) != -1 || tar_member_seek(member, 0, SEEK_END + 100) != -1;
+
+    // Positional reads leave the cursor where it is
+    failed += tar_member_seek(member, 0, SEEK_SET) != 0;
+    failed += tar_member_pread(member, buf, 100, size - 30) != 30 || memcmp(buf, expected + size - 30, 30) != 0;
+    failed += tar_member_pread(member, buf, 10, size) != 0 || tar_member_pread(member, buf, 10, size + 10) != 0;
+    failed += tar_member_read(member, buf, 5) != 5 || memcmp(buf, expected, 5) != 0;
+    tar_member_close(member);
+    tar_close(ar);
+    return failed;
+}
+
+/**
+ * Looks up paths of the archive in one batch: a path given twice, missing ones and a symlink, which is returned as a
+ * link rather than followed. Each result must be the entry of the path at the same index, as found by tar_lookup().
+ *
+ * @return the number of checks that failed.
+ */
+int test_lookup_batch(int fd) {
+    char *paths[] = { "test/tests.c", "missing", "test/S1_exo6", "test/folder1/", "test/tests.c", "test/tests",
+                      "test/missing/" };
+    size_t no_paths = sizeof(paths) / sizeof(paths[0]);
+    tar_stat_t results[sizeof(paths) / sizeof(paths[0])];
+    int found = tar_lookup_batch(fd, paths, no_paths, results);
+    tar_archive_t *ar = tar_open(fd);
+    int failed = found != 5 || ar == NULL;
+    for (size_t i = 0; ar != NULL && i < no_paths; i++) {
+        const tar_entry_t *entry = tar_lookup(ar, paths[i]);
+        failed += results[i].found != (entry != NULL);
+        failed += entry != NULL && (results[i].typeflag != entry->typeflag || results[i].size != entry->size
+                                    || results[i].data_offset != entry->offset + 512
+                                    || strcmp(results[i].linkname, entry->linkname) != 0);
+    }
+    failed += results[2].typeflag != SYMTYPE || strcmp(results[2].linkname, "/home/celia/Documents/S1_exo6/") != 0;
+    tar_close(ar);
+    return failed;
+}
+
+/* Lists path with tar_list_ex() by pages of page entries and tells whether the names are the expected ones */
+int list_pages(const tar_archive_t *ar, const char *path, int flags, size_t page, const char *const *expected,
+               size_t no_expected) {
+    char names[16][256];
+    char *entries[16];
+    for (int i = 0; i < 16; i++) {
+        entries[i] = names[i];
+    }
+    tar_list_cursor_t cursor = {0};
+    size_t listed = 0;
+    int ok = 1;
+    do {
+        size_t no_entries = page;
+        ok &= tar_list_ex(ar, path, flags, &cursor, entries, &no_entries) != 0 && no_entries <= page;
+        for (size_t i = 0; ok && i < no_entries; i++, listed++) {
+            ok &= listed < no_expected && strcmp(entries[i], expected[listed]) == 0;
+        }
+    } while (ok && !cursor.done);
+    return ok && listed == no_expected;
+}
+
+/**
+ * Lists a directory of the archive with list() and tar_list_ex(), whole, recursively and by pages of every size, and
+ * an archive whose directories have no header and are only implied by the paths of the files.
+ *
+ * @return the number of checks that failed.
+ */
+int test_list_ex(int fd) {
+    const char *const folder[] = { "test/folder1/hello.c", "test/folder1/lignthing/", "test/folder1/file1.py" };
+    const char *const tree[] = { "test/folder1/hello.c", "test/folder1/lignthing/",
+                                 "test/folder1/lignthing/inside_inside.c", "test/folder1/file1.py" };
+    char names[4][256];
+    char *entries[4] = { names[0], names[1], names[2], names[3] };
+    size_t no_entries = 4;
+    int failed = list(fd, "test/folder1/", entries, &no_entries) == 0 || no_entries != 3;
+    for (size_t i = 0; i < no_entries && i < 3; i++) {
+        failed += strcmp(entries[i], folder[i]) != 0;
+    }
+    no_entries = 4;
+    failed += list(fd, "test/tests.c", entries, &no_entries) != 0 || list(fd, "test/nothing/", entries, &no_entries);
+
+    tar_archive_t *ar = tar_open(fd);
+    for (size_t page = 1; ar != NULL && page <= 4; page++) {
+        failed += !list_pages(ar, "test/folder1/", 0, page, folder, 3);
+        failed += !list_pages(ar, "test/folder1/", TAR_LIST_RECURSIVE, page, tree, 4);
+    }
+    tar_close(ar);
+
+    // Only files, under directories that have no header
+    uint8_t archive[8 * 512];
+    const char *const files[][2] = { { "x/y/z.txt", "z" }, { "x/w", "w" } };
+    const char *const root[] = { "x/" };
+    const char *const children[] = { "x/y/", "x/w" };
+    const char *const implied[] = { "x/y/", "x/y/z.txt", "x/w" };
+    int implied_fd = temp_file(archive, craft_archive(archive, files, 2));
+    ar = tar_open(implied_fd);
+    failed += ar == NULL || !list_pages(ar, "", 0, 1, root, 1) || !list_pages(ar, "x/", 0, 1, children, 2);
+    failed += ar == NULL || !list_pages(ar, "x/", TAR_LIST_RECURSIVE, 2, implied, 3);
+    tar_close(ar);
+    close(implied_fd);
+    return failed;
+}
+
+/**
+ * Counts the calls of a few groups of functions while the statistics are on, and none once they are off. Each call
+ * must land in one bucket of the latency histogram of its group, and a reset must clear every counter.
+ *
+ * @return the number of checks that failed.
+ */
+int test_stats(int fd) {
+    tar_stats_t stats, off, zero;
+    uint8_t buf[64];
+    memset(&zero, 0, sizeof(zero));
+    exists(fd, "test/tests.c");
+    tar_stats_enable(1);
+    tar_stats_reset();
+    for (int i = 0; i < 3; i++) {
+        size_t len = sizeof(buf);
+        exists(fd, "test/tests.c");
+        read_file(fd, "test/tests.c", i, buf, &len);
+    }
+    int headers = check_archive(fd);
+    tar_stats_snapshot(&stats);
+    tar_stats_enable(0);
+    exists(fd, "test/tests.c");
+    tar_stats_snapshot(&off);
+
+    const uint64_t calls[TAR_NO_OPS] = { [TAR_OP_CHECK] = 1, [TAR_OP_LOOKUP] = 3, [TAR_OP_READ] = 3 };
+    int failed = memcmp(&stats, &off, sizeof(stats)) != 0;
+    for (int op = 0; op < TAR_NO_OPS; op++) {
+        uint64_t no_latencies = 0;
+        for (int i = 0; i < TAR_HIST_BUCKETS; i++) {
+            no_latencies += stats.ops[op].latency[i];
+        }
+        failed += stats.ops[op].calls != calls[op] || no_latencies != calls[op];
+    }
+    // The check reads every header, the block ending the archive included
+    failed += stats.ops[TAR_OP_CHECK].headers <= headers || stats.ops[TAR_OP_READ].bytes_read < 3 * sizeof(buf);
+
+    tar_stats_reset();
+    tar_stats_snapshot(&stats);
+    failed += memcmp(&stats, &zero, sizeof(stats)) != 0;
+    return failed;
+}
+
+/**
+ * Indexes an archive whose PAX header holds a record shorter than its own length prefix, which must be rejected.
+ *
+ * @return 1 if the archive was accepted.
+ */
+int test_truncated_pax(void) {
+    uint8_t archive[5 * 512];
+    const char *records = "1 path=evil\n";
+    memset(archive, 0, sizeof(archive));
+    fill_header(archive, "PaxHeaders/a", XHDTYPE, strlen(records));
+    memcpy(archive + 512, records, strlen(records));
+    fill_header(archive + 1024, "a", REGTYPE, 0);
+
+    int fd = temp_file(archive, sizeof(archive));
+    tar_archive_t *ar = tar_open(fd);
+    int failed = ar != NULL;
+    tar_close(ar);
+    close(fd);
+    return failed;
+}
+
+/**
+ * Checks and indexes an archive in the GNU format, a long name followed by the file it names.
+ *
+ * @return the number of checks that failed.
+ */
+int test_gnu_check(void) {
+    uint8_t archive[6 * 512];
+    char name[200];
+    memset(name, 'n', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    memset(archive, 0, sizeof(archive));
+    fill_header(archive, "././@LongLink", GNUTYPE_LONGNAME, sizeof(name));
+    memcpy(archive + 512, name, sizeof(name));
+    fill_header(archive + 1024, "short", REGTYPE, 3);
+    memcpy(archive + 1536, "abc", 3);
+    for (int i = 0; i < 2; i++) {
+        memcpy(((tar_header_t *) (archive + i * 1024))->magic, "ustar  ", 8);
+        seal_header(archive + i * 1024);
+    }
+
+    int fd = temp_file(archive, sizeof(archive));
+    tar_archive_t *ar = tar_open(fd);
+    const tar_entry_t *entry = ar != NULL ? tar_lookup(ar, name) : NULL;
+    int failed = (check_archive(fd) != 2) + (entry == NULL || entry->size != 3);
+    tar_close(ar);
+    close(fd);
+    return failed;
+}
+
+/**
+ * Sends a file of the archive to another file and compares it with read_file(), then sends from its last byte, its
+ * end and past it, by path and through a cursor.
+ *
+ * @return the number of checks that failed.
+ */
+int test_send_file(int fd, char *path) {
+    static uint8_t expected[1 << 16], sent[1 << 16];
+    size_t size = sizeof(expected);
+    if (read_file(fd, path, 0, expected, &size) != 0) {
+        return 1;
+    }
+    tar_archive_t *ar = tar_open(fd);
+    int out = temp_file(NULL, 0);
+    int failed = tar_send_file(ar, path, out, 0, SIZE_MAX) != (ssize_t) size;
+    failed += pread(out, sent, sizeof(sent), 0) != (ssize_t) size || memcmp(sent, expected, size) != 0;
+
+    // Past the end is the same offset for both
+    size_t len = 1;
+    failed += read_file(fd, path, size, sent, &len) != -2;
+    failed += tar_send_file(ar, path, out, size, 1) != -2 || tar_send_file(ar, path, out, size + 1, 1) != -2;
+    tar_member_t *member = tar_open_member(ar, path);
+    failed += member == NULL || tar_member_send(member, out, size - 1, 10) != 1;
+    failed += member == NULL || tar_member_send(member, out, size, 1) != -2;
+    failed += member == NULL || tar_member_send(member, out, size + 1, 1) != -2;
+    failed += pread(out, sent, sizeof(sent), 0) != (ssize_t) size + 1 || sent[size] != expected[size - 1];
+    tar_member_close(member);
+    close(out);
+    tar_close(ar);
+    return failed;
+}
+
+/**
+ * Checks archives with the vector and the scalar kernels summing the headers: the test archive, a copy of it with a
+ * corrupted header and an archive whose name has bytes above 127, which signed and unsigned sums tell apart.
+ *
+ * @return the number of checks whose result differs from the expected one.
+ */
+int test_check_kernels(int fd) {
+    static uint8_t archive[1 << 20];
+    ssize_t len = pread(fd, archive, sizeof(archive), 0);
+    int expected = check_archive(fd);
+    int copies[3];
+    int results[3] = { expected, -3, 1 };
+    copies[0] = temp_file(archive, len);
+    archive[100] ^= 1;
+    copies[1] = temp_file(archive, len);
+    memset(archive, 0, 3 * 512);
+    fill_header(archive, "\xe9t\xe9\xff", REGTYPE, 0);
+    copies[2] = temp_file(archive, 3 * 512);
+
+    int failed = expected <= 0;
+    for (int kernel = TAR_CHECK_DEFAULT; kernel <= TAR_CHECK_SCALAR; kernel++) {
+        tar_set_check_kernel(kernel);
+        for (int i = 0; i < 3; i++) {
+            failed += check_archive(copies[i]) != results[i];
+        }
+    }
+    tar_set_check_kernel(TAR_CHECK_DEFAULT);
+    for (int i = 0; i < 3; i++) {
+        close(copies[i]);
+    }
+    return failed;
+}
+
+/**
+ * Indexes a copy of the archive whose second header has a wrong checksum. The walks of the index, of a batch of
+ * lookups and of a stream must stop there like check_archive() does, not take the header for a valid one.
+ *
+ * @return the number of checks that failed.
+ */
+int test_corrupted_header(int fd) {
+    static uint8_t archive[1 << 20];
+    ssize_t len = pread(fd, archive, sizeof(archive), 0);
+    archive[512 + 1] ^= 1;
+    int copy = temp_file(archive, len);
+    char *paths[] = { "test/" };
+    tar_stat_t result;
+    int failed = check_archive(copy) != -3 || tar_open(copy) != NULL || exists(copy, "test/");
+    failed += tar_lookup_batch(copy, paths, 1, &result) != -1;
+
+    lseek(copy, 0, SEEK_SET);
+    tar_stream_t *stream = tar_stream_open(copy);
+    tar_entry_t entry;
+    failed += stream == NULL || tar_stream_next(stream, &entry) != 1 || tar_stream_next(stream, &entry) != -1;
+    tar_stream_close(stream);
+    close(copy);
+    return failed;
+}
+
+/**
+ * Alternates the fd-based functions between two archives, each one should be indexed only once.
+ *
+ * @return the number of heap allocations made once both are indexed, plus one if fd is not indexed again after
+ * tar_release_fds().
+ */
+int test_two_fds(int fd) {
+    static uint8_t archive[1 << 20];
+    ssize_t len = pread(fd, archive, sizeof(archive), 0);
+    int other = temp_file(archive, len);
+    uint8_t buf[16];
+
+    size_t before = 0;
+    for (int i = 0; i < NO_QUERIES; i++) {
+        if (i == 1) {
+            before = no_allocs;
+        }
+        size_t n = sizeof(buf);
+        exists(fd, "test/tests.c");
+        read_file(other, "test/tests.c", 0, buf, &n);
+    }
+    size_t allocs = no_allocs - before;
+
+    // Once released, the index of fd is built again
+    tar_release_fds();
+    before = no_allocs;
+    exists(fd, "test/tests.c");
+    allocs += no_allocs == before;
+    tar_release_fds();
+    close(other);
+    return (int) allocs;
+}
+
+/* Writes an archive of the entries of src, given as pairs of a source path and an entry name, to a temporary file */
+int write_archive(const char *src, const char *const (*entries)[2], size_t no_entries) {
+    char path[TAR_PATH_MAX];
+    int out = temp_file(NULL, 0);
+    tar_writer_t *writer = tar_writer_open(out, 2);
+    int failed = writer == NULL;
+    for (size_t i = 0; writer != NULL && i < no_entries; i++) {
+        snprintf(path, sizeof(path), "%s/%s", src, entries[i][0]);
+        failed += tar_writer_add(writer, path, entries[i][1]) != 0;
+    }
+    if (writer != NULL) {
+        failed += tar_writer_close(writer) != 0;
+    }
+    if (failed) {
+        close(out);
+        return -1;
+    }
+    return out;
+}
+
+/**
+ * Archives a small tree with the writer and extracts it, checking the data and modes of what was extracted. The
+ * tree holds a symlink to a directory outside of the destination, and a second archive a file under that symlink,
+ * which must not be written through it.
+ *
+ * @return the number of checks that failed.
+ */
+int test_extract(void) {
+    char root[] = "/tmp/lib_tar_testXXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+    char src[64], dest[64], outside[64], path[128];
+    snprintf(src, sizeof(src), "%s/src", root);
+    snprintf(dest, sizeof(dest), "%s/dest", root);
+    snprintf(outside, sizeof(outside), "%s/outside", root);
+    mkdir(src, 0755);
+    mkdir(dest, 0755);
+    mkdir(outside, 0755);
+    static uint8_t data[100000];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) (i * 7 + i / 251);
+    }
+    int failed = 0;
+    snprintf(path, sizeof(path), "%s/a.txt", src);
+    failed += write_file(path, "hello", 5, 0640) == -1;
+    snprintf(path, sizeof(path), "%s/sub", src);
+    failed += mkdir(path, 0750) == -1;
+    snprintf(path, sizeof(path), "%s/sub/b.bin", src);
+    failed += write_file(path, data, sizeof(data), 0600) == -1;
+    snprintf(path, sizeof(path), "%s/link", src);
+    failed += symlink(outside, path) == -1;
+
+    const char *const tree[][2] = { { "a.txt", "a.txt" }, { "sub", "sub" }, { "sub/b.bin", "sub/b.bin" },
+                                    { "link", "link" } };
+    const char *const escape[][2] = { { "a.txt", "link/evil" } };
+    int archives[2] = { write_archive(src, tree, 4), write_archive(src, escape, 1) };
+    for (int i = 0; i < 2; i++) {
+        tar_archive_t *ar = archives[i] != -1 ? tar_open(archives[i]) : NULL;
+        // Everything of the tree is extracted, nothing of the second archive
+        int ret = ar != NULL ? tar_extract(ar, dest, NULL, 2) : -1;
+        failed += i == 0 ? ret != 0 : ret <= 0;
+        tar_close(ar);
+        close(archives[i]);
+    }
+    snprintf(path, sizeof(path), "%s/evil", outside);
+    failed += access(path, F_OK) == 0;
+
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/a.txt", dest);
+    failed += !same_file(path, "hello", 5) || stat(path, &st) == -1 || (st.st_mode & 07777) != 0640;
+    snprintf(path, sizeof(path), "%s/sub/b.bin", dest);
+    failed += !same_file(path, data, sizeof(data)) || stat(path, &st) == -1 || (st.st_mode & 07777) != 0600;
+    snprintf(path, sizeof(path), "%s/sub", dest);
+    failed += stat(path, &st) == -1 || !S_ISDIR(st.st_mode) || (st.st_mode & 07777) != 0750;
+    snprintf(path, sizeof(path), "%s/link", dest);
+    failed += lstat(path, &st) == -1 || !S_ISLNK(st.st_mode);
+
+    remove_tree(root);
+    return failed;
+}
+
+/* Files of the sample archive, see sample_archive() */
+#define NO_SAMPLES 3
+static const char *const sample_names[NO_SAMPLES] = { "big.bin", "dir/small.txt", "dir/mid.bin" };
+static const size_t sample_sizes[NO_SAMPLES] = { 700000, 5, 200000 };
+
+/* Fills the data of the sample file i, which differs from one file to the other */
+void sample_data(uint8_t *data, size_t len, int i) {
+    uint32_t x = 2654435761u * (i + 1);
+    for (size_t j = 0; j < len; j++) {
+        x = x * 1103515245 + 12345;
+        data[j] = (uint8_t) (x >> 16);
+    }
+}
+
+/* Creates the sample files under root/src and returns an fd on an archive of them, laid out header by header, or -1 */
+int sample_archive(const char *root) {
+    static uint8_t data[1 << 20], archive[2 << 20];
+    char src[64], path[128];
+    snprintf(src, sizeof(src), "%s/src", root);
+    snprintf(path, sizeof(path), "%s/dir", src);
+    if (mkdir(src, 0755) == -1 || mkdir(path, 0755) == -1) {
+        return -1;
+    }
+    memset(archive, 0, sizeof(archive));
+    size_t offset = 0;
+    for (int i = 0; i < NO_SAMPLES; i++) {
+        snprintf(path, sizeof(path), "%s/%s", src, sample_names[i]);
+        sample_data(data, sample_sizes[i], i);
+        if (write_file(path, data, sample_sizes[i], 0644) == -1) {
+            return -1;
+        }
+        // The directory goes before its first file
+        if (i == 1) {
+            fill_header(archive + offset, "dir/", DIRTYPE, 0);
+            offset += 512;
+        }
+        fill_header(archive + offset, sample_names[i], REGTYPE, sample_sizes[i]);
+        memcpy(archive + offset + 512, data, sample_sizes[i]);
+        offset += 512 + (sample_sizes[i] + 511) / 512 * 512;
+    }
+    return temp_file(archive, offset + 1024);
+}
+
+/**
+ * Reads each sample file of an archive whole, then a range in its middle, and compares them with their data.
+ *
+ * @return the number of reads that returned a wrong result.
+ */
+int check_samples(const tar_archive_t *ar) {
+    static uint8_t expected[1 << 20], buf[1 << 20];
+    int failed = 0;
+    for (int i = 0; i < NO_SAMPLES; i++) {
+        size_t size = sample_sizes[i], len = sizeof(buf);
+        sample_data(expected, size, i);
+        failed += tar_read_file(ar, sample_names[i], 0, buf, &len) != 0 || len != size
+                  || memcmp(buf, expected, size) != 0;
+        size_t offset = size / 3;
+        len = size - offset < 1000 ? size - offset : 1000;
+        failed += tar_read_file(ar, sample_names[i], offset, buf, &len) < 0 || memcmp(buf, expected + offset, len) != 0;
+    }
+    return failed;
+}
+
+/**
+ * Compresses the sample archive with zlib and reads it back with tar_open_gz() twice: the first time inflates it and
+ * saves the index, the second one loads the index without parsing a single header.
+ *
+ * @return the number of checks that failed.
+ */
+int test_gz(void) {
+    char root[] = "/tmp/lib_tar_testXXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+    char gz_path[64], index_path[64];
+    snprintf(gz_path, sizeof(gz_path), "%s/sample.tar.gz", root);
+    snprintf(index_path, sizeof(index_path), "%s/sample.idx", root);
+    static uint8_t archive[2 << 20];
+    int fd = sample_archive(root);
+    ssize_t len = fd != -1 ? pread(fd, archive, sizeof(archive), 0) : -1;
+    gzFile gz = gzopen(gz_path, "wb");
+    int failed = len <= 0 || gz == NULL || gzwrite(gz, archive, len) != len;
+    if (gz != NULL) {
+        failed += gzclose(gz) != Z_OK;
+    }
+
+    // Checkpoints every 64 KiB, so that the reads resume from many of them
+    int gz_fd = open(gz_path, O_RDONLY);
+    tar_stats_enable(1);
+    for (int round = 0; !failed && round < 2; round++) {
+        tar_stats_t stats;
+        tar_stats_reset();
+        tar_archive_t *ar = tar_open_gz(gz_fd, index_path, 64 << 10);
+        tar_stats_snapshot(&stats);
+        failed += ar == NULL || (stats.ops[TAR_OP_OPEN].headers == 0) != round;
+        failed += ar == NULL || check_samples(ar) != 0;
+        tar_close(ar);
+    }
+    tar_stats_enable(0);
+    failed += access(index_path, F_OK) != 0;
+
+    close(gz_fd);
+    close(fd);
+    remove_tree(root);
+    return failed;
+}
+
+/**
+ * Reads the sample archive through io_uring: a check, an index, plain reads and a batch of reads of every file. The
+ * test passes without checking anything where io_uring is not available.
+ *
+ * @return the number of checks that failed.
+ */
+int test_io_uring(void) {
+    if (tar_set_io_engine(TAR_IO_URING) == -1) {
+        printf("test_io_uring: io_uring is not available, skipped\n");
+        return 0;
+    }
+    char root[] = "/tmp/lib_tar_testXXXXXX";
+    if (mkdtemp(root) == NULL) {
+        tar_set_io_engine(TAR_IO_DEFAULT);
+        return 1;
+    }
+    static uint8_t expected[NO_SAMPLES][1 << 20], bufs[NO_SAMPLES][1 << 20];
+    int fd = sample_archive(root);
+    tar_stats_enable(1);
+    tar_stats_reset();
+    int failed = fd == -1 || check_archive(fd) != 4;
+    tar_archive_t *ar = fd != -1 ? tar_open(fd) : NULL;
+    failed += ar == NULL || check_samples(ar) != 0;
+
+    // Each file read whole but the first byte, in a single batch
+    tar_read_req_t reqs[NO_SAMPLES];
+    for (int i = 0; i < NO_SAMPLES; i++) {
+        sample_data(expected[i], sample_sizes[i], i);
+        reqs[i] = (tar_read_req_t) { sample_names[i], 1, bufs[i], sizeof(bufs[i]), 0 };
+    }
+    failed += ar == NULL || tar_read_batch(ar, reqs, NO_SAMPLES) != NO_SAMPLES;
+    for (int i = 0; ar != NULL && i < NO_SAMPLES; i++) {
+        failed += reqs[i].ret != 0 || reqs[i].len != sample_sizes[i] - 1
+                  || memcmp(bufs[i], expected[i] + 1, reqs[i].len) != 0;
+    }
+    tar_stats_t stats;
+    tar_stats_snapshot(&stats);
+    tar_stats_enable(0);
+    // The walk of the check and the batch went through the ring
+    failed += (stats.ops[TAR_OP_CHECK].ring_reads == 0) + (stats.ops[TAR_OP_READ].ring_reads == 0);
+
+    tar_set_io_engine(TAR_IO_DEFAULT);
+    tar_close(ar);
+    close(fd);
+    remove_tree(root);
+    return failed;
+}
+
+/**
+ * Writes the sample files with tar_writer, along with a symlink and a file whose name does not fit the ustar fields,
+ * then reads the archive back and compares the data and the attributes of each entry with the source.
+ *
+ * @return the number of checks that failed.
+ */
+int test_writer(void) {
+    char root[] = "/tmp/lib_tar_testXXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+    int sample = sample_archive(root);
+    close(sample);
+    char src[64], path[512], name[300];
+    snprintf(src, sizeof(src), "%s/src", root);
+    memset(name, 'l', 250);
+    name[250] = '\0';
+    snprintf(path, sizeof(path), "%s/%s", src, name);
+    int failed = sample == -1 || write_file(path, "long", 4, 0600) == -1;
+    snprintf(path, sizeof(path), "%s/link", src);
+    failed += symlink("dir/mid.bin", path) == -1;
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 1000000000, 0 } };
+    snprintf(path, sizeof(path), "%s/big.bin", src);
+    failed += utimensat(AT_FDCWD, path, times, 0) == -1;
+
+    const char *const entries[][2] = { { "big.bin", "big.bin" }, { "dir", "dir" },
+                                       { "dir/small.txt", "dir/small.txt" }, { "dir/mid.bin", "dir/mid.bin" },
+                                       { name, name }, { "link", "link" } };
+    int fd = failed ? -1 : write_archive(src, entries, 6);
+    tar_archive_t *ar = fd != -1 ? tar_open(fd) : NULL;
+    failed += ar == NULL || check_archive(fd) < 6 || check_samples(ar) != 0;
+
+    const tar_entry_t *entry = ar != NULL ? tar_lookup(ar, name) : NULL;
+    uint8_t buf[8];
+    size_t len = sizeof(buf);
+    failed += entry == NULL || entry->typeflag != REGTYPE || entry->mode != 0600 || entry->size != 4;
+    failed += ar == NULL || tar_read_file(ar, name, 0, buf, &len) != 0 || len != 4 || memcmp(buf, "long", 4) != 0;
+    entry = ar != NULL ? tar_lookup(ar, "link") : NULL;
+    failed += entry == NULL || entry->typeflag != SYMTYPE || strcmp(entry->linkname, "dir/mid.bin") != 0;
+    entry = ar != NULL ? tar_resolve(ar, "link") : NULL;
+    failed += entry == NULL || strcmp(entry->name, "dir/mid.bin") != 0;
+    entry = ar != NULL ? tar_lookup(ar, "dir/") : NULL;
+    failed += entry == NULL || entry->typeflag != DIRTYPE || entry->offset < 0;
+    entry = ar != NULL ? tar_lookup(ar, "big.bin") : NULL;
+    failed += entry == NULL || entry->mtime != 1000000000 || entry->mode != 0644 || entry->uid != getuid();
+
+    tar_close(ar);
+    if (fd != -1) {
+        close(fd);
+    }
+    remove_tree(root);
+    return failed;
+}
+
+struct pipe_writer_args {
+    const char *src;
+    int fd;
+    int failed;
+};
+
+/* Writes the sample files to a pipe with tar_writer, then closes it */
+void *pipe_writer(void *arg) {
+    struct pipe_writer_args *args = arg;
+    char path[128];
+    tar_writer_t *writer = tar_writer_open(args->fd, 2);
+    for (int i = 0; writer != NULL && i < NO_SAMPLES; i++) {
+        snprintf(path, sizeof(path), "%s/%s", args->src, sample_names[i]);
+        args->failed += tar_writer_add(writer, path, sample_names[i]) != 0;
+    }
+    args->failed += writer == NULL || tar_writer_close(writer) != 0;
+    close(args->fd);
+    return NULL;
+}
+
+/**
+ * Streams the sample files from a pipe fed by tar_writer in another thread. The first file is only read in part,
+ * so that the rest of its data is skipped by reading, a pipe being unseekable, and the others are read whole.
+ *
+ * @return the number of checks that failed.
+ */
+int test_stream_pipe(void) {
+    char root[] = "/tmp/lib_tar_testXXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+    static uint8_t expected[1 << 20], buf[1 << 20];
+    char src[64];
+    snprintf(src, sizeof(src), "%s/src", root);
+    int sample = sample_archive(root);
+    int pipe_fds[2];
+    if (sample == -1 || pipe(pipe_fds) == -1) {
+        remove_tree(root);
+        return 1;
+    }
+    close(sample);
+    struct pipe_writer_args args = { src, pipe_fds[1], 0 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, pipe_writer, &args);
+
+    tar_stream_t *stream = tar_stream_open(pipe_fds[0]);
+    tar_entry_t entry;
+    int failed = stream == NULL, no_entries = 0, ret = -1;
+    while (stream != NULL && (ret = tar_stream_next(stream, &entry)) == 1) {
+        int i = no_entries++;
+        if (i >= NO_SAMPLES || strcmp(entry.name, sample_names[i]) != 0 || entry.size != sample_sizes[i]) {
+            failed++;
+            continue;
+        }
+        sample_data(expected, sample_sizes[i], i);
+        size_t want = i == 0 ? 1000 : sample_sizes[i], got = 0;
+        ssize_t n;
+        // Small reads, each one cut at the end of the entry
+        while (got < want && (n = tar_stream_read(stream, buf + got, want - got < 4096 ? want - got : 4096)) > 0) {
+            got += n;
+        }
+        failed += got != want || memcmp(buf, expected, want) != 0;
+    }
+    failed += stream == NULL || ret != 0 || no_entries != NO_SAMPLES;
+    tar_stream_close(stream);
+    pthread_join(thread, NULL);
+    failed += args.failed;
+
+    close(pipe_fds[0]);
+    remove_tree(root);
+    return failed;
+}
+
+/**
+ * Writes symlinks of every kind next to the sample files: relative, absolute, through a parent, chained, dangling,
+ * escaping the archive and in cycles, then follows them with tar_resolve() and read_file(). A crafted archive
+ * checks hard links the same way, a symlink to a hard link included.
+ *
+ * @return the number of checks that failed.
+ */
+int test_links(void) {
+    char root[] = "/tmp/lib_tar_testXXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+    char src[64], path[128];
+    snprintf(src, sizeof(src), "%s/src", root);
+    int sample = sample_archive(root);
+    int failed = sample == -1;
+    close(sample);
+    // Link, target and the entry it resolves to, NULL when it does not resolve
+    const char *const links[][3] = { { "rel", "dir/mid.bin", "dir/mid.bin" }, { "dir/up", "../big.bin", "big.bin" },
+                                     { "abs", "/dir/small.txt", "dir/small.txt" }, { "chain", "rel", "dir/mid.bin" },
+                                     { "dirlink", "dir", "dir/" }, { "dangling", "nothing", NULL },
+                                     { "escape", "../../etc/passwd", NULL }, { "x", "y", NULL }, { "y", "x", NULL },
+                                     { "self", "self", NULL } };
+    size_t no_links = sizeof(links) / sizeof(links[0]);
+    const char *entries[16][2] = { { "big.bin", "big.bin" }, { "dir", "dir" }, { "dir/small.txt", "dir/small.txt" },
+                                   { "dir/mid.bin", "dir/mid.bin" } };
+    for (size_t i = 0; i < no_links; i++) {
+        snprintf(path, sizeof(path), "%s/%s", src, links[i][0]);
+        failed += symlink(links[i][1], path) == -1;
+        entries[4 + i][0] = entries[4 + i][1] = links[i][0];
+    }
+    int fd = failed ? -1 : write_archive(src, entries, 4 + no_links);
+    tar_archive_t *ar = fd != -1 ? tar_open(fd) : NULL;
+    failed += ar == NULL;
+
+    static uint8_t expected[1 << 20], buf[1 << 20];
+    sample_data(expected, sample_sizes[2], 2);
+    for (size_t i = 0; ar != NULL && i < no_links; i++) {
+        const tar_entry_t *entry = tar_resolve(ar, links[i][0]);
+        failed += links[i][2] == NULL ? entry != NULL : entry == NULL || strcmp(entry->name, links[i][2]) != 0;
+        failed += !is_symlink(fd, (char *) links[i][0]);
+    }
+    size_t len = sizeof(buf);
+    failed += read_file(fd, "chain", 0, buf, &len) != 0 || len != sample_sizes[2]
+              || memcmp(buf, expected, len) != 0;
+    len = sizeof(buf);
+    failed += read_file(fd, "x", 0, buf, &len) != -1 || read_file(fd, "dangling", 0, buf, &len) != -1;
+    tar_close(ar);
+    if (fd != -1) {
+        close(fd);
+    }
+
+    // A file, a hard link to it, a hard link to that link and a symlink to the first hard link
+    uint8_t archive[7 * 512];
+    const char *const hard[][3] = { { "h1", "f" }, { "h2", "h1" }, { "s", "h1" } };
+    memset(archive, 0, sizeof(archive));
+    fill_header(archive, "f", REGTYPE, 3);
+    memcpy(archive + 512, "abc", 3);
+    for (int i = 0; i < 3; i++) {
+        uint8_t *block = archive + (i + 2) * 512;
+        fill_header(block, hard[i][0], i < 2 ? LNKTYPE : SYMTYPE, 0);
+        strcpy(((tar_header_t *) block)->linkname, hard[i][1]);
+        seal_header(block);
+    }
+    fd = temp_file(archive, sizeof(archive));
+    ar = tar_open(fd);
+    for (int i = 0; i < 3; i++) {
+        const tar_entry_t *entry = ar != NULL ? tar_resolve(ar, hard[i][0]) : NULL;
+        len = sizeof(buf);
+        failed += entry == NULL || strcmp(entry->name, "f") != 0;
+        failed += read_file(fd, (char *) hard[i][0], 0, buf, &len) != 0 || len != 3 || memcmp(buf, "abc", 3) != 0;
+    }
+    tar_close(ar);
+    close(fd);
+    remove_tree(root);
+    return failed;
+}
+
+/* Queries the archive by pages of page entries and tells whether the names found are the expected ones */
+int query_pages(const tar_archive_t *ar, const char *pattern, int flags, size_t page, const char *const *expected,
+                size_t no_expected) {
+    const tar_entry_t *entries[16];
+    tar_list_cursor_t cursor = {0};
+    size_t found = 0;
+    int ok = 1;
+    do {
+        size_t no_entries = page;
+        ok &= tar_query(ar, pattern, flags, &cursor, entries, &no_entries) == 0 && no_entries <= page;
+        for (size_t i = 0; ok && i < no_entries; i++, found++) {
+            ok &= found < no_expected && strcmp(entries[i]->name, expected[found]) == 0;
+        }
+    } while (ok && !cursor.done);
+    return ok && found == no_expected;
+}
+
+/**
+ * Queries the archive with globs, with and without wildcards matching slashes, and with prefixes that must not reach
+ * past their bounds, by pages of every size. A query matching nothing must be done at once.
+ *
+ * @return the number of checks that failed.
+ */
+int test_query(int fd) {
+    const char *const sources[] = { "test/folder1/hello.c", "test/folder1/lignthing/inside_inside.c", "test/tests.c" };
+    const char *const folder[] = { "test/folder1/", "test/folder1/file1.py", "test/folder1/hello.c",
+                                   "test/folder1/lignthing/", "test/folder1/lignthing/inside_inside.c" };
+    const char *const all[] = { "test/S1_exo6", "test/folder1/", "test/folder1/file1.py", "test/folder1/hello.c",
+                                "test/folder1/lignthing/", "test/folder1/lignthing/inside_inside.c", "test/tests",
+                                "test/tests.c" };
+    tar_archive_t *ar = tar_open(fd);
+    int failed = ar == NULL;
+    for (size_t page = 1; ar != NULL && page <= 8; page++) {
+        failed += !query_pages(ar, "test/*.c", 0, page, sources, 3);
+        failed += !query_pages(ar, "test/*.c", TAR_QUERY_PATHNAME, page, sources + 2, 1);
+        failed += !query_pages(ar, "test/folder1/", TAR_QUERY_PREFIX, page, folder, 5);
+        failed += !query_pages(ar, "test/folder1/lignthing", TAR_QUERY_PREFIX, page, folder + 3, 2);
+        failed += !query_pages(ar, "test/?*", 0, page, all, 8);
+    }
+    const tar_entry_t *entries[4];
+    tar_list_cursor_t cursor = {0};
+    size_t no_entries = 4;
+    failed += ar == NULL || tar_query(ar, "test/folder1/*.h", 0, &cursor, entries, &no_entries) != 0
+              || no_entries != 0 || !cursor.done;
+    no_entries = 4;
+    failed += ar == NULL || tar_query(ar, "test/folder2", TAR_QUERY_PREFIX, NULL, entries, &no_entries) != 0
+              || no_entries != 0;
+    tar_close(ar);
+    return failed;
+}
+
+/**
+ * Writes the manifest of an archive of files with known digests, the check value of CRC-32C and the test vectors
+ * of SHA-256, the last one spanning many blocks, and a file of 9 MiB whose CRC-32C alone is computed in 3 pieces,
+ * and compares it with the expected one, with both digests, with SHA-256 alone and with CRC-32C alone.
+ *
+ * @return the number of manifests that differ from the expected ones.
+ */
+int test_digest(void) {
+    static uint8_t archive[11 << 20];
+    static char manifest[1024];
+    const char *const names[] = { "check", "empty", "abc", "million", "big" };
+    const char *const contents[] = { "123456789", "", "abc", NULL, NULL };
+    const char *const expected[] = {
+        "e3069283 15e2b0d3c33891ebb0f1ef609ec419420c20e320ce94c65fbc8c3312448eb225  check\n"
+        "00000000 e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855  empty\n"
+        "364b3fb7 ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad  abc\n"
+        "436fe240 cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0  million\n"
+        "9472472d 980cc6e13b89bc9bfada6d66b2b5f0be05fadaea6468998a8fd65f7b34fffd2b  big\n",
+        "15e2b0d3c33891ebb0f1ef609ec419420c20e320ce94c65fbc8c3312448eb225  check\n"
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855  empty\n"
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad  abc\n"
+        "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0  million\n"
+        "980cc6e13b89bc9bfada6d66b2b5f0be05fadaea6468998a8fd65f7b34fffd2b  big\n",
+        "e3069283  check\n"
+        "00000000  empty\n"
+        "364b3fb7  abc\n"
+        "436fe240  million\n"
+        "9472472d  big\n"
+    };
+    memset(archive, 0, sizeof(archive));
+    size_t offset = 0;
+    for (int i = 0; i < 5; i++) {
+        size_t size = contents[i] != NULL ? strlen(contents[i]) : i == 3 ? 1000000 : (9 << 20) + 1000;
+        fill_header(archive + offset, names[i], REGTYPE, size);
+        if (contents[i] != NULL) {
+            memcpy(archive + offset + 512, contents[i], size);
+        } else if (i == 3) {
+            memset(archive + offset + 512, 'a', size);
+        } else {
+            for (size_t j = 0; j < size; j++) {
+                archive[offset + 512 + j] = j % 251;
+            }
+        }
+        offset += 512 + (size + 511) / 512 * 512;
+    }
+
+    int fd = temp_file(archive, sizeof(archive));
+    tar_archive_t *ar = tar_open(fd);
+    int failed = ar == NULL;
+    const int digests[] = { TAR_DIGEST_CRC32C | TAR_DIGEST_SHA256, TAR_DIGEST_SHA256, TAR_DIGEST_CRC32C };
+    for (int i = 0; ar != NULL && i < 3; i++) {
+        int out = temp_file(NULL, 0);
+        memset(manifest, 0, sizeof(manifest));
+        failed += tar_digest(ar, digests[i], 2, out) != 0;
+        failed += pread(out, manifest, sizeof(manifest) - 1, 0) < 0 || strcmp(manifest, expected[i]) != 0;
+        close(out);
+    }
+    tar_close(ar);
+    close(fd);
+    return failed;
+}
+
+/**
+ * Merges three shards into a catalog that keeps a single fd open, so that reads alternating between them close and
+ * reopen shards. The path found in two shards must come from the last one, and the directories of the shards are
+ * merged. Once a shard file is replaced, its files can no longer be read while the others still can.
+ *
+ * @return the number of checks that failed.
+ */
+int test_catalog(void) {
+    char root[] = "/tmp/lib_tar_testXXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+    const char *const shard0[][2] = { { "a/one", "111" }, { "common", "old" } };
+    const char *const shard1[][2] = { { "b/two", "2222" }, { "common", "new!" } };
+    const char *const shard2[][2] = { { "a/three", "3" } };
+    uint8_t archive[8 * 512];
+    char paths[3][64];
+    const char *shards[3];
+    int failed = 0;
+    for (int i = 0; i < 3; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/shard%d.tar", root, i);
+        shards[i] = paths[i];
+    }
+    failed += write_file(paths[0], archive, craft_archive(archive, shard0, 2), 0644) == -1;
+    failed += write_file(paths[1], archive, craft_archive(archive, shard1, 2), 0644) == -1;
+    failed += write_file(paths[2], archive, craft_archive(archive, shard2, 1), 0644) == -1;
+
+    tar_catalog_t *cat = failed ? NULL : tar_catalog_open(shards, 3, 1);
+    failed += cat == NULL;
+    const char *const reads[][2] = { { "a/one", "111" }, { "b/two", "2222" }, { "a/three", "3" },
+                                     { "common", "new!" } };
+    uint8_t buf[16];
+    for (int round = 0; cat != NULL && round < 3; round++) {
+        for (int i = 0; i < 4; i++) {
+            size_t len = sizeof(buf);
+            failed += tar_catalog_read_file(cat, reads[i][0], 0, buf, &len) != 0 || len != strlen(reads[i][1])
+                      || memcmp(buf, reads[i][1], len) != 0;
+        }
+    }
+    const char *shard = NULL;
+    failed += cat == NULL || tar_catalog_lookup(cat, "common", &shard) == NULL || shard == NULL
+              || strcmp(shard, paths[1]) != 0;
+    char names[4][TAR_PATH_MAX];
+    char *entries[4] = { names[0], names[1], names[2], names[3] };
+    size_t no_entries = 4;
+    failed += cat == NULL || !tar_catalog_list(cat, "a/", entries, &no_entries) || no_entries != 2;
+
+    // The replaced shard is reopened after another one took its fd, and found changed
+    char other[80];
+    snprintf(other, sizeof(other), "%s/replacement", root);
+    const char *const replaced[][2] = { { "a/one", "999999" } };
+    failed += write_file(other, archive, craft_archive(archive, replaced, 1), 0644) == -1 || rename(other, paths[0]);
+    for (int i = 0; cat != NULL && i < 2; i++) {
+        size_t len = sizeof(buf);
+        ssize_t ret = tar_catalog_read_file(cat, reads[1 - i][0], 0, buf, &len);
+        failed += i == 0 ? ret != 0 || memcmp(buf, "2222", 4) != 0 : ret >= 0;
+    }
+    tar_catalog_close(cat);
+    remove_tree(root);
+    return failed;
+}
+
+/* Appends a PAX record to dest, with the length prefix that counts itself, and returns its length */
+size_t pax_record(char *dest, const char *key, const char *value) {
+    size_t len = strlen(key) + strlen(value) + 3;
+    size_t total = len + 1;
+    while (total != len + (size_t) snprintf(NULL, 0, "%zu", total)) {
+        total = len + snprintf(NULL, 0, "%zu", total);
+    }
+    return sprintf(dest, "%zu %s=%s\n", total, key, value);
+}
+
+/**
+ * Reads and extracts a sparse file of 100000 bytes with two runs of data, "HELLO" at 10000 and "END" at its very
+ * end, stored in the old GNU format and in format 1.0 of PAX. Reads of the holes must return zeros, reads across the
+ * edge of a run both, and the extracted files the same bytes.
+ *
+ * @return the number of checks that failed.
+ */
+int test_sparse(void) {
+    char root[] = "/tmp/lib_tar_testXXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+    static uint8_t expected[100000], buf[100000];
+    memset(expected, 0, sizeof(expected));
+    memcpy(expected + 10000, "HELLO", 5);
+    memcpy(expected + 99997, "END", 3);
+
+    // Old GNU: the map in the header, then the runs back to back
+    uint8_t archive[8 * 512];
+    memset(archive, 0, sizeof(archive));
+    fill_header(archive, "old", GNUTYPE_SPARSE, 8);
+    char *block = (char *) archive;
+    memcpy(((tar_header_t *) archive)->magic, "ustar  ", 8);
+    sprintf(block + 386, "%011o", 10000);
+    sprintf(block + 398, "%011o", 5);
+    sprintf(block + 410, "%011o", 99997);
+    sprintf(block + 422, "%011o", 3);
+    sprintf(block + 483, "%011o", 100000);
+    seal_header(archive);
+    memcpy(archive + 512, "HELLOEND", 8);
+    int fds[2];
+    fds[0] = temp_file(archive, 4 * 512);
+
+    // PAX 1.0: the real name and size in the extended header, the map in the first block of the data
+    memset(archive, 0, sizeof(archive));
+    char *records = (char *) archive + 512;
+    size_t len = pax_record(records, "GNU.sparse.major", "1");
+    len += pax_record(records + len, "GNU.sparse.minor", "0");
+    len += pax_record(records + len, "GNU.sparse.name", "pax");
+    len += pax_record(records + len, "GNU.sparse.realsize", "100000");
+    fill_header(archive, "PaxHeaders/pax", XHDTYPE, len);
+    fill_header(archive + 1024, "GNUSparseFile.0/pax", REGTYPE, 512 + 8);
+    strcpy((char *) archive + 1536, "2\n10000\n5\n99997\n3\n");
+    memcpy(archive + 2048, "HELLOEND", 8);
+    fds[1] = temp_file(archive, sizeof(archive));
+
+    const char *const names[] = { "old", "pax" };
+    int failed = 0;
+    for (int i = 0; i < 2; i++) {
+        tar_archive_t *ar = tar_open(fds[i]);
+        const tar_entry_t *entry = ar != NULL ? tar_lookup(ar, names[i]) : NULL;
+        failed += entry == NULL || entry->size != sizeof(expected);
+        // The whole file, a hole alone and the start of the first run with the hole before it
+        const size_t ranges[][2] = { { 0, sizeof(buf) }, { 50000, 100 }, { 9998, 10 }, { 99990, 10 } };
+        for (int j = 0; ar != NULL && j < 4; j++) {
+            size_t n = ranges[j][1];
+            memset(buf, 0xff, n);
+            failed += tar_read_file(ar, names[i], ranges[j][0], buf, &n) < 0 || n != ranges[j][1]
+                      || memcmp(buf, expected + ranges[j][0], n) != 0;
+        }
+        char dest[64], path[128];
+        snprintf(dest, sizeof(dest), "%s/%s", root, names[i]);
+        snprintf(path, sizeof(path), "%s/%s", dest, names[i]);
+        failed += ar == NULL || mkdir(dest, 0755) == -1 || tar_extract(ar, dest, NULL, 1) != 0
+                  || !same_file(path, expected, sizeof(expected));
+        tar_close(ar);
+        close(fds[i]);
+    }
+    remove_tree(root);
+    return failed;
+}
+
+/* A server run by run_server(), and what tar_server_run() returned */
+struct server_args {
+    tar_server_t *server;
+    int ret;
+};
+
+void *run_server(void *arg) {
+    struct server_args *args = arg;
+    args->ret = tar_server_run(args->server);
+    return NULL;
+}
+
+/* A lookup made by run_client_exists() in a thread of its own, and what it returned */
+struct client_args {
+    tar_client_t *client;
+    const char *archive;
+    int ret;
+};
+
+void *run_client_exists(void *arg) {
+    struct client_args *args = arg;
+    __atomic_store_n(&args->ret, tar_client_exists(args->client, args->archive, "dir/mid.bin"), __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+/* Returns the lowest fd free, which tells whether a function left an fd open */
+int lowest_free_fd(void) {
+    int fd = dup(0);
+    close(fd);
+    return fd;
+}
+
+/**
+ * Serves the sample archive, plain and compressed, and reads it back through a client: lookups, a listing and reads
+ * of every file, whole and in part, whose bytes come through the fd of the plain archive and in the replies for the
+ * compressed one. A server given a file too short to be an archive must fail without leaving an fd open, and a
+ * path too long must fail without cutting the connection of the client. Limited to one connection, the server must
+ * keep a second client waiting until the first one is closed.
+ *
+ * @return the number of checks that failed.
+ */
+int test_server(void) {
+    char root[] = "/tmp/lib_tar_testXXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+    static uint8_t archive[2 << 20], expected[1 << 20], buf[1 << 20];
+    char plain[64], compressed[64], tiny[64], socket_path[64];
+    snprintf(plain, sizeof(plain), "%s/sample.tar", root);
+    snprintf(compressed, sizeof(compressed), "%s/sample.tar.gz", root);
+    snprintf(tiny, sizeof(tiny), "%s/tiny", root);
+    snprintf(socket_path, sizeof(socket_path), "%s/socket", root);
+    int fd = sample_archive(root);
+    ssize_t len = fd != -1 ? pread(fd, archive, sizeof(archive), 0) : -1;
+    close(fd);
+    gzFile gz = gzopen(compressed, "wb");
+    int failed = len <= 0 || write_file(plain, archive, len, 0644) == -1;
+    failed += gz == NULL || gzwrite(gz, archive, len) != len;
+    failed += gz == NULL || gzclose(gz) != Z_OK;
+    failed += write_file(tiny, "x", 1, 0644) == -1;
+
+    const char *const bad[] = { plain, tiny };
+    int free_fd = lowest_free_fd();
+    failed += tar_server_open(socket_path, bad, 2) != NULL || lowest_free_fd() != free_fd;
+
+
+    const char *const paths[] = { plain, compressed };
+    struct server_args args = { failed ? NULL : tar_server_open(socket_path, paths, 2), -1 };
+    pthread_t thread;
+    if (args.server == NULL) {
+        remove_tree(root);
+        return failed + 1;
+    }
+    failed += tar_server_set_max_conns(args.server, 0) != -1 || tar_server_set_max_conns(args.server, 1) != 0;
+    pthread_create(&thread, NULL, run_server, &args);
+    tar_client_t *client = tar_client_open(socket_path);
+    failed += client == NULL;
+    for (int i = 0; client != NULL && i < 2; i++) {
+        failed += tar_client_exists(client, paths[i], "dir/mid.bin") <= 0;
+        failed += tar_client_exists(client, paths[i], "no") != 0;
+        char names[4][TAR_PATH_MAX];
+        char *entries[4] = { names[0], names[1], names[2], names[3] };
+        size_t no_entries = 4;
+        failed += tar_client_list(client, paths[i], "dir/", entries, &no_entries) <= 0 || no_entries != 2;
+        for (int j = 0; j < NO_SAMPLES; j++) {
+            size_t size = sample_sizes[j], n = sizeof(buf);
+            sample_data(expected, size, j);
+            failed += tar_client_read_file(client, paths[i], sample_names[j], 0, buf, &n) != 0 || n != size
+                      || memcmp(buf, expected, size) != 0;
+            n = 3;
+            failed += tar_client_read_file(client, paths[i], sample_names[j], size / 2, buf, &n) < 0 || n != 3
+                      || memcmp(buf, expected + size / 2, 3) != 0;
+        }
+    }
+    size_t n = sizeof(buf);
+    failed += client == NULL || tar_client_read_file(client, tiny, "big.bin", 0, buf, &n) != -3;
+
+    // A path too long is refused by the client, which stays connected
+    static char long_path[TAR_PATH_MAX + 2];
+    memset(long_path, 'a', TAR_PATH_MAX + 1);
+    n = sizeof(buf);
+    failed += client == NULL || tar_client_exists(client, plain, long_path) != -1;
+    failed += client == NULL || tar_client_read_file(client, long_path, "big.bin", 0, buf, &n) != -3;
+    failed += client == NULL || tar_client_exists(client, plain, "dir/mid.bin") <= 0;
+
+    // Limited to one connection, the server serves a second client only once the first one is closed
+    struct client_args waiting = { tar_client_open(socket_path), plain, -2 };
+    pthread_t waiter;
+    failed += waiting.client == NULL;
+    if (waiting.client != NULL) {
+        pthread_create(&waiter, NULL, run_client_exists, &waiting);
+        struct timespec pause = { 0, 100000000 };
+        nanosleep(&pause, NULL);
+        failed += __atomic_load_n(&waiting.ret, __ATOMIC_SEQ_CST) != -2;
+    }
+    tar_client_close(client);
+    if (waiting.client != NULL) {
+        pthread_join(waiter, NULL);
+        failed += waiting.ret <= 0;
+    }
+    tar_client_close(waiting.client);
+
+    tar_server_stop(args.server);
+    pthread_join(thread, NULL);
+    failed += args.ret != 0;
+    tar_server_close(args.server);
+    remove_tree(root);
+    return failed;
+}
+
+/**
+ * Reads the sample archive as the shard of a catalog through a block cache of 4 blocks of 16 KiB. Reads of 4 KiB
+ * going forward miss once per block and hit the other times, the first blocks being evicted once the cache is
+ * full. Once the shard is rewritten in place with a new mtime, a new catalog on it must miss and read the new bytes
+ * rather than the blocks cached for the old file.
+ *
+ * @return the number of checks that failed.
+ */
+int test_cache(void) {
+    char root[] = "/tmp/lib_tar_testXXXXXX";
+    if (mkdtemp(root) == NULL) {
+        return 1;
+    }
+    static uint8_t archive[2 << 20], expected[1 << 20], buf[4096];
+    char shard[64];
+    snprintf(shard, sizeof(shard), "%s/shard.tar", root);
+    const char *const shards[] = { shard };
+    int fd = sample_archive(root);
+    ssize_t len = fd != -1 ? pread(fd, archive, sizeof(archive), 0) : -1;
+    close(fd);
+    int failed = len <= 0 || write_file(shard, archive, len, 0644) == -1 || tar_cache_enable(64 << 10) == -1;
+    sample_data(expected, sample_sizes[0], 0);
+
+    tar_cache_stats_t before, after;
+    tar_catalog_t *cat = failed ? NULL : tar_catalog_open(shards, 1, 1);
+    failed += cat == NULL;
+    tar_cache_stats(&before);
+    for (size_t offset = 0; cat != NULL && offset < 128 << 10; offset += sizeof(buf)) {
+        size_t n = sizeof(buf);
+        failed += tar_catalog_read_file(cat, "big.bin", offset, buf, &n) < 0 || memcmp(buf, expected + offset, n);
+    }
+    tar_cache_stats(&after);
+    // 32 reads over 9 blocks, the data of the file not starting on a block, 8 of them across the edge of two blocks
+    // and counted for both, and the first 5 blocks evicted
+    failed += after.misses - before.misses != 9 || after.hits - before.hits != 31;
+    failed += after.evictions - before.evictions != 5 || after.bytes_cached != 64 << 10;
+
+    // The first block was evicted, the last two are still there
+    size_t n = sizeof(buf);
+    tar_cache_stats(&before);
+    failed += cat == NULL || tar_catalog_read_file(cat, "big.bin", 0, buf, &n) < 0 || memcmp(buf, expected, n);
+    n = sizeof(buf);
+    failed += cat == NULL || tar_catalog_read_file(cat, "big.bin", (128 << 10) - 4096, buf, &n) < 0;
+    tar_cache_stats(&after);
+    failed += after.misses - before.misses != 1 || after.hits - before.hits != 2;
+    const tar_entry_t *entry = cat != NULL ? tar_catalog_lookup(cat, "big.bin", NULL) : NULL;
+    off_t data = entry != NULL ? entry->offset + 512 : 512;
+    tar_catalog_close(cat);
+
+    // Same inode, other bytes and mtime
+    archive[data + 100] ^= 0xff;
+    expected[100] ^= 0xff;
+    int shard_fd = open(shard, O_WRONLY);
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 1000000000, 0 } };
+    failed += shard_fd == -1 || pwrite(shard_fd, archive, len, 0) != len || futimens(shard_fd, times) == -1;
+    close(shard_fd);
+    cat = tar_catalog_open(shards, 1, 1);
+    n = sizeof(buf);
+    tar_cache_stats(&before);
+    failed += cat == NULL || tar_catalog_read_file(cat, "big.bin", 0, buf, &n) < 0 || memcmp(buf, expected, n);
+    tar_cache_stats(&after);
+    failed += after.misses - before.misses != 1 || after.hits != before.hits;
+    tar_catalog_close(cat);
+
+    tar_cache_enable(0);
+    remove_tree(root);
+    return failed;
+}
+
 int main(int argc, char **argv) {
     //uint8_t dest;
     //size_t len = 512;
@@ -64,23 +1577,157 @@ int main(int argc, char **argv) {
     ret = exists(fd, "lib_tar.c");
     printf("exists returned %d\n", ret);*/
 
-    size_t n = 50;
-    size_t *no_entries = &n;
-    char **entries = (char**) malloc(n);
-    int i = 0;
-    while(i<n){
-        entries[i] = (char*) malloc(sizeof(char));
-        i++;
+    int ret;
+
+    ret = test_no_allocs(fd);
+    printf("test_no_allocs returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_concurrent_reads(fd, "test/tests.c");
+    printf("test_concurrent_reads returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_map_file(fd);
+    printf("test_map_file returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_member(fd);
+    printf("test_member returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_lookup_batch(fd);
+    printf("test_lookup_batch returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_list_ex(fd);
+    printf("test_list_ex returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_stats(fd);
+    printf("test_stats returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_query(fd);
+    printf("test_query returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_gz();
+    printf("test_gz returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_io_uring();
+    printf("test_io_uring returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_writer();
+    printf("test_writer returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_extract();
+    printf("test_extract returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_stream_pipe();
+    printf("test_stream_pipe returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_links();
+    printf("test_links returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_digest();
+    printf("test_digest returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_catalog();
+    printf("test_catalog returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_two_fds(fd);
+    printf("test_two_fds returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_sparse();
+    printf("test_sparse returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_server();
+    printf("test_server returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_cache();
+    printf("test_cache returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_truncated_pax();
+    printf("test_truncated_pax returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_gnu_check();
+    printf("test_gnu_check returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_send_file(fd, "test/tests.c");
+    printf("test_send_file returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = test_check_kernels(fd);
+    printf("test_check_kernels returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
     }
 
-    int ret = list(fd,"S1_exo6",entries,no_entries);
-    printf("list returned %d\n", ret);
-    i = 0;
-    while(i<n){
-        printf("%s\n", entries[i]);
-        i++;
+    ret = test_corrupted_header(fd);
+    printf("test_corrupted_header returned %d\n", ret);
+    if (ret != 0) {
+        return 1;
     }
-    free(entries);
 
     //ret = read_file(fd, "lib_tar.c", 50, dest, &len);
     //printf("read_file returned %d\n", ret);